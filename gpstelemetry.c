@@ -19,10 +19,19 @@ Place - Suite 330, Boston, MA 02111-1307, USA.
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdint.h>
 #include <time.h>
 #include <stdbool.h>
 #include <math.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <fcntl.h>
 
 #include "./gpmf-parser/GPMF_parser.h"
 #include "./gpmf-parser/demo/GPMF_mp4reader.h"
@@ -41,304 +50,8650 @@ static const char *const column_names[] =
 	"fix","precision",
 };
 
-static const int gps9_indexes[] =
+/* output columns a GPS stream's fields can be decoded into */
+typedef enum
 {
-	0, /* lat */
-	1, /* long */
-	2, /* alt */
-	3, /* 2D speed */
-	4, /* 3D speed */
-	8, /* fix */
-	7, /* precision */
+	COL_LAT,
+	COL_LON,
+	COL_ALT,
+	COL_SPEED2D,
+	COL_SPEED3D,
+	COL_DAYS, /* days since 2000 */
+	COL_SECS, /* seconds since midnight */
+	COL_DOP,
+	COL_FIX,
+	COL_COUNT
+} gps_column;
+
+/* field layouts to fall back on when a stream's STNM and UNIT don't say which field is which */
+static const int8_t gps5_layout[] = { COL_LAT, COL_LON, COL_ALT, COL_SPEED2D, COL_SPEED3D };
+static const int8_t gps9_layout[] = { COL_LAT, COL_LON, COL_ALT, COL_SPEED2D, COL_SPEED3D, COL_DAYS, COL_SECS, COL_DOP, COL_FIX };
+
+#define PLAN_MAX_FIELDS 32
+#define PLAN_CACHE_SIZE 4
+
+typedef struct plan_field
+{
+	uint16_t offset; /* byte offset within the sample */
+	uint8_t column;  /* gps_column */
+	char type;       /* GPMF type of the field */
+	double scale;    /* the stream's SCAL for this field */
+} plan_field;
+
+/*
+precompiled decoding of one stream, built once from its TYPE, SCAL, STNM and UNIT
+fields are grouped by type so that the per-sample loop never has to interpret types
+*/
+typedef struct decode_plan
+{
+	uint32_t key;
+	uint64_t signature; /* hash of the metadata the plan was built from; a change means a rebuild */
+	uint32_t structsize; /* 0 if the stream can't be decoded */
+	uint32_t int32_count, uint16_count, other_count;
+	plan_field int32[PLAN_MAX_FIELDS];
+	plan_field uint16[PLAN_MAX_FIELDS];
+	plan_field other[PLAN_MAX_FIELDS];
+} decode_plan;
+
+enum { META_TYPE, META_SCAL, META_STNM, META_UNIT, META_COUNT };
+
+/* metadata KLVs of the stream being walked, pointing into the payload */
+typedef struct stream_meta
+{
+	const uint8_t *data[META_COUNT]; /* NULL if the stream doesn't have it */
+	char type[META_COUNT];
+	uint32_t structsize[META_COUNT];
+	uint32_t repeat[META_COUNT];
+} stream_meta;
+
+/* one decoded GPS fix, as it will be written out */
+typedef struct gps_sample
+{
+	double cts;          /* seconds since the start of the file the sample came from */
+	time_t time;         /* second-accurate standard format compatible with time.h routines */
+	double milliseconds; /* sub-second quantity to add to the above time_t data */
+	double lat, lon, alt, speed2d, speed3d;
+	double fix, precision;
+	bool gps9;           /* GPS9 rows print fix and precision as scaled values */
+	bool accl;           /* an accelerometer reading: only cts and accel are set */
+	bool filtered;       /* failed --min_fix or --max_precision, passed on only for outage detection */
+	double accel[3];     /* m/s^2, in the camera's axes */
+} gps_sample;
+
+#define GPS5_RATE 18.0      /* Hz, nominal */
+#define GPS5_RATE_WINDOW 16 /* GPSU intervals the GPS5 sample period is fitted over */
+
+/*
+GPS5 sample times: a line fitted through the last GPS5_RATE_WINDOW GPSU times against the number of samples
+before each, which smooths both the jitter in GPSU and the sample rate; the MP4 payload duration stands in
+for the rate until there are two
+*/
+typedef struct gps5_clock
+{
+	int64_t utc[GPS5_RATE_WINDOW];    /* GPSU times in milliseconds since 1970... */
+	uint64_t index[GPS5_RATE_WINDOW]; /* ...and the GPS5 samples before each */
+	uint32_t next, used;
+	uint64_t samples;                 /* GPS5 samples so far */
+	uint64_t at;                      /* ...as of the last GPSU */
+	double base, period;              /* the fitted time of that sample, and milliseconds per sample (0 if unknown) */
+} gps5_clock;
+
+/* the part of the decoder state that a sequential run carries from one file into the next */
+typedef struct carried_state
+{
+	bool use_gps9;
+	uint32_t fix;
+	uint16_t precision;
+} carried_state;
+
+/* decoder state that carries over from one payload (and one file) to the next */
+typedef struct decode_state
+{
+	bool use_gps9;
+	uint32_t fix;       /* data from "GPSF" */
+	uint16_t precision; /* data from "GPSP" */
+	gps5_clock gps5;    /* from "GPSU" */
+	bool gps9_anchored;      /* the file has had a GPS9 sample with a time of its own */
+	int64_t gps9_anchor;     /* the last such time, in milliseconds since 1970 */
+	double gps9_anchor_cts;  /* and when it was in the file */
+	decode_plan plans[PLAN_CACHE_SIZE];
+	uint32_t plan_count;
+	double *rows; /* decoded columns of the stream being processed */
+	uint32_t rows_size;
+} decode_state;
+
+typedef struct decode_options
+{
+	int min_fix; /* -1 means no filtering */
+	int max_precision; /* -1 means no filtering */
+	time_t gps9_epoch;
+	bool full_moov; /* index the file with gpmf-parser's reader rather than our lean one */
+	bool safe;         /* validate every payload and never fall back to gpmf-parser's MP4 reader */
+	size_t max_alloc;  /* largest buffer a file may need, 0 means no limit */
+	uint32_t max_klv;  /* most KLVs walked per payload, 0 means no limit */
+	double cpu_limit;  /* CPU seconds a file may use, 0 means no limit */
+	bool accl;         /* pass ACCL readings to the sink as well */
+	bool keep_filtered; /* pass samples the filters reject to the sink too, marked as filtered */
+} decode_options;
+
+/* decoded samples of one payload, queued between a decoder thread and the writer */
+typedef struct sample_batch
+{
+	struct sample_batch *next;
+	uint32_t count;
+	size_t bytes;
+	gps_sample samples[];
+} sample_batch;
+
+typedef enum
+{
+	JOB_PENDING,
+	JOB_OPEN_FAILED,
+	JOB_NO_DURATION,
+	JOB_RUNNING,
+	JOB_FINISHED,
+} job_state;
+
+/* one input file */
+typedef struct file_job
+{
+	char *path;
+	const char *display_name;
+	job_state state;
+	GPMF_ERR ret;
+	const char *abort_reason; /* why a --safe limit stopped the file, NULL otherwise */
+	double file_finish;
+	uint32_t first_payload, end_payload; /* decode only payloads first_payload up to end_payload, if end_payload is set */
+	bool continues;           /* the next job is the rest of the same file */
+	uint64_t cost;            /* bytes of GPMF payloads, from the sample table */
+	uint32_t payload_count;   /* in the above range of the sample table */
+	bool placed;              /* placed_at is where the file starts on the stitched timeline, known before decoding */
+	double placed_at;
+	uint32_t payloads;
+	uint64_t payload_bytes;
+	uint64_t samples;
+	carried_state carry;        /* what a sequential run would start the job with, once carry_known */
+	bool carry_known;
+	sample_batch *first, *last; /* decoded batches the writer hasn't got to yet (parallel mode only) */
+	size_t queued;              /* bytes held in the above */
+} file_job;
+
+/* where decode_file() sends its output; any callback may be NULL */
+typedef struct sample_sink
+{
+	void (*opened)(void *ctx, file_job *job);
+	void (*sample)(void *ctx, file_job *job, const gps_sample *s);
+	void (*payload_done)(void *ctx, file_job *job);
+	void (*closed)(void *ctx, file_job *job); /* after the last payload of a file that was opened */
+} sample_sink;
+
+typedef enum
+{
+	SEGMENT_NONE,
+	SEGMENT_MOVING,
+	SEGMENT_STOPPED,
+	SEGMENT_OUTAGE,
+} segment_type;
+
+typedef struct segment_point
+{
+	const file_job *job;
+	double t;            /* seconds along the stitched timeline */
+	time_t time;
+	double milliseconds;
+	double lat, lon;
+	bool located;        /* false until the first fix of the recording */
+} segment_point;
+
+/* the open segment of --segments output; constant size however long the recording */
+typedef struct segmenter
+{
+	segment_type type;
+	segment_point start, last; /* for an outage, "last" keeps the position of the last good fix */
+	double distance;           /* metres covered since "start" */
+	bool pending;              /* a change to the other of moving/stopped is waiting out its dwell */
+	segment_point pending_start;
+	double pending_distance;   /* "distance" when the pending change began */
+} segmenter;
+
+typedef enum
+{
+	EVENT_BRAKING,
+	EVENT_ACCELERATION,
+	EVENT_CORNERING,
+	EVENT_SPEEDING,
+	EVENT_HARSH_MOTION,
+	EVENT_KINDS,
+} event_kind;
+
+typedef struct history_sample
+{
+	double t, speed, lat, lon;
+} history_sample;
+
+typedef struct event_record
+{
+	event_kind kind;
+	const file_job *job;
+	double start, end;       /* seconds along the stitched timeline */
+	time_t time;             /* UTC of the start */
+	double milliseconds;
+	double peak;
+	double lat, lon;         /* where the peak was */
+	bool located;
+	double min_speed, max_speed; /* over the event and its context */
+} event_record;
+
+/* state of --events detectors: bounded by the window and context lengths, not the recording */
+typedef struct event_state
+{
+	double threshold[EVENT_KINDS]; /* 0 disables a detector */
+	double context;                /* seconds of context either side of an event */
+	history_sample *history;       /* ring of recent fixes */
+	uint32_t first, count, size;
+	bool active[EVENT_KINDS];
+	event_record open[EVENT_KINDS];
+	event_record *pending;         /* finished events waiting for their trailing context */
+	uint32_t pending_count, pending_size;
+	segment_point last;            /* latest fix */
+	bool accl_started;
+	double accl_t;
+	double gravity[3];
+	double accl_level;
+	bool failed;                   /* an event or fix was lost for want of memory */
+} event_state;
+
+/* an equirectangular plane in metres around an origin, for geometry over a few tens of kilometres */
+typedef struct local_plane
+{
+	double lat0, lon0;
+	double scale;          /* metres per degree of longitude at the origin, 0 until it is set */
+} local_plane;
+
+#define REF_NAME_SIZE 64
+
+typedef struct ref_gate
+{
+	char name[REF_NAME_SIZE];
+	double ax, ay, bx, by; /* ends, in metres on the local plane */
+	int direction;         /* the side it is crossed from, 0 until the first crossing */
+	double last;           /* timeline seconds of the last crossing counted */
+	uint32_t seen;         /* step that last tested this gate */
+} ref_gate;
+
+typedef struct ref_route
+{
+	uint32_t first, count; /* vertices in reference_set.points */
+	double width;          /* metres the track may stray either side */
+} ref_route;
+
+typedef struct ref_crossing
+{
+	segment_point p;
+	double distance;       /* metres travelled along the track */
+} ref_crossing;
+
+typedef struct ref_timer
+{
+	char name[REF_NAME_SIZE];
+	bool lap;              /* timed between successive crossings of "from" */
+	uint32_t from, to;     /* gates */
+	int32_t route;         /* route to stay on in between, or -1 */
+	uint32_t count;        /* laps or runs completed */
+	bool running;
+	ref_crossing start;
+} ref_timer;
+
+/* a gate, or a route edge widened by the route's width, filed under one cell of the index */
+typedef struct ref_item
+{
+	int64_t cell;
+	bool edge;
+	uint32_t index;        /* the gate, or the first vertex of the edge */
+	uint32_t route;
+} ref_item;
+
+typedef struct ref_hit
+{
+	uint32_t gate;
+	double u;              /* how far along the step the gate was crossed */
+	int side;
+} ref_hit;
+
+/* --segments_ref: reference gates and routes, and the timers running against them */
+typedef struct reference_set
+{
+	local_plane plane;
+	ref_gate *gates;
+	uint32_t gate_count, gate_size;
+	ref_route *routes;
+	uint32_t route_count, route_size;
+	double (*points)[2];
+	uint32_t point_count, point_size;
+	ref_timer *timers;
+	uint32_t timer_count, timer_size;
+	ref_item *items;       /* sorted by cell */
+	uint32_t item_count, item_size;
+	ref_hit *hits;
+	uint32_t hit_size;
+	bool started;
+	segment_point last;    /* previous fix */
+	double x, y;           /* where it is on the plane */
+	double distance;
+	uint32_t step;
+} reference_set;
+
+#define MATCH_CANDIDATES 8  /* road positions considered for each fix */
+#define MATCH_LAG 32        /* fixes held back before one is decided */
+
+typedef struct road_node
+{
+	int64_t id;
+	double x, y;
+	uint32_t first, count; /* its edges, in road_graph.adjacent */
+} road_node;
+
+typedef struct road_edge
+{
+	uint32_t a, b;         /* nodes */
+	int64_t way;
+	double length;
+} road_edge;
+
+typedef struct road_way
+{
+	int64_t id;
+	uint32_t first, count; /* node ids in road_graph.refs */
+} road_way;
+
+typedef struct road_item
+{
+	int64_t cell;
+	uint32_t edge;
+} road_item;
+
+typedef struct road_heap_entry
+{
+	double dist;
+	uint32_t node;
+} road_heap_entry;
+
+/* --match: a road network, indexed by grid cell */
+typedef struct road_graph
+{
+	local_plane plane;
+	road_node *nodes;      /* sorted by id */
+	uint32_t node_count, node_size;
+	road_edge *edges;
+	uint32_t edge_count, edge_size;
+	uint32_t *adjacent;
+	road_way *ways;
+	uint32_t way_count, way_size;
+	int64_t *refs;
+	uint32_t ref_count, ref_size;
+	road_item *items;      /* sorted by cell */
+	uint32_t item_count, item_size;
+	uint32_t *edge_seen;   /* search that last looked at each edge */
+	uint32_t search;
+	double *dist;          /* shortest path scratch, INFINITY when untouched */
+	uint32_t *touched;
+	uint32_t touched_count;
+	road_heap_entry *heap;
+	uint32_t heap_count, heap_size;
+} road_graph;
+
+typedef struct match_candidate
+{
+	uint32_t edge;
+	double f;              /* how far along the edge, 0 at a and 1 at b */
+	double x, y;
+	double offset;         /* metres from the fix */
+	double score;          /* log likelihood of the best path ending here */
+	uint32_t back;         /* candidate of the previous fix on that path */
+} match_candidate;
+
+typedef struct match_step
+{
+	segment_point p;
+	double x, y;
+	uint32_t count, choice;
+	match_candidate candidates[MATCH_CANDIDATES];
+} match_step;
+
+typedef struct map_matcher
+{
+	road_graph graph;
+	match_step steps[MATCH_LAG + 1]; /* ring of the fixes not yet decided */
+	uint32_t first, count;
+} map_matcher;
+
+/* --every_distance: where along the track the next sample falls */
+typedef struct resampler
+{
+	bool started;
+	segment_point last;    /* previous fix */
+	double alt;            /* and its altitude */
+	double distance;       /* metres along the track to it */
+	double next;           /* metres along the track of the next sample */
+} resampler;
+
+/* --where: the GPS columns a query may test, which the zone maps also cover */
+#define ZONE_COLUMNS 7
+#define WHERE_MAX_TERMS 16
+
+static const char *const zone_names[ZONE_COLUMNS] = { "lat", "lon", "alt", "speed2d", "speed3d", "fix", "precision" };
+
+typedef enum where_op
+{
+	WHERE_LT,
+	WHERE_LE,
+	WHERE_EQ,
+	WHERE_GE,
+	WHERE_GT,
+} where_op;
+
+typedef struct where_term
+{
+	uint32_t column;       /* of zone_names */
+	where_op op;
+	double value;
+} where_term;
+
+/* all of the terms must hold */
+typedef struct where_filter
+{
+	where_term terms[WHERE_MAX_TERMS];
+	uint32_t count;
+} where_filter;
+
+/* a sample's values in zone_names order, fix and precision as printed */
+static void sample_columns(const gps_sample *s, double *v)
+{
+	v[0] = s->lat;
+	v[1] = s->lon;
+	v[2] = s->alt;
+	v[3] = s->speed2d;
+	v[4] = s->speed3d;
+	v[5] = s->fix;
+	v[6] = s->precision;
+}
+
+static bool where_holds(const where_term *t, double v)
+{
+	switch (t->op)
+	{
+	case WHERE_LT: return v < t->value;
+	case WHERE_LE: return v <= t->value;
+	case WHERE_EQ: return v == t->value;
+	case WHERE_GE: return v >= t->value;
+	case WHERE_GT: return v > t->value;
+	}
+	return false;
+}
+
+static bool where_sample(const where_filter *w, const gps_sample *s)
+{
+	double v[ZONE_COLUMNS];
+
+	sample_columns(s, v);
+	for (uint32_t i = 0; i < w->count; i++)
+		if (!where_holds(&w->terms[i], v[w->terms[i].column])) return false;
+	return true;
+}
+
+/* "speed2d>35,fix>=3": terms joined by commas, each a column, one of < <= = >= > and a number */
+static bool where_parse(const char *str, where_filter *w)
+{
+	memset(w, 0, sizeof(*w));
+
+	while (*str)
+	{
+		size_t len = strcspn(str, "<>=,");
+		uint32_t column = ZONE_COLUMNS;
+		char *end;
+
+		for (uint32_t c = 0; c < ZONE_COLUMNS; c++)
+			if (strlen(zone_names[c]) == len && !strncmp(str, zone_names[c], len)) column = c;
+		if (ZONE_COLUMNS == column || WHERE_MAX_TERMS == w->count) return false;
+
+		where_term *t = &w->terms[w->count++];
+		t->column = column;
+		str += len;
+		if (!strncmp(str, "<=", 2)) t->op = WHERE_LE;
+		else if (!strncmp(str, ">=", 2)) t->op = WHERE_GE;
+		else if ('<' == *str) t->op = WHERE_LT;
+		else if ('>' == *str) t->op = WHERE_GT;
+		else if ('=' == *str) t->op = WHERE_EQ;
+		else return false;
+		str += ('=' == str[1] && '=' != str[0]) ? 2 : 1;
+
+		t->value = strtod(str, &end);
+		if (end == str || (*end && ',' != *end)) return false;
+		str = *end ? end + 1 : end;
+	}
+	return w->count > 0;
+}
+
+/* --replay */
+typedef struct replayer
+{
+	double speed;           /* 2.0 replays twice as fast as recorded */
+	bool binary;            /* binary records instead of NMEA */
+	int fd;
+	bool failed;            /* a write failed, which has been reported */
+	bool started;
+	double first;           /* stitched time of the first sample sent */
+	struct timespec clock0; /* when it was sent */
+	bool have_last;
+	history_sample last;    /* fix the course is measured from */
+	double course;          /* degrees true */
+} replayer;
+
+typedef struct output_options
+{
+	bool print_filename;
+	bool print_filepath;
+	bool header_printed;
+	double file_start; /* where the current file begins on the stitched timeline */
+	bool segments;     /* print one row per stop, moving segment or outage instead of every sample */
+	double stop_speed; /* m/s below which the camera is stopped */
+	double stop_dwell; /* seconds below stop_speed before a stop begins */
+	segmenter seg;
+	event_state *ev;   /* print harsh driving events instead of samples, if set */
+	reference_set *refs; /* print laps and segments timed against these instead of samples, if set */
+	map_matcher *matcher; /* print samples snapped to its roads, if set */
+	double every_distance; /* print samples this many metres apart along the track instead, if set */
+	resampler rs;
+	double part_finish; /* latest fix so far of a file that is being written in parts */
+	const where_filter *where; /* print only the samples matching it, if set */
+	replayer *replay;  /* send samples in real time instead, if set */
+} output_options;
+
+/* per-thread context of the parallel decoders */
+typedef struct decode_worker
+{
+	pthread_t thread;
+	const decode_options *opt;
+	gps_sample *scratch; /* samples of the payload being decoded */
+	uint32_t scratch_count, scratch_size;
+} decode_worker;
+
+/*
+everything shared between decoder threads and the writer lives here, guarded by a single lock
+"cond" is broadcast whenever memory is released, a batch is queued or a job changes state
+*/
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_mutex_t carry_lock; /* held while working out jobs' carried state, which reads files */
+	size_t mem_limit; /* 0 means no limit */
+	size_t mem_used;  /* bytes held in payload buffers, decode buffers and queued batches */
+	size_t mem_peak;
+	file_job *jobs;
+	uint32_t job_count;
+	uint32_t next_job; /* next file for a decoder thread to pick up */
+	uint32_t head;     /* file the writer is currently draining */
+	bool abort;
+} pipeline = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER };
+
+/*
+take "bytes" out of the memory budget, blocking until enough has been released
+the file being written is exempt once its own queue has drained, as the writer could otherwise wait on it forever;
+so is a lookup's own job outside the pipeline (--at), and the job find_utc() makes the head, as nothing else runs
+*/
+static void mem_acquire(file_job *job, size_t bytes)
+{
+	pthread_mutex_lock(&pipeline.lock);
+	while (pipeline.mem_limit && pipeline.mem_used && pipeline.mem_used + bytes > pipeline.mem_limit && !pipeline.abort)
+	{
+		bool pipelined = job >= pipeline.jobs && job < pipeline.jobs + pipeline.job_count;
+		if ((!pipelined || job == &pipeline.jobs[pipeline.head]) && !job->queued) break;
+		pthread_cond_wait(&pipeline.cond, &pipeline.lock);
+	}
+	pipeline.mem_used += bytes;
+	if (pipeline.mem_used > pipeline.mem_peak) pipeline.mem_peak = pipeline.mem_used;
+	pthread_mutex_unlock(&pipeline.lock);
+}
+
+/*
+count "bytes" more of the data a mode keeps until it is done, "*kept" being what it has already counted; false,
+counting nothing, if the kept data alone would exceed the budget (the decoders' own buffers come and go, so they
+are left out of that test and simply wait for the kept data to be released)
+*/
+static bool mem_keep(size_t *kept, size_t bytes)
+{
+	pthread_mutex_lock(&pipeline.lock);
+	bool fits = !pipeline.mem_limit || (*kept <= pipeline.mem_limit && bytes <= pipeline.mem_limit - *kept);
+	if (fits)
+	{
+		*kept += bytes;
+		pipeline.mem_used += bytes;
+		if (pipeline.mem_used > pipeline.mem_peak) pipeline.mem_peak = pipeline.mem_used;
+	}
+	pthread_mutex_unlock(&pipeline.lock);
+	return fits;
+}
+
+static void mem_release(size_t bytes)
+{
+	pthread_mutex_lock(&pipeline.lock);
+	pipeline.mem_used -= bytes;
+	pthread_cond_broadcast(&pipeline.cond);
+	pthread_mutex_unlock(&pipeline.lock);
+}
+
+/* give back "bytes" counted by mem_keep() */
+static void mem_unkeep(size_t *kept, size_t bytes)
+{
+	pthread_mutex_lock(&pipeline.lock);
+	*kept -= bytes;
+	pipeline.mem_used -= bytes;
+	pthread_cond_broadcast(&pipeline.cond);
+	pthread_mutex_unlock(&pipeline.lock);
+}
+
+static void job_update(file_job *job, job_state state)
+{
+	pthread_mutex_lock(&pipeline.lock);
+	job->state = state;
+	pthread_cond_broadcast(&pipeline.cond);
+	pthread_mutex_unlock(&pipeline.lock);
+}
+
+static bool pipeline_aborted(void)
+{
+	pthread_mutex_lock(&pipeline.lock);
+	bool aborted = pipeline.abort;
+	pthread_mutex_unlock(&pipeline.lock);
+	return aborted;
+}
+
+/* match "--name" or "--name=" (spelt with underscores, though dashes are accepted too); returns what follows the name */
+static const char *match_option(const char *arg, const char *name)
+{
+	size_t i;
+	for (i = 0; name[i]; i++)
+	{
+		char c = arg[i];
+		if (c == '-' && i > 1) c = '_';
+		if (c != name[i]) return NULL;
+	}
+	if (name[i - 1] != '=' && arg[i] != '\0') return NULL;
+	return arg + i;
+}
+
+/* parse a byte count with an optional K, M or G suffix */
+static size_t parse_size(const char *str)
+{
+	char *end;
+	double value = strtod(str, &end);
+	switch (*end)
+	{
+	case 'g': case 'G': value *= 1024.0; /* fall through */
+	case 'm': case 'M': value *= 1024.0; /* fall through */
+	case 'k': case 'K': value *= 1024.0; break;
+	}
+	return (value > 0.0) ? (size_t)value : 0;
+}
+
+/* multiply sizes, failing rather than wrapping around */
+static bool checked_size(size_t a, size_t b, size_t *result)
+{
+	if (b && a > SIZE_MAX / b) return false;
+	*result = a * b;
+	return true;
+}
+
+static double seconds_since(clockid_t clock, const struct timespec *then)
+{
+	struct timespec now;
+	clock_gettime(clock, &now);
+	return (now.tv_sec - then->tv_sec) + (now.tv_nsec - then->tv_nsec) / 1e9;
+}
+
+static uint32_t be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t be64(const uint8_t *p)
+{
+	return ((uint64_t)be32(p) << 32) | be32(p + 4);
+}
+
+/*
+lean MP4 reader
+OpenMP4Source() indexes every track in the moov; for long 4K recordings the video and audio sample tables
+hold hundreds of thousands of entries we never use, so instead we walk the box tree, seek past every trak
+whose handler isn't "meta", and only load the sample tables of the GPMF ("gpmd") track
+*/
+typedef struct mp4_box
+{
+	uint32_t type;
+	uint64_t head;  /* first byte of the box header */
+	uint64_t start; /* first byte after the box header */
+	uint64_t end;   /* first byte after the box */
+} mp4_box;
+
+typedef struct gpmf_track
+{
+	FILE *fp;
+	uint32_t movie_timescale; /* from "mvhd" */
+	uint32_t timescale;       /* from the GPMF track's "mdhd" */
+	uint64_t duration;        /* in timescale units */
+	double edit_offset;       /* seconds the track is shifted by its edit list */
+	uint32_t count;           /* number of payloads */
+	uint32_t *sizes;          /* "stsz" */
+	uint64_t *offsets;        /* file offset of each payload, resolved through "stsc" and "stco"/"co64" */
+	uint64_t stts_total;      /* sum of all sample durations in "stts" */
+	uint64_t table_limit;     /* largest sample table we are prepared to load */
+	uint32_t boxes_left;      /* bounds the walk of files made of endless tiny boxes */
+	mp4_box moov, trak;       /* where the GPMF track was found */
+} gpmf_track;
+
+/* read the header of the box at *pos, which must lie within "end", and advance *pos past it */
+static bool next_box(gpmf_track *t, uint64_t *pos, uint64_t end, mp4_box *box)
+{
+	FILE *fp = t->fp;
+	uint8_t header[16];
+	uint32_t headersize = 8;
+
+	if (*pos + 8 > end || !t->boxes_left) return false;
+	t->boxes_left--;
+	if (fseeko(fp, (off_t)*pos, SEEK_SET) != 0 || fread(header, 1, 8, fp) != 8) return false;
+
+	uint64_t size = be32(header);
+	if (size == 1)
+	{
+		if (fread(header + 8, 1, 8, fp) != 8) return false;
+		size = be64(header + 8);
+		headersize = 16;
+	}
+	else if (size == 0)
+	{
+		size = end - *pos; /* the box runs to the end of its parent */
+	}
+
+	if (size < headersize || size > end - *pos) return false;
+
+	box->type = MAKEID(header[4], header[5], header[6], header[7]);
+	box->head = *pos;
+	box->start = *pos + headersize;
+	box->end = *pos + size;
+	*pos = box->end;
+	return true;
+}
+
+/* load a whole (small) box body; NULL if it is larger than "limit" */
+static uint8_t *read_box(FILE *fp, const mp4_box *box, uint64_t limit, uint32_t *length)
+{
+	uint64_t size = box->end - box->start;
+	if (size > limit) return NULL;
+
+	uint8_t *body = malloc(size ? size : 1);
+	if (!body) return NULL;
+
+	if (fseeko(fp, (off_t)box->start, SEEK_SET) != 0 || fread(body, 1, size, fp) != size)
+	{
+		free(body);
+		return NULL;
+	}
+	*length = (uint32_t)size;
+	return body;
+}
+
+#define MP4_TABLE_LIMIT (256u * 1024u * 1024u)
+#define MP4_BOX_LIMIT 100000
+
+static bool parse_gpmf_stbl(gpmf_track *t, const mp4_box *stbl)
+{
+	uint8_t *stsc = NULL, *chunks = NULL;
+	uint32_t stsc_length = 0, chunks_length = 0;
+	bool co64 = false, gpmd = false;
+	uint64_t pos = stbl->start;
+	mp4_box box;
+
+	while (next_box(t, &pos, stbl->end, &box))
+	{
+		uint8_t *body;
+		uint32_t length;
+
+		switch (box.type)
+		{
+		case MAKEID('s','t','s','d'):
+			if ((body = read_box(t->fp, &box, 4096, &length)))
+			{
+				/* version/flags, entry count, then the first sample entry's size and format */
+				gpmd = (length >= 16) && (MAKEID(body[12], body[13], body[14], body[15]) == MOV_GPMF_TRAK_SUBTYPE);
+				free(body);
+			}
+			if (!gpmd) goto fail;
+			break;
+
+		case MAKEID('s','t','t','s'):
+			if ((body = read_box(t->fp, &box, t->table_limit, &length)))
+			{
+				uint32_t entries = (length >= 8) ? be32(body + 4) : 0;
+				if (entries > (length - 8) / 8) entries = (length - 8) / 8;
+				for (uint32_t i = 0; i < entries; i++)
+					t->stts_total += (uint64_t)be32(body + 8 + 8 * i) * be32(body + 12 + 8 * i);
+				free(body);
+			}
+			break;
+
+		case MAKEID('s','t','s','z'):
+			if ((body = read_box(t->fp, &box, t->table_limit, &length)) && length >= 12)
+			{
+				uint32_t fixed = be32(body + 4);
+				uint32_t count = be32(body + 8);
+				if (!fixed && count > (length - 12) / 4) count = (length - 12) / 4;
+				if (count > t->table_limit / (sizeof(uint32_t) + sizeof(uint64_t))) count = 0;
+				t->sizes = malloc(count * sizeof(uint32_t) + 1);
+				if (t->sizes)
+				{
+					for (uint32_t i = 0; i < count; i++)
+						t->sizes[i] = fixed ? fixed : be32(body + 12 + 4 * i);
+					t->count = count;
+				}
+			}
+			free(body);
+			break;
+
+		case MAKEID('s','t','s','c'):
+			free(stsc);
+			stsc = read_box(t->fp, &box, t->table_limit, &stsc_length);
+			break;
+
+		case MAKEID('c','o','6','4'):
+		case MAKEID('s','t','c','o'):
+			free(chunks);
+			chunks = read_box(t->fp, &box, t->table_limit, &chunks_length);
+			co64 = (box.type == MAKEID('c','o','6','4'));
+			break;
+		}
+	}
+
+	if (!gpmd || !t->sizes || !chunks || chunks_length < 8) goto fail;
+
+	uint32_t chunk_count = be32(chunks + 4);
+	uint32_t chunk_size = co64 ? 8 : 4;
+	if (chunk_count > (chunks_length - 8) / chunk_size) chunk_count = (chunks_length - 8) / chunk_size;
+
+	uint32_t stsc_count = (stsc && stsc_length >= 8) ? be32(stsc + 4) : 0;
+	if (stsc_count > (stsc_length - 8) / 12) stsc_count = (stsc_length - 8) / 12;
+
+	t->offsets = malloc(t->count * sizeof(uint64_t) + 1);
+	if (!t->offsets) goto fail;
+
+	/* resolve each payload's file offset from the chunk offsets and the sample-to-chunk table */
+	uint32_t sample = 0;
+	for (uint32_t entry = 0; entry < (stsc_count ? stsc_count : 1) && sample < t->count; entry++)
+	{
+		uint32_t first = stsc_count ? be32(stsc + 8 + 12 * entry) : 1;
+		uint32_t last = (entry + 1 < stsc_count) ? be32(stsc + 8 + 12 * (entry + 1)) : chunk_count + 1;
+		uint32_t per_chunk = stsc_count ? be32(stsc + 12 + 12 * entry) : 1;
+
+		for (uint32_t chunk = first; chunk < last && chunk >= 1 && chunk <= chunk_count && sample < t->count; chunk++)
+		{
+			const uint8_t *entry_ptr = chunks + 8 + (size_t)chunk_size * (chunk - 1);
+			uint64_t offset = co64 ? be64(entry_ptr) : be32(entry_ptr);
+			for (uint32_t i = 0; i < per_chunk && sample < t->count; i++)
+			{
+				t->offsets[sample] = offset;
+				offset += t->sizes[sample++];
+			}
+		}
+	}
+	t->count = sample;
+
+	free(stsc);
+	free(chunks);
+	return t->count > 0;
+
+fail:
+	free(stsc);
+	free(chunks);
+	free(t->sizes);
+	free(t->offsets);
+	t->sizes = NULL;
+	t->offsets = NULL;
+	t->count = 0;
+	t->stts_total = 0;
+	return false;
+}
+
+static bool parse_gpmf_trak(gpmf_track *t, const mp4_box *trak)
+{
+	uint64_t pos = trak->start, mdia_pos;
+	mp4_box box, minf = { 0 }, stbl;
+	bool meta = false, have_minf = false;
+	uint8_t *body;
+	uint32_t length;
+
+	t->edit_offset = 0.0;
+	t->timescale = 0;
+	t->duration = 0;
+
+	while (next_box(t, &pos, trak->end, &box))
+	{
+		if (box.type == MAKEID('e','d','t','s'))
+		{
+			uint64_t edts_pos = box.start;
+			mp4_box elst;
+			while (next_box(t, &edts_pos, box.end, &elst))
+			{
+				if (elst.type != MAKEID('e','l','s','t') || !(body = read_box(t->fp, &elst, 4096, &length))) continue;
+
+				/* empty edits delay the start of the track */
+				bool v1 = length && body[0] == 1;
+				uint32_t entry_size = v1 ? 20 : 12;
+				uint32_t entries = (length >= 8) ? be32(body + 4) : 0;
+				for (uint32_t i = 0; i < entries && 8 + (i + 1) * entry_size <= length; i++)
+				{
+					const uint8_t *e = body + 8 + i * entry_size;
+					uint64_t segment = v1 ? be64(e) : be32(e);
+					int64_t media_time = v1 ? (int64_t)be64(e + 8) : (int32_t)be32(e + 4);
+					if (media_time == -1 && t->movie_timescale)
+						t->edit_offset += (double)segment / t->movie_timescale;
+				}
+				free(body);
+			}
+		}
+		else if (box.type == MAKEID('m','d','i','a'))
+		{
+			mp4_box mdia = box;
+			mdia_pos = mdia.start;
+			while (next_box(t, &mdia_pos, mdia.end, &box))
+			{
+				if (box.type == MAKEID('m','d','h','d') && (body = read_box(t->fp, &box, 4096, &length)))
+				{
+					if (length >= 24 && body[0] == 0)
+					{
+						t->timescale = be32(body + 12);
+						t->duration = be32(body + 16);
+					}
+					else if (length >= 32 && body[0] == 1)
+					{
+						t->timescale = be32(body + 20);
+						t->duration = be64(body + 24);
+					}
+					free(body);
+				}
+				else if (box.type == MAKEID('h','d','l','r') && (body = read_box(t->fp, &box, 4096, &length)))
+				{
+					meta = (length >= 12) && (MAKEID(body[8], body[9], body[10], body[11]) == MOV_GPMF_TRAK_TYPE);
+					free(body);
+					if (!meta) return false; /* not a metadata track, skip it without touching its tables */
+				}
+				else if (box.type == MAKEID('m','i','n','f'))
+				{
+					minf = box;
+					have_minf = true;
+				}
+			}
+		}
+	}
+
+	if (!meta || !have_minf || !t->timescale) return false;
+
+	pos = minf.start;
+	while (next_box(t, &pos, minf.end, &stbl))
+		if (stbl.type == MAKEID('s','t','b','l'))
+			return parse_gpmf_stbl(t, &stbl);
+
+	return false;
+}
+
+static void close_gpmf_track(gpmf_track *t)
+{
+	if (!t) return;
+	if (t->fp) fclose(t->fp);
+	free(t->sizes);
+	free(t->offsets);
+	free(t);
+}
+
+static gpmf_track *open_gpmf_track(const char *path, uint64_t table_limit)
+{
+	gpmf_track *t = calloc(1, sizeof(gpmf_track));
+	if (!t) return NULL;
+
+	t->table_limit = table_limit;
+	t->boxes_left = MP4_BOX_LIMIT;
+
+	t->fp = fopen(path, "rb");
+	if (!t->fp || fseeko(t->fp, 0, SEEK_END) != 0)
+	{
+		close_gpmf_track(t);
+		return NULL;
+	}
+
+	uint64_t filesize = (uint64_t)ftello(t->fp), pos = 0;
+	mp4_box box;
+
+	/* skip straight over "mdat" and friends to the "moov" */
+	while (next_box(t, &pos, filesize, &box))
+	{
+		if (box.type != MAKEID('m','o','o','v')) continue;
+
+		uint64_t moov_pos = box.start;
+		mp4_box child;
+		while (next_box(t, &moov_pos, box.end, &child))
+		{
+			uint8_t *body;
+			uint32_t length;
+
+			if (child.type == MAKEID('m','v','h','d') && (body = read_box(t->fp, &child, 4096, &length)))
+			{
+				if (length >= 20) t->movie_timescale = be32(body + ((body[0] == 1) ? 20 : 12));
+				free(body);
+			}
+			else if (child.type == MAKEID('t','r','a','k') && parse_gpmf_trak(t, &child))
+			{
+				t->moov = box;
+				t->trak = child;
+				return t;
+			}
+		}
+		break;
+	}
+
+	close_gpmf_track(t);
+	return NULL;
+}
+
+/* a GPMF payload source; either our lean track index or, as a fallback, gpmf-parser's own MP4 reader */
+typedef struct gpmf_source
+{
+	gpmf_track *track;
+	size_t mp4handle;
+	size_t payloadres;
+	uint32_t *buffer; /* payload buffer for the lean reader */
+	uint32_t buffer_size;
+} gpmf_source;
+
+static bool source_open(gpmf_source *src, char *path, const decode_options *opt)
+{
+	uint64_t table_limit = (opt->max_alloc && opt->max_alloc < MP4_TABLE_LIMIT) ? opt->max_alloc : MP4_TABLE_LIMIT;
+
+	memset(src, 0, sizeof(*src));
+
+	if (!opt->full_moov && (src->track = open_gpmf_track(path, table_limit)))
+		return true;
+
+	/* gpmf-parser's reader loads every table of every track, whatever their size */
+	if (opt->safe) return false;
+
+	src->mp4handle = OpenMP4Source(path, MOV_GPMF_TRAK_TYPE, MOV_GPMF_TRAK_SUBTYPE, 0);
+	return src->mp4handle != 0;
+}
+
+static void source_close(gpmf_source *src)
+{
+	if (src->track)
+	{
+		close_gpmf_track(src->track);
+		free(src->buffer);
+	}
+	else if (src->mp4handle)
+	{
+		if (src->payloadres) FreePayloadResource(src->mp4handle, src->payloadres);
+		CloseSource(src->mp4handle);
+	}
+	memset(src, 0, sizeof(*src));
+}
+
+/* bytes held by the source's sample tables */
+static size_t source_table_size(const gpmf_source *src)
+{
+	return src->track ? src->track->count * (sizeof(uint32_t) + sizeof(uint64_t)) : 0;
+}
+
+static double source_duration(const gpmf_source *src)
+{
+	if (src->track)
+		return (double)src->track->duration / src->track->timescale;
+	return GetDuration(src->mp4handle);
+}
+
+static uint32_t source_payloads(const gpmf_source *src)
+{
+	return src->track ? src->track->count : GetNumberPayloads(src->mp4handle);
+}
+
+static uint32_t source_payload_size(const gpmf_source *src, uint32_t index)
+{
+	if (src->track)
+		return (index < src->track->count) ? src->track->sizes[index] : 0;
+	return GetPayloadSize(src->mp4handle, index);
+}
+
+static uint32_t *source_payload(gpmf_source *src, uint32_t index)
+{
+	uint32_t size = source_payload_size(src, index);
+
+	if (!src->track)
+	{
+		src->payloadres = GetPayloadResource(src->mp4handle, src->payloadres, size);
+		return GetPayload(src->mp4handle, src->payloadres, index);
+	}
+
+	if (index >= src->track->count) return NULL;
+
+	if (size > src->buffer_size || !src->buffer)
+	{
+		/* an empty payload still needs a buffer, and realloc() of 0 bytes may give none */
+		uint32_t *buffer = realloc(src->buffer, size ? ((size_t)size + 3) & ~(size_t)3 : 4);
+		if (!buffer) return NULL;
+		src->buffer = buffer;
+		src->buffer_size = size;
+	}
+
+	if (fseeko(src->track->fp, (off_t)src->track->offsets[index], SEEK_SET) != 0) return NULL;
+	if (fread(src->buffer, 1, size, src->track->fp) != size) return NULL;
+	return src->buffer;
+}
+
+/* same timing model as gpmf-parser: payloads of equal duration, clipped to the track length */
+static GPMF_ERR source_payload_time(const gpmf_source *src, uint32_t index, double *start, double *finish)
+{
+	const gpmf_track *t = src->track;
+
+	if (!t) return GetPayloadTime(src->mp4handle, index, start, finish);
+
+	if (!t->count || !t->stts_total || !t->timescale) return GPMF_ERROR_MEMORY;
+
+	double base = (double)t->stts_total / t->count;
+	double length = (double)t->duration / t->timescale;
+
+	*start = index * base / t->timescale;
+	*finish = (index + 1) * base / t->timescale;
+	if (*finish > length) *finish = length;
+
+	*start += t->edit_offset;
+	*finish += t->edit_offset;
+	return GPMF_OK;
+}
+
+static uint16_t be16(const uint8_t *p)
+{
+	return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+/* read one big-endian GPMF value of any numeric type */
+static double read_value(const uint8_t *p, char type)
+{
+	uint32_t u32;
+	uint64_t u64;
+	float f;
+	double d;
+
+	switch (type)
+	{
+	case GPMF_TYPE_SIGNED_BYTE: return (int8_t)p[0];
+	case GPMF_TYPE_UNSIGNED_BYTE: return p[0];
+	case GPMF_TYPE_SIGNED_SHORT: return (int16_t)be16(p);
+	case GPMF_TYPE_UNSIGNED_SHORT: return be16(p);
+	case GPMF_TYPE_SIGNED_LONG: return (int32_t)be32(p);
+	case GPMF_TYPE_UNSIGNED_LONG: return be32(p);
+	case GPMF_TYPE_SIGNED_64BIT_INT: return (double)(int64_t)be64(p);
+	case GPMF_TYPE_UNSIGNED_64BIT_INT: return (double)be64(p);
+	case GPMF_TYPE_Q15_16_FIXED_POINT: return (int32_t)be32(p) / 65536.0;
+	case GPMF_TYPE_Q31_32_FIXED_POINT: return (int64_t)be64(p) / 4294967296.0;
+	case GPMF_TYPE_FLOAT: u32 = be32(p); memcpy(&f, &u32, sizeof(f)); return f;
+	case GPMF_TYPE_DOUBLE: u64 = be64(p); memcpy(&d, &u64, sizeof(d)); return d;
+	}
+	return 0.0;
+}
+
+static void stream_meta_set(stream_meta *meta, int which, GPMF_stream *ms)
+{
+	meta->data[which] = GPMF_RawData(ms);
+	meta->type[which] = (char)GPMF_Type(ms);
+	meta->structsize[which] = GPMF_StructSize(ms);
+	meta->repeat[which] = GPMF_Repeat(ms);
+}
+
+static uint64_t stream_signature(uint32_t key, uint32_t structsize, const stream_meta *meta)
+{
+	uint64_t hash = 14695981039346656037ull; /* FNV-1a */
+
+	hash = (hash ^ key) * 1099511628211ull;
+	hash = (hash ^ structsize) * 1099511628211ull;
+	for (int m = 0; m < META_COUNT; m++)
+	{
+		if (!meta->data[m]) continue;
+		uint32_t length = meta->structsize[m] * meta->repeat[m];
+		hash = (hash ^ (uint8_t)meta->type[m]) * 1099511628211ull;
+		for (uint32_t i = 0; i < length; i++)
+			hash = (hash ^ meta->data[m][i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+/* expand a TYPE string such as "lllllllSS" or "f[4]" into one type per field */
+static uint32_t expand_type(const stream_meta *meta, char *types)
+{
+	const char *src = (const char *)meta->data[META_TYPE];
+	uint32_t length = meta->structsize[META_TYPE] * meta->repeat[META_TYPE];
+	uint32_t fields = 0;
+
+	for (uint32_t i = 0; i < length && src[i]; i++)
+	{
+		if (src[i] == '[')
+		{
+			uint32_t count = 0;
+			for (i++; i < length && src[i] >= '0' && src[i] <= '9'; i++)
+				count = 10 * count + (src[i] - '0');
+			if (!fields || !count || count > PLAN_MAX_FIELDS) return 0;
+			for (uint32_t c = 1; c < count; c++)
+			{
+				if (fields >= PLAN_MAX_FIELDS) return 0;
+				types[fields] = types[fields - 1];
+				fields++;
+			}
+		}
+		else
+		{
+			if (fields >= PLAN_MAX_FIELDS) return 0;
+			types[fields++] = src[i];
+		}
+	}
+	return fields;
+}
+
+/*
+split STNM or UNIT into one lower-case name per field
+they come either as one string per field (e.g. UNIT 'c' 3 5), or as a single string such as "GPS (Lat., Long., Alt., 2D, 3D)"
+*/
+static uint32_t split_names(const stream_meta *meta, int which, char names[][16])
+{
+	const char *src = (const char *)meta->data[which];
+	uint32_t count = 0;
+
+	if (!src || meta->type[which] != GPMF_TYPE_STRING_ASCII) return 0;
+
+	if (meta->structsize[which] > 1)
+	{
+		for (uint32_t r = 0; r < meta->repeat[which] && count < PLAN_MAX_FIELDS; r++, count++)
+		{
+			const char *name = src + r * meta->structsize[which];
+			uint32_t n = 0;
+			for (uint32_t i = 0; i < meta->structsize[which] && name[i] && n < 15; i++)
+				if (name[i] != ' ') names[count][n++] = (char)tolower((unsigned char)name[i]);
+			names[count][n] = '\0';
+		}
+		return count;
+	}
+
+	uint32_t length = meta->repeat[which];
+	uint32_t i = 0, n = 0;
+	for (uint32_t j = 0; j < length && src[j]; j++)
+		if (src[j] == '(') i = j + 1;
+	for (; i < length && src[i] && src[i] != ')' && count < PLAN_MAX_FIELDS; i++)
+	{
+		if (src[i] == ',')
+		{
+			names[count++][n] = '\0';
+			n = 0;
+		}
+		else if (src[i] != ' ' && n < 15)
+		{
+			names[count][n++] = (char)tolower((unsigned char)src[i]);
+		}
+	}
+	if (n && count < PLAN_MAX_FIELDS) names[count++][n] = '\0';
+	return count;
+}
+
+static int column_from_name(const char *name)
+{
+	if (strstr(name, "lat")) return COL_LAT;
+	if (strstr(name, "lon")) return COL_LON;
+	if (strstr(name, "alt")) return COL_ALT;
+	if (strstr(name, "2d")) return COL_SPEED2D;
+	if (strstr(name, "3d")) return COL_SPEED3D;
+	if (strstr(name, "day")) return COL_DAYS;
+	if (strstr(name, "sec")) return COL_SECS;
+	if (strstr(name, "dop") || strstr(name, "precision")) return COL_DOP;
+	if (strstr(name, "fix")) return COL_FIX;
+	return -1;
+}
+
+/* units only tell apart positions, altitude, speeds and time, so repeated units fill columns in order */
+static int column_from_unit(const char *unit, const bool *used)
+{
+	if (!strcmp(unit, "deg")) return used[COL_LAT] ? COL_LON : COL_LAT;
+	if (!strcmp(unit, "m")) return COL_ALT;
+	if (!strcmp(unit, "m/s")) return used[COL_SPEED2D] ? COL_SPEED3D : COL_SPEED2D;
+	if (!strcmp(unit, "s")) return COL_SECS;
+	return -1;
+}
+
+static void map_columns(uint32_t key, const stream_meta *meta, uint32_t fields, int8_t *columns)
+{
+	char names[PLAN_MAX_FIELDS][16];
+	bool used[COL_COUNT];
+	const int8_t *layout = NULL;
+	uint32_t layout_fields = 0;
+
+	memset(used, 0, sizeof(used));
+	for (uint32_t f = 0; f < fields; f++) columns[f] = -1;
+
+	/* names say exactly what each field is */
+	if (split_names(meta, META_STNM, names) == fields)
+	{
+		for (uint32_t f = 0; f < fields; f++)
+		{
+			int column = column_from_name(names[f]);
+			if (column >= 0 && !used[column]) used[column] = true, columns[f] = (int8_t)column;
+		}
+		if (used[COL_LAT] && used[COL_LON]) return;
+
+		memset(used, 0, sizeof(used));
+		for (uint32_t f = 0; f < fields; f++) columns[f] = -1;
+	}
+
+	/* units are the next best thing */
+	if (split_names(meta, META_UNIT, names) == fields)
+	{
+		for (uint32_t f = 0; f < fields; f++)
+		{
+			int column = column_from_unit(names[f], used);
+			if (column >= 0 && !used[column]) used[column] = true, columns[f] = (int8_t)column;
+		}
+	}
+
+	/* and whatever is still unknown comes from the documented layout */
+	if (STR2FOURCC("GPS5") == key)
+		layout = gps5_layout, layout_fields = sizeof(gps5_layout) / sizeof(*gps5_layout);
+	else if (STR2FOURCC("GPS9") == key)
+		layout = gps9_layout, layout_fields = sizeof(gps9_layout) / sizeof(*gps9_layout);
+
+	for (uint32_t f = 0; f < fields && f < layout_fields; f++)
+		if (columns[f] < 0 && !used[layout[f]]) used[layout[f]] = true, columns[f] = layout[f];
+}
+
+static double field_scale(const stream_meta *meta, uint32_t field)
+{
+	const uint8_t *scal = meta->data[META_SCAL];
+	if (!scal) return 1.0;
+
+	uint32_t size = GPMF_SizeofType((GPMF_SampleType)meta->type[META_SCAL]);
+	if (!size) return 1.0;
+
+	uint32_t count = meta->structsize[META_SCAL] / size * meta->repeat[META_SCAL];
+	double scale = read_value(scal + size * ((count > field) ? field : 0), meta->type[META_SCAL]);
+	return (scale != 0.0) ? scale : 1.0;
+}
+
+static void build_plan(decode_plan *plan, uint32_t key, uint64_t signature, char type, uint32_t structsize, const stream_meta *meta)
+{
+	char types[PLAN_MAX_FIELDS];
+	int8_t columns[PLAN_MAX_FIELDS];
+	uint32_t fields = 0, offset = 0;
+	bool lat = false, lon = false;
+
+	memset(plan, 0, sizeof(*plan));
+	plan->key = key;
+	plan->signature = signature;
+
+	/* complex structures describe their fields in TYPE, anything else is an array of the KLV's own type */
+	if (GPMF_TYPE_COMPLEX == type)
+	{
+		if (!meta->data[META_TYPE]) return;
+		fields = expand_type(meta, types);
+	}
+	else
+	{
+		uint32_t size = GPMF_SizeofType((GPMF_SampleType)type);
+		if (!size || structsize % size || structsize / size > PLAN_MAX_FIELDS) return;
+		fields = structsize / size;
+		memset(types, type, fields);
+	}
+	if (!fields) return;
+
+	map_columns(key, meta, fields, columns);
+
+	for (uint32_t f = 0; f < fields; f++)
+	{
+		uint32_t size = GPMF_SizeofType((GPMF_SampleType)types[f]);
+		if (!size || types[f] == GPMF_TYPE_STRING_ASCII) return;
+
+		if (columns[f] >= 0)
+		{
+			plan_field field = { (uint16_t)offset, (uint8_t)columns[f], types[f], field_scale(meta, f) };
+
+			if (GPMF_TYPE_SIGNED_LONG == types[f])
+				plan->int32[plan->int32_count++] = field;
+			else if (GPMF_TYPE_UNSIGNED_SHORT == types[f])
+				plan->uint16[plan->uint16_count++] = field;
+			else
+				plan->other[plan->other_count++] = field;
+
+			lat |= (COL_LAT == columns[f]);
+			lon |= (COL_LON == columns[f]);
+		}
+		offset += size;
+	}
+
+	if (offset == structsize && lat && lon)
+		plan->structsize = structsize;
+}
+
+/* the plan for the current stream, rebuilt only when its metadata differs from last time */
+static const decode_plan *stream_plan(decode_state *state, uint32_t key, const stream_meta *meta, GPMF_stream *ms)
+{
+	uint32_t structsize = GPMF_StructSize(ms);
+	uint64_t signature = stream_signature(key, structsize, meta);
+	decode_plan *plan = NULL;
+
+	for (uint32_t i = 0; i < state->plan_count; i++)
+		if (state->plans[i].key == key) plan = &state->plans[i];
+
+	if (!plan || plan->signature != signature)
+	{
+		if (!plan) plan = &state->plans[(state->plan_count < PLAN_CACHE_SIZE) ? state->plan_count++ : 0];
+		build_plan(plan, key, signature, (char)GPMF_Type(ms), structsize, meta);
+	}
+
+	return plan->structsize ? plan : NULL;
+}
+
+/* decode "samples" structures into rows of COL_COUNT doubles */
+static void run_plan(const decode_plan *plan, const uint8_t *data, uint32_t samples, double *rows)
+{
+	memset(rows, 0, (size_t)samples * COL_COUNT * sizeof(double));
+
+	for (uint32_t i = 0; i < samples; i++, data += plan->structsize, rows += COL_COUNT)
+	{
+		for (uint32_t f = 0; f < plan->int32_count; f++)
+			rows[plan->int32[f].column] = (double)(int32_t)be32(data + plan->int32[f].offset) / plan->int32[f].scale;
+		for (uint32_t f = 0; f < plan->uint16_count; f++)
+			rows[plan->uint16[f].column] = (double)be16(data + plan->uint16[f].offset) / plan->uint16[f].scale;
+		for (uint32_t f = 0; f < plan->other_count; f++)
+			rows[plan->other[f].column] = read_value(data + plan->other[f].offset, plan->other[f].type) / plan->other[f].scale;
+	}
+}
+
+static double *plan_rows(file_job *job, decode_state *state, uint32_t samples, size_t bytes)
+{
+	if (samples > state->rows_size)
+	{
+		double *rows = realloc(state->rows, bytes);
+		if (!rows) return NULL;
+		mem_acquire(job, (size_t)(samples - state->rows_size) * COL_COUNT * sizeof(double));
+		state->rows = rows;
+		state->rows_size = samples;
+	}
+	return state->rows;
+}
+
+static void decode_state_free(decode_state *state)
+{
+	free(state->rows);
+	mem_release((size_t)state->rows_size * COL_COUNT * sizeof(double));
+	state->rows = NULL;
+	state->rows_size = 0;
+}
+
+static const char *const segment_column_names[] =
+{
+	"file",
+	"segment",
+	"start cts",
+	"end cts",
+	"start date",
+	"end date",
+	"duration [s]",
+	"start (Lat.) [deg]",
+	"start (Long.) [deg]",
+	"end (Lat.) [deg]",
+	"end (Long.) [deg]",
+	"distance [m]",
+};
+
+static const char *const event_column_names[] =
+{
+	"file",
+	"event",
+	"start cts",
+	"end cts",
+	"date",
+	"duration [s]",
+	"peak",
+	"peak (Lat.) [deg]",
+	"peak (Long.) [deg]",
+	"context start cts",
+	"context end cts",
+	"context min speed [m/s]",
+	"context max speed [m/s]",
+};
+
+static const char *const reference_column_names[] =
+{
+	"file",
+	"type",
+	"name",
+	"number",
+	"start cts",
+	"end cts",
+	"start date",
+	"duration [s]",
+	"distance [m]",
+};
+
+static const char *const match_column_names[] =
+{
+	"file",
+	"cts",
+	"date",
+	"GPS (Lat.) [deg]",
+	"GPS (Long.) [deg]",
+	"matched (Lat.) [deg]",
+	"matched (Long.) [deg]",
+	"road",
+	"offset [m]",
+};
+
+static const char *const resample_column_names[] =
+{
+	"file",
+	"distance [m]",
+	"cts",
+	"date",
+	"GPS (Lat.) [deg]",
+	"GPS (Long.) [deg]",
+	"GPS (Alt.) [m]",
+};
+
+static void print_header(output_options *out)
+{
+	const char *const *names = NULL;
+	int count = 0;
+
+	if (out->segments)
+	{
+		names = segment_column_names;
+		count = sizeof(segment_column_names) / sizeof(*segment_column_names);
+	}
+	else if (out->ev)
+	{
+		names = event_column_names;
+		count = sizeof(event_column_names) / sizeof(*event_column_names);
+	}
+	else if (out->refs)
+	{
+		names = reference_column_names;
+		count = sizeof(reference_column_names) / sizeof(*reference_column_names);
+	}
+	else if (out->matcher)
+	{
+		names = match_column_names;
+		count = sizeof(match_column_names) / sizeof(*match_column_names);
+	}
+	else if (out->every_distance > 0.0)
+	{
+		names = resample_column_names;
+		count = sizeof(resample_column_names) / sizeof(*resample_column_names);
+	}
+
+	if (names)
+	{
+		int col = 0;
+		if (out->print_filename || out->print_filepath)
+			printf("\"%s\"", names[0]);
+		for (int i = 1; i < count; i++)
+			printf("%s\"%s\"", (col++ || out->print_filename || out->print_filepath) ? "," : "", names[i]);
+		printf("\n");
+		out->header_printed = true;
+		return;
+	}
+
+	/* print column names on the first row */
+	int col = 0;
+	if (out->print_filename || out->print_filepath)
+		printf("\"%s\"", column_names[0]); /* "file" */
+	for (int i = 1; i < (sizeof(column_names) / sizeof(*column_names)); i++)
+		printf("%s\"%s\"", (col++ || out->print_filename || out->print_filepath) ? "," : "", column_names[i]);
+	printf("\n");
+	out->header_printed = true;
+}
+
+static void print_sample(const output_options *out, const file_job *job, const gps_sample *s)
+{
+	/* we print the filename (if requested) and time... */
+	if (out->print_filepath)
+		printf("\"%s\", ", job->path);
+	else if (out->print_filename)
+		printf("\"%s\", ", job->display_name);
+	printf("%f, ", (out->file_start + s->cts) * 1000.0);
+	char ftimestr[64];
+	strftime(ftimestr, sizeof(ftimestr), "%Y-%m-%dT%H:%M:%S", gmtime(&s->time));
+
+	/* ... and print out all the data */
+	if (s->gps9)
+	{
+		printf("%s.%03dZ", ftimestr, (int)s->milliseconds);
+		printf(", %.6f, %.6f, %.6f, %.6f, %.6f", s->lat, s->lon, s->alt, s->speed2d, s->speed3d);
+		printf(", %.6f, %.6f\n", s->fix, s->precision);
+	}
+	else
+	{
+		printf("%s.%03dZ, ", ftimestr, (int)s->milliseconds);
+		printf("%.6f, %.6f, %.6f, %.6f, %.6f, ", s->lat, s->lon, s->alt, s->speed2d, s->speed3d);
+		printf("%d, %d\n", (int)s->fix, (int)s->precision);
+	}
+}
+
+#define SEGMENT_MOVE_DWELL 5.0 /* seconds above stop_speed before a stop ends */
+#define SEGMENT_GAP 2.0        /* seconds without samples that count as an outage */
+
+/* great circle distance in metres */
+static double haversine(double lat1, double lon1, double lat2, double lon2)
+{
+	double p1 = lat1 * M_PI / 180.0, p2 = lat2 * M_PI / 180.0;
+	double dp = p2 - p1, dl = (lon2 - lon1) * M_PI / 180.0;
+	double a = sin(dp / 2.0) * sin(dp / 2.0) + cos(p1) * cos(p2) * sin(dl / 2.0) * sin(dl / 2.0);
+	return 2.0 * 6371008.8 * asin(fmin(1.0, sqrt(a)));
+}
+
+static void print_segment_point(const segment_point *p)
+{
+	char ftimestr[64];
+	strftime(ftimestr, sizeof(ftimestr), "%Y-%m-%dT%H:%M:%S", gmtime(&p->time));
+	printf("%s.%03dZ", ftimestr, (int)p->milliseconds);
+}
+
+/* print the open segment as ending at "end" having covered "distance" */
+static void segment_close(const output_options *out, const segment_point *end, double distance)
+{
+	static const char *const names[] = { "", "moving", "stopped", "outage" };
+	const segmenter *seg = &out->seg;
+
+	if (out->print_filepath)
+		printf("\"%s\", ", seg->start.job->path);
+	else if (out->print_filename)
+		printf("\"%s\", ", seg->start.job->display_name);
+	printf("%s, %f, %f, ", names[seg->type], seg->start.t * 1000.0, end->t * 1000.0);
+	print_segment_point(&seg->start);
+	printf(", ");
+	print_segment_point(end);
+	printf(", %.3f, ", end->t - seg->start.t);
+	if (seg->start.located) printf("%.6f, %.6f, ", seg->start.lat, seg->start.lon);
+	else printf(", , ");
+	if (end->located) printf("%.6f, %.6f, ", end->lat, end->lon);
+	else printf(", , ");
+	printf("%.1f\n", distance);
+}
+
+static void segment_open(segmenter *seg, segment_type type, const segment_point *start)
+{
+	seg->type = type;
+	seg->start = *start;
+	seg->last = *start;
+	seg->distance = 0.0;
+	seg->pending = false;
+}
+
+/* first fix after an outage: moving, unless it is slow and stays so for the stop dwell */
+static void segment_resume(segmenter *seg, const segment_point *start, bool slow)
+{
+	segment_open(seg, SEGMENT_MOVING, start);
+	if (slow)
+	{
+		seg->pending = true;
+		seg->pending_start = *start;
+		seg->pending_distance = 0.0;
+	}
+}
+
+/* single pass stop/move/outage segmentation, fed every sample in timeline order */
+static void segment_sample(output_options *out, const file_job *job, const gps_sample *s)
+{
+	segmenter *seg = &out->seg;
+	segment_point p;
+	bool good = s->fix >= 2.0 && !s->filtered; /* a sample the filters reject is as good as no fix */
+
+	p.job = job;
+	p.t = out->file_start + s->cts;
+	p.time = s->time;
+	p.milliseconds = s->milliseconds;
+	p.lat = s->lat;
+	p.lon = s->lon;
+	p.located = good;
+
+	/* a silence in the samples is an outage too */
+	if (seg->type != SEGMENT_NONE && seg->type != SEGMENT_OUTAGE && p.t - seg->last.t > SEGMENT_GAP)
+	{
+		segment_close(out, &seg->last, seg->distance);
+		segment_open(seg, SEGMENT_OUTAGE, &seg->last);
+	}
+
+	if (!good)
+	{
+		if (SEGMENT_NONE == seg->type)
+		{
+			segment_open(seg, SEGMENT_OUTAGE, &p);
+		}
+		else if (seg->type != SEGMENT_OUTAGE)
+		{
+			/* the outage begins with the last good fix */
+			segment_close(out, &seg->last, seg->distance);
+			segment_open(seg, SEGMENT_OUTAGE, &seg->last);
+		}
+		return;
+	}
+
+	if (SEGMENT_OUTAGE == seg->type)
+	{
+		double distance = seg->last.located ? haversine(seg->last.lat, seg->last.lon, p.lat, p.lon) : 0.0;
+		segment_close(out, &p, distance);
+		segment_resume(seg, &p, s->speed2d < out->stop_speed);
+		return;
+	}
+
+	if (SEGMENT_NONE == seg->type)
+	{
+		segment_resume(seg, &p, s->speed2d < out->stop_speed);
+		return;
+	}
+
+	seg->distance += haversine(seg->last.lat, seg->last.lon, p.lat, p.lon);
+	seg->last = p;
+
+	segment_type want = (s->speed2d < out->stop_speed) ? SEGMENT_STOPPED : SEGMENT_MOVING;
+	if (want == seg->type)
+	{
+		seg->pending = false;
+		return;
+	}
+
+	if (!seg->pending)
+	{
+		seg->pending = true;
+		seg->pending_start = p;
+		seg->pending_distance = seg->distance;
+	}
+
+	if (p.t - seg->pending_start.t < ((SEGMENT_STOPPED == want) ? out->stop_dwell : SEGMENT_MOVE_DWELL)) return;
+
+	/* the change has lasted long enough; it began with the pending sample */
+	if (seg->pending_start.t == seg->start.t)
+	{
+		seg->type = want;
+		seg->pending = false;
+		return;
+	}
+
+	double distance = seg->distance - seg->pending_distance;
+	segment_close(out, &seg->pending_start, seg->pending_distance);
+	segment_open(seg, want, &seg->pending_start);
+	seg->distance = distance;
+	seg->last = p;
+}
+
+static void segment_finish(output_options *out)
+{
+	if (out->seg.type != SEGMENT_NONE) segment_close(out, &out->seg.last, out->seg.distance);
+	out->seg.type = SEGMENT_NONE;
+}
+
+/* --events: sliding window detectors run over the stitched timeline as samples are written */
+#define EVENT_WINDOW 1.0           /* seconds over which changes of speed and heading are measured */
+#define EVENT_CORNER_SPEED 5.0     /* m/s below which GPS headings are too noisy to corner on */
+#define EVENT_SPEEDING_MIN 3.0     /* seconds over the limit before it counts */
+#define ACCL_GRAVITY_TC 2.0        /* seconds, time constant of the gravity estimate */
+#define ACCL_SMOOTH_TC 0.25        /* seconds, time constant of the harsh motion level */
+
+static const char *const event_names[EVENT_KINDS] = { "harsh_braking", "harsh_acceleration", "harsh_cornering", "speeding", "harsh_motion" };
+
+static void print_event(const output_options *out, const event_record *e)
+{
+	char ftimestr[64];
+
+	if (out->print_filepath)
+		printf("\"%s\", ", e->job->path);
+	else if (out->print_filename)
+		printf("\"%s\", ", e->job->display_name);
+	strftime(ftimestr, sizeof(ftimestr), "%Y-%m-%dT%H:%M:%S", gmtime(&e->time));
+	printf("%s, %f, %f, %s.%03dZ, %.3f, %.3f, ", event_names[e->kind], e->start * 1000.0, e->end * 1000.0,
+		ftimestr, (int)e->milliseconds, e->end - e->start, e->peak);
+	if (e->located) printf("%.6f, %.6f, ", e->lat, e->lon);
+	else printf(", , ");
+	printf("%f, %f, %.3f, %.3f\n", (e->start - out->ev->context) * 1000.0, (e->end + out->ev->context) * 1000.0, e->min_speed, e->max_speed);
+}
+
+/* min and max speed over the history since "from" */
+static void history_speeds(const event_state *ev, double from, double *min_speed, double *max_speed)
+{
+	*min_speed = INFINITY;
+	*max_speed = 0.0;
+	for (uint32_t i = 0; i < ev->count; i++)
+	{
+		const history_sample *h = &ev->history[(ev->first + i) % ev->size];
+		if (h->t < from) continue;
+		if (h->speed < *min_speed) *min_speed = h->speed;
+		if (h->speed > *max_speed) *max_speed = h->speed;
+	}
+	if (*min_speed > *max_speed) *min_speed = *max_speed;
+}
+
+/* the newest history sample at least "age" seconds older than the newest of all */
+static const history_sample *history_before(const event_state *ev, double age)
+{
+	if (!ev->count) return NULL;
+
+	double t = ev->history[(ev->first + ev->count - 1) % ev->size].t - age;
+	for (uint32_t i = ev->count; i-- > 0; )
+	{
+		const history_sample *h = &ev->history[(ev->first + i) % ev->size];
+		if (h->t <= t) return h;
+	}
+	return NULL;
+}
+
+/* feed one detector; an event runs while "value" is at or above its threshold */
+static void event_update(event_state *ev, event_kind kind, double value, const segment_point *p)
+{
+	double limit = ev->threshold[kind];
+	event_record *e = &ev->open[kind];
+
+	if (limit <= 0.0) return;
+
+	if (value >= limit)
+	{
+		if (!ev->active[kind])
+		{
+			ev->active[kind] = true;
+			e->kind = kind;
+			e->job = p->job;
+			e->start = p->t;
+			e->time = p->time;
+			e->milliseconds = p->milliseconds;
+			e->peak = -INFINITY;
+			history_speeds(ev, p->t - ev->context, &e->min_speed, &e->max_speed);
+		}
+		if (value > e->peak)
+		{
+			e->peak = value;
+			e->lat = p->lat;
+			e->lon = p->lon;
+			e->located = p->located;
+		}
+		e->end = p->t;
+		return;
+	}
+
+	if (!ev->active[kind]) return;
+	ev->active[kind] = false;
+	if (EVENT_SPEEDING == kind && e->end - e->start < EVENT_SPEEDING_MIN) return;
+
+	/* finished, but its trailing context is still to come */
+	if (ev->pending_count == ev->pending_size)
+	{
+		uint32_t size = ev->pending_size ? 2 * ev->pending_size : 16;
+		event_record *pending = realloc(ev->pending, size * sizeof(event_record));
+		if (!pending)
+		{
+			ev->failed = true;
+			return;
+		}
+		ev->pending = pending;
+		ev->pending_size = size;
+	}
+	ev->pending[ev->pending_count++] = *e;
+}
+
+static void history_push(event_state *ev, const history_sample *h)
+{
+	/* keep enough for the detector windows and the leading context */
+	while (ev->count && ev->history[ev->first].t < h->t - (ev->context + 2.0 * EVENT_WINDOW + 1.0))
+	{
+		ev->first = (ev->first + 1) % ev->size;
+		ev->count--;
+	}
+
+	if (ev->count == ev->size)
+	{
+		uint32_t size = ev->size ? 2 * ev->size : 256;
+		history_sample *history = malloc(size * sizeof(history_sample));
+		if (!history)
+		{
+			/* the detectors carry on with less history rather than none */
+			ev->failed = true;
+			if (!ev->count) return;
+			ev->first = (ev->first + 1) % ev->size;
+			ev->count--;
+			ev->history[(ev->first + ev->count++) % ev->size] = *h;
+			return;
+		}
+		for (uint32_t i = 0; i < ev->count; i++) history[i] = ev->history[(ev->first + i) % ev->size];
+		free(ev->history);
+		ev->history = history;
+		ev->size = size;
+		ev->first = 0;
+	}
+	ev->history[(ev->first + ev->count++) % ev->size] = *h;
+}
+
+static double bearing(const history_sample *a, const history_sample *b)
+{
+	double p1 = a->lat * M_PI / 180.0, p2 = b->lat * M_PI / 180.0, dl = (b->lon - a->lon) * M_PI / 180.0;
+	return atan2(sin(dl) * cos(p2), cos(p1) * sin(p2) - sin(p1) * cos(p2) * cos(dl));
+}
+
+static void accl_event_sample(output_options *out, const file_job *job, const gps_sample *s)
+{
+	event_state *ev = out->ev;
+	double t = out->file_start + s->cts;
+	double *g = ev->gravity;
+
+	if (!ev->accl_started || t - ev->accl_t > EVENT_WINDOW || t < ev->accl_t)
+	{
+		memcpy(g, s->accel, sizeof(ev->gravity));
+		ev->accl_started = true;
+		ev->accl_t = t;
+		ev->accl_level = 0.0;
+		return;
+	}
+
+	/* gravity is what the accelerometer reads on average; what's left, across it, is how hard the camera is thrown about */
+	double dt = t - ev->accl_t;
+	double k = 1.0 - exp(-dt / ACCL_GRAVITY_TC);
+	for (int i = 0; i < 3; i++) g[i] += k * (s->accel[i] - g[i]);
+	ev->accl_t = t;
+
+	double gn = sqrt(g[0] * g[0] + g[1] * g[1] + g[2] * g[2]);
+	if (gn <= 0.0) return;
+
+	double d[3] = { s->accel[0] - g[0], s->accel[1] - g[1], s->accel[2] - g[2] };
+	double up = (d[0] * g[0] + d[1] * g[1] + d[2] * g[2]) / gn;
+	double across = sqrt(fmax(0.0, d[0] * d[0] + d[1] * d[1] + d[2] * d[2] - up * up));
+	ev->accl_level += (1.0 - exp(-dt / ACCL_SMOOTH_TC)) * (across - ev->accl_level);
+
+	/* placed at the last fix, and timed from it */
+	segment_point p = ev->last;
+	double ms = p.milliseconds + (t - p.t) * 1000.0;
+	double whole = floor(ms / 1000.0);
+	p.job = job;
+	p.t = t;
+	p.time += (time_t)whole;
+	p.milliseconds = ms - whole * 1000.0;
+	event_update(ev, EVENT_HARSH_MOTION, ev->accl_level, &p);
+}
+
+static void event_sample(output_options *out, const file_job *job, const gps_sample *s)
+{
+	event_state *ev = out->ev;
+
+	if (s->accl)
+	{
+		accl_event_sample(out, job, s);
+		return;
+	}
+
+	if (s->fix < 2.0) return; /* speed and position mean nothing without a fix */
+
+	history_sample h = { out->file_start + s->cts, s->speed2d, s->lat, s->lon };
+	segment_point p = { job, h.t, s->time, s->milliseconds, s->lat, s->lon, true };
+
+	/* across an outage, or files that don't follow on in UTC, nothing is compared with what came before */
+	if (ev->count)
+	{
+		double elapsed = h.t - ev->last.t;
+		double utc = difftime(p.time, ev->last.time) + (p.milliseconds - ev->last.milliseconds) / 1000.0;
+		if (elapsed > SEGMENT_GAP || fabs(utc - elapsed) > SEGMENT_GAP)
+		{
+			for (int k = 0; k < EVENT_KINDS; k++)
+				event_update(ev, (event_kind)k, -INFINITY, &ev->last);
+			ev->count = 0;
+		}
+	}
+
+	history_push(ev, &h);
+	ev->last = p;
+
+	/* longitudinal acceleration over the window */
+	const history_sample *a = history_before(ev, EVENT_WINDOW);
+	double accel = (a && h.t > a->t) ? (h.speed - a->speed) / (h.t - a->t) : 0.0;
+	event_update(ev, EVENT_BRAKING, -accel, &p);
+	event_update(ev, EVENT_ACCELERATION, accel, &p);
+
+	/* lateral acceleration from the turn between the last two windows */
+	const history_sample *b = history_before(ev, 2.0 * EVENT_WINDOW);
+	double lateral = 0.0;
+	if (a && b && h.speed >= EVENT_CORNER_SPEED && h.t > b->t &&
+		haversine(b->lat, b->lon, a->lat, a->lon) > 2.0 && haversine(a->lat, a->lon, h.lat, h.lon) > 2.0)
+	{
+		double turn = bearing(a, &h) - bearing(b, a);
+		turn = atan2(sin(turn), cos(turn));
+		lateral = fabs(h.speed * turn / ((h.t - b->t) / 2.0));
+	}
+	event_update(ev, EVENT_CORNERING, lateral, &p);
+	event_update(ev, EVENT_SPEEDING, h.speed, &p);
+
+	for (int k = 0; k < EVENT_KINDS; k++)
+	{
+		if (!ev->active[k]) continue;
+		if (h.speed < ev->open[k].min_speed) ev->open[k].min_speed = h.speed;
+		if (h.speed > ev->open[k].max_speed) ev->open[k].max_speed = h.speed;
+	}
+
+	/* finished events are printed once their trailing context has gone by */
+	uint32_t kept = 0;
+	for (uint32_t i = 0; i < ev->pending_count; i++)
+	{
+		event_record *e = &ev->pending[i];
+		if (h.t > e->end + ev->context)
+		{
+			print_event(out, e);
+			continue;
+		}
+		if (h.speed < e->min_speed) e->min_speed = h.speed;
+		if (h.speed > e->max_speed) e->max_speed = h.speed;
+		ev->pending[kept++] = *e;
+	}
+	ev->pending_count = kept;
+}
+
+static void events_finish(output_options *out)
+{
+	event_state *ev = out->ev;
+
+	/* close whatever is still running, as if every detector dropped to zero */
+	for (int k = 0; k < EVENT_KINDS; k++)
+		event_update(ev, (event_kind)k, -INFINITY, &ev->last);
+	for (uint32_t i = 0; i < ev->pending_count; i++)
+		print_event(out, &ev->pending[i]);
+	ev->pending_count = 0;
+}
+
+/* --segments_ref: laps and segments timed at gate crossings, in the same pass as decoding */
+#define REF_CELL 50.0              /* metres, side of a spatial index cell */
+#define REF_MAX_ITEMS (1u << 22)   /* index entries a reference file may need */
+#define REF_MAX_STEP_CELLS 4096    /* cells a step between fixes may cover before it counts as a glitch */
+#define REF_DEBOUNCE 1.0           /* seconds before a gate counts again */
+#define REF_SEPARATORS " \t,\r\n"
+#define METRES_PER_DEGREE (6371008.8 * M_PI / 180.0)
+
+/* make room for one more of "count" items of "item" bytes */
+static bool ref_grow(void **array, uint32_t *size, uint32_t count, size_t item)
+{
+	if (count < *size) return true;
+
+	uint32_t grown = *size ? 2 * *size : 16;
+	void *p = realloc(*array, grown * item);
+	if (!p) return false;
+	*array = p;
+	*size = grown;
+	return true;
+}
+
+/* the first point projected becomes the origin */
+static void plane_project(local_plane *plane, double lat, double lon, double *x, double *y)
+{
+	if (plane->scale <= 0.0)
+	{
+		plane->lat0 = lat;
+		plane->lon0 = lon;
+		plane->scale = METRES_PER_DEGREE * fmax(cos(lat * M_PI / 180.0), 1e-6);
+	}
+	*x = (lon - plane->lon0) * plane->scale;
+	*y = (lat - plane->lat0) * METRES_PER_DEGREE;
+}
+
+static void plane_unproject(const local_plane *plane, double x, double y, double *lat, double *lon)
+{
+	*lat = plane->lat0 + y / METRES_PER_DEGREE;
+	*lon = plane->lon0 + x / plane->scale;
+}
+
+/* key of a grid cell, for indexes sorted by cell */
+static int64_t grid_key(int32_t cx, int32_t cy)
+{
+	return (int64_t)((uint64_t)(uint32_t)cx << 32 | (uint32_t)cy);
+}
+
+static int64_t ref_cell(double x, double y)
+{
+	return grid_key((int32_t)floor(x / REF_CELL), (int32_t)floor(y / REF_CELL));
+}
+
+static int32_t ref_find_gate(const reference_set *refs, const char *name)
+{
+	for (uint32_t i = 0; i < refs->gate_count; i++)
+		if (!strcmp(refs->gates[i].name, name)) return (int32_t)i;
+	return -1;
+}
+
+static ref_gate *ref_add_gate(reference_set *refs, const char *name)
+{
+	if (!ref_grow((void **)&refs->gates, &refs->gate_size, refs->gate_count, sizeof(ref_gate))) return NULL;
+
+	ref_gate *g = &refs->gates[refs->gate_count++];
+	memset(g, 0, sizeof(*g));
+	strcpy(g->name, name);
+	g->last = -INFINITY;
+	return g;
+}
+
+static ref_timer *ref_add_timer(reference_set *refs, const char *name, bool lap, uint32_t from, uint32_t to, int32_t route)
+{
+	if (!ref_grow((void **)&refs->timers, &refs->timer_size, refs->timer_count, sizeof(ref_timer))) return NULL;
+
+	ref_timer *timer = &refs->timers[refs->timer_count++];
+	memset(timer, 0, sizeof(*timer));
+	strcpy(timer->name, name);
+	timer->lap = lap;
+	timer->from = from;
+	timer->to = to;
+	timer->route = route;
+	return timer;
+}
+
+static bool ref_numbers(char **save, double *values, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++)
+	{
+		char *word = strtok_r(NULL, REF_SEPARATORS, save), *end;
+		if (!word) return false;
+		values[i] = strtod(word, &end);
+		if (*end || !isfinite(values[i])) return false;
+	}
+	return true;
+}
+
+/* a gate across the end of a route, "width" either side of "x, y" and square to the direction "dx, dy" */
+static const char *ref_route_gate(reference_set *refs, const char *name, const char *suffix, double x, double y, double dx, double dy, double width)
+{
+	char gate_name[REF_NAME_SIZE];
+	double length = hypot(dx, dy);
+
+	snprintf(gate_name, sizeof(gate_name), "%s%s", name, suffix);
+	if (ref_find_gate(refs, gate_name) >= 0) return "duplicate gate";
+
+	ref_gate *g = ref_add_gate(refs, gate_name);
+	if (!g) return "out of memory";
+	g->ax = x + dy / length * width;
+	g->ay = y - dx / length * width;
+	g->bx = x - dy / length * width;
+	g->by = y + dx / length * width;
+	g->direction = 1; /* routes are only driven one way */
+	return NULL;
+}
+
+/* parse one line of a reference file, returning what was wrong with it */
+static const char *reference_line(reference_set *refs, char *line)
+{
+	char *save, *word = strtok_r(line, REF_SEPARATORS, &save);
+
+	if (!word || '#' == *word) return NULL;
+
+	char *name = strtok_r(NULL, REF_SEPARATORS, &save);
+	if (!name) return "missing name";
+	if (strlen(name) + sizeof(".finish") > REF_NAME_SIZE) return "name too long";
+
+	if (!strcmp(word, "gate"))
+	{
+		double v[4];
+		if (!ref_numbers(&save, v, 4) || strtok_r(NULL, REF_SEPARATORS, &save)) return "expected gate NAME LAT1 LON1 LAT2 LON2";
+		if (ref_find_gate(refs, name) >= 0) return "duplicate gate";
+
+		ref_gate *g = ref_add_gate(refs, name);
+		if (!g) return "out of memory";
+		plane_project(&refs->plane, v[0], v[1], &g->ax, &g->ay);
+		plane_project(&refs->plane, v[2], v[3], &g->bx, &g->by);
+		if (g->ax == g->bx && g->ay == g->by) return "gate has no width";
+		return NULL;
+	}
+
+	if (!strcmp(word, "lap"))
+	{
+		int32_t gate = ref_find_gate(refs, name);
+		if (gate < 0) return "unknown gate";
+		if (strtok_r(NULL, REF_SEPARATORS, &save)) return "expected lap GATE";
+		return ref_add_timer(refs, name, true, (uint32_t)gate, (uint32_t)gate, -1) ? NULL : "out of memory";
+	}
+
+	if (!strcmp(word, "segment"))
+	{
+		char *from = strtok_r(NULL, REF_SEPARATORS, &save), *to = strtok_r(NULL, REF_SEPARATORS, &save);
+		if (!from || !to || strtok_r(NULL, REF_SEPARATORS, &save)) return "expected segment NAME FROM_GATE TO_GATE";
+
+		int32_t a = ref_find_gate(refs, from), b = ref_find_gate(refs, to);
+		if (a < 0 || b < 0) return "unknown gate";
+		return ref_add_timer(refs, name, false, (uint32_t)a, (uint32_t)b, -1) ? NULL : "out of memory";
+	}
+
+	if (!strcmp(word, "route"))
+	{
+		double width, v[2];
+		char *word, *end;
+		uint32_t n = 0;
+		if (!ref_numbers(&save, &width, 1) || width <= 0.0) return "expected route NAME WIDTH LAT LON LAT LON ...";
+		if (!ref_grow((void **)&refs->routes, &refs->route_size, refs->route_count, sizeof(ref_route))) return "out of memory";
+
+		ref_route *r = &refs->routes[refs->route_count];
+		r->first = refs->point_count;
+		r->count = 0;
+		r->width = width;
+		while ((word = strtok_r(NULL, REF_SEPARATORS, &save)))
+		{
+			v[n] = strtod(word, &end);
+			if (*end || !isfinite(v[n])) return "route coordinates must be numbers";
+			if (++n < 2) continue;
+			if (!ref_grow((void **)&refs->points, &refs->point_size, refs->point_count, sizeof(*refs->points))) return "out of memory";
+			plane_project(&refs->plane, v[0], v[1], &refs->points[refs->point_count][0], &refs->points[refs->point_count][1]);
+			refs->point_count++;
+			r->count++;
+			n = 0;
+		}
+		if (n) return "route has an odd number of coordinates";
+		if (r->count < 2) return "route needs at least two points";
+
+		/* gates square to the first and last edges that go anywhere */
+		double (*p)[2] = refs->points + r->first;
+		uint32_t a = 1, b = r->count - 1;
+		while (a < r->count && p[a][0] == p[0][0] && p[a][1] == p[0][1]) a++;
+		while (b > 0 && p[b - 1][0] == p[r->count - 1][0] && p[b - 1][1] == p[r->count - 1][1]) b--;
+		if (a == r->count || !b) return "route has no length";
+
+		const char *error;
+		if ((error = ref_route_gate(refs, name, ".start", p[0][0], p[0][1], p[a][0] - p[0][0], p[a][1] - p[0][1], width))) return error;
+		if ((error = ref_route_gate(refs, name, ".finish", p[r->count - 1][0], p[r->count - 1][1],
+			p[r->count - 1][0] - p[b - 1][0], p[r->count - 1][1] - p[b - 1][1], width))) return error;
+		refs->route_count++;
+		return ref_add_timer(refs, name, false, refs->gate_count - 2, refs->gate_count - 1, (int32_t)refs->route_count - 1) ? NULL : "out of memory";
+	}
+
+	return "expected gate, lap, segment or route";
+}
+
+/* file an item under every cell its bounding box touches */
+static const char *ref_index_box(reference_set *refs, ref_item item, double x0, double y0, double x1, double y1)
+{
+	int32_t cx0 = (int32_t)floor(fmin(x0, x1) / REF_CELL), cx1 = (int32_t)floor(fmax(x0, x1) / REF_CELL);
+	int32_t cy0 = (int32_t)floor(fmin(y0, y1) / REF_CELL), cy1 = (int32_t)floor(fmax(y0, y1) / REF_CELL);
+
+	if ((double)(cx1 - cx0 + 1) * (cy1 - cy0 + 1) > REF_MAX_ITEMS - refs->item_count) return "gates and routes cover too large an area";
+
+	for (int32_t cx = cx0; cx <= cx1; cx++)
+	{
+		for (int32_t cy = cy0; cy <= cy1; cy++)
+		{
+			if (!ref_grow((void **)&refs->items, &refs->item_size, refs->item_count, sizeof(ref_item))) return "out of memory";
+			item.cell = grid_key(cx, cy);
+			refs->items[refs->item_count++] = item;
+		}
+	}
+	return NULL;
+}
+
+static int compare_items(const void *a, const void *b)
+{
+	const ref_item *x = a, *y = b;
+	return (x->cell > y->cell) - (x->cell < y->cell);
+}
+
+static const char *reference_index(reference_set *refs)
+{
+	const char *error;
+
+	for (uint32_t i = 0; i < refs->gate_count; i++)
+	{
+		const ref_gate *g = &refs->gates[i];
+		ref_item item = { 0, false, i, 0 };
+		if ((error = ref_index_box(refs, item, g->ax, g->ay, g->bx, g->by))) return error;
+	}
+
+	for (uint32_t r = 0; r < refs->route_count; r++)
+	{
+		const ref_route *route = &refs->routes[r];
+		for (uint32_t i = route->first; i + 1 < route->first + route->count; i++)
+		{
+			const double *a = refs->points[i], *b = refs->points[i + 1];
+			ref_item item = { 0, true, i, r };
+			if ((error = ref_index_box(refs, item, fmin(a[0], b[0]) - route->width, fmin(a[1], b[1]) - route->width,
+				fmax(a[0], b[0]) + route->width, fmax(a[1], b[1]) + route->width))) return error;
+		}
+	}
+
+	qsort(refs->items, refs->item_count, sizeof(ref_item), compare_items);
+	return NULL;
+}
+
+static void reference_free(reference_set *refs)
+{
+	if (!refs) return;
+	free(refs->gates);
+	free(refs->routes);
+	free(refs->points);
+	free(refs->timers);
+	free(refs->items);
+	free(refs->hits);
+	free(refs);
+}
+
+/* read gates, laps, segments and routes, printing what's wrong if they can't be used */
+static reference_set *reference_load(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+	{
+		fprintf(stderr, "ERROR: unable to open %s\n", path);
+		return NULL;
+	}
+
+	reference_set *refs = calloc(1, sizeof(reference_set));
+	char *line = NULL;
+	size_t line_size = 0;
+	uint32_t number = 0;
+	const char *error = refs ? NULL : "out of memory";
+
+	while (!error && getline(&line, &line_size, fp) >= 0)
+	{
+		number++;
+		error = reference_line(refs, line);
+	}
+	free(line);
+
+	if (error)
+	{
+		fprintf(stderr, "ERROR: %s:%u: %s\n", path, number, error);
+	}
+	else
+	{
+		if (ferror(fp)) error = "read error";
+		else if (!refs->timer_count) error = "no laps, segments or routes";
+		else error = reference_index(refs);
+		if (error) fprintf(stderr, "ERROR: %s: %s\n", path, error);
+	}
+	fclose(fp);
+
+	if (error)
+	{
+		reference_free(refs);
+		return NULL;
+	}
+	return refs;
+}
+
+static void reference_print(const output_options *out, const ref_timer *timer, const ref_crossing *end)
+{
+	const ref_crossing *start = &timer->start;
+
+	if (out->print_filepath)
+		printf("\"%s\", ", start->p.job->path);
+	else if (out->print_filename)
+		printf("\"%s\", ", start->p.job->display_name);
+	printf("%s, %s, %u, %f, %f, ", timer->lap ? "lap" : "segment", timer->name, timer->count, start->p.t * 1000.0, end->p.t * 1000.0);
+	print_segment_point(&start->p);
+	printf(", %.3f, %.1f\n", end->p.t - start->p.t, end->distance - start->distance);
+}
+
+/* gate "gate" was crossed: close and start whatever it times */
+static void reference_cross(output_options *out, uint32_t gate, const ref_crossing *c)
+{
+	reference_set *refs = out->refs;
+
+	for (uint32_t i = 0; i < refs->timer_count; i++)
+	{
+		ref_timer *timer = &refs->timers[i];
+
+		if (timer->to == gate && timer->running)
+		{
+			timer->count++;
+			reference_print(out, timer, c);
+			timer->running = false;
+		}
+		if (timer->from == gate)
+		{
+			timer->start = *c;
+			timer->running = true;
+		}
+	}
+}
+
+/* where the step "p, q" crosses the gate, as a fraction of the step, and from which side */
+static bool ref_intersect(const ref_gate *g, double px, double py, double qx, double qy, double *u, int *side)
+{
+	double rx = qx - px, ry = qy - py, sx = g->bx - g->ax, sy = g->by - g->ay;
+	double denom = rx * sy - ry * sx;
+
+	if (denom == 0.0) return false;
+
+	double wx = g->ax - px, wy = g->ay - py;
+	*u = (wx * sy - wy * sx) / denom;
+	double v = (wx * ry - wy * rx) / denom;
+	*side = denom > 0.0 ? 1 : -1;
+
+	/* a fix exactly on the gate belongs to the step that ends there */
+	return *u > 0.0 && *u <= 1.0 && v >= 0.0 && v <= 1.0;
+}
+
+static int compare_hits(const void *a, const void *b)
+{
+	const ref_hit *x = a, *y = b;
+	return (x->u > y->u) - (x->u < y->u);
+}
+
+/* first index entry of "cell" */
+static uint32_t ref_lookup(const reference_set *refs, int64_t cell)
+{
+	uint32_t lo = 0, hi = refs->item_count;
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (refs->items[mid].cell < cell) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+static bool ref_on_route(const reference_set *refs, int32_t route, double x, double y)
+{
+	int64_t cell = ref_cell(x, y);
+	double width = refs->routes[route].width;
+
+	for (uint32_t i = ref_lookup(refs, cell); i < refs->item_count && refs->items[i].cell == cell; i++)
+	{
+		const ref_item *item = &refs->items[i];
+		if (!item->edge || item->route != (uint32_t)route) continue;
+
+		const double *a = refs->points[item->index], *b = refs->points[item->index + 1];
+		double dx = b[0] - a[0], dy = b[1] - a[1], len2 = dx * dx + dy * dy;
+		double k = len2 > 0.0 ? fmax(0.0, fmin(1.0, ((x - a[0]) * dx + (y - a[1]) * dy) / len2)) : 0.0;
+		if (hypot(x - a[0] - k * dx, y - a[1] - k * dy) <= width) return true;
+	}
+	return false;
+}
+
+/* the fix "a fraction u" of the way from a to b */
+static void ref_interpolate(const segment_point *a, const segment_point *b, double u, segment_point *p)
+{
+	double ms = a->milliseconds + u * (b->t - a->t) * 1000.0;
+	double whole = floor(ms / 1000.0);
+
+	*p = *b;
+	p->t = a->t + u * (b->t - a->t);
+	p->time = a->time + (time_t)whole;
+	p->milliseconds = ms - whole * 1000.0;
+	p->lat = a->lat + u * (b->lat - a->lat);
+	p->lon = a->lon + u * (b->lon - a->lon);
+}
+
+static void reference_sample(output_options *out, const file_job *job, const gps_sample *s)
+{
+	reference_set *refs = out->refs;
+
+	if (s->fix < 2.0) return;
+
+	segment_point p = { job, out->file_start + s->cts, s->time, s->milliseconds, s->lat, s->lon, true };
+	double x, y;
+	plane_project(&refs->plane, s->lat, s->lon, &x, &y);
+
+	/* gates crossed between the last fix and this one, unless there was an outage in between */
+	if (refs->started && p.t > refs->last.t && p.t - refs->last.t <= SEGMENT_GAP)
+	{
+		double step_distance = haversine(refs->last.lat, refs->last.lon, p.lat, p.lon);
+		int32_t cx0 = (int32_t)floor(fmin(refs->x, x) / REF_CELL), cx1 = (int32_t)floor(fmax(refs->x, x) / REF_CELL);
+		int32_t cy0 = (int32_t)floor(fmin(refs->y, y) / REF_CELL), cy1 = (int32_t)floor(fmax(refs->y, y) / REF_CELL);
+		bool glitch = (double)(cx1 - cx0 + 1) * (cy1 - cy0 + 1) > REF_MAX_STEP_CELLS;
+		uint32_t hits = 0;
+
+		refs->step++;
+		for (int32_t cx = cx0; !glitch && cx <= cx1; cx++)
+		{
+			for (int32_t cy = cy0; cy <= cy1; cy++)
+			{
+				int64_t cell = grid_key(cx, cy);
+				for (uint32_t i = ref_lookup(refs, cell); i < refs->item_count && refs->items[i].cell == cell; i++)
+				{
+					const ref_item *item = &refs->items[i];
+					ref_gate *g = &refs->gates[item->index];
+					double u;
+					int side;
+
+					if (item->edge || g->seen == refs->step) continue;
+					g->seen = refs->step;
+					if (!ref_intersect(g, refs->x, refs->y, x, y, &u, &side)) continue;
+					if (!ref_grow((void **)&refs->hits, &refs->hit_size, hits, sizeof(ref_hit))) continue;
+					refs->hits[hits].gate = item->index;
+					refs->hits[hits].u = u;
+					refs->hits[hits].side = side;
+					hits++;
+				}
+			}
+		}
+
+		/* in the order they were crossed */
+		if (hits > 1) qsort(refs->hits, hits, sizeof(ref_hit), compare_hits);
+		for (uint32_t i = 0; i < hits; i++)
+		{
+			ref_gate *g = &refs->gates[refs->hits[i].gate];
+			ref_crossing c;
+			double u = refs->hits[i].u;
+			int side = refs->hits[i].side;
+
+			ref_interpolate(&refs->last, &p, u, &c.p);
+			c.distance = refs->distance + u * step_distance;
+
+			/* gates count one way only, and not again while the fix jitters about them */
+			if (!g->direction) g->direction = side;
+			if (side != g->direction || c.p.t - g->last < REF_DEBOUNCE) continue;
+			g->last = c.p.t;
+			reference_cross(out, refs->hits[i].gate, &c);
+		}
+		refs->distance += step_distance;
+	}
+
+	refs->started = true;
+	refs->last = p;
+	refs->x = x;
+	refs->y = y;
+
+	/* a run of a route is abandoned as soon as the track leaves it */
+	for (uint32_t i = 0; i < refs->timer_count; i++)
+	{
+		ref_timer *timer = &refs->timers[i];
+		if (timer->running && timer->route >= 0 && !ref_on_route(refs, timer->route, x, y))
+			timer->running = false;
+	}
+}
+
+/* --match: snap fixes to a road network with a fixed lag hidden Markov model */
+#define MATCH_CELL 50.0          /* metres, side of a road index cell */
+#define MATCH_RADIUS 50.0        /* metres from a fix a road may be */
+#define MATCH_SIGMA 5.0          /* metres, GPS error */
+#define MATCH_BETA 5.0           /* metres, how far route and straight line distances usually differ */
+#define MATCH_MAX_ITEMS (1u << 24)
+
+static int compare_road_nodes(const void *a, const void *b)
+{
+	const road_node *x = a, *y = b;
+	return (x->id > y->id) - (x->id < y->id);
+}
+
+static int compare_road_items(const void *a, const void *b)
+{
+	const road_item *x = a, *y = b;
+	return (x->cell > y->cell) - (x->cell < y->cell);
+}
+
+static int32_t road_find_node(const road_graph *g, int64_t id)
+{
+	uint32_t lo = 0, hi = g->node_count;
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (g->nodes[mid].id < id) lo = mid + 1;
+		else hi = mid;
+	}
+	return (lo < g->node_count && g->nodes[lo].id == id) ? (int32_t)lo : -1;
+}
+
+static bool road_id(char **save, int64_t *id)
+{
+	char *word = strtok_r(NULL, REF_SEPARATORS, save), *end;
+	if (!word) return false;
+	*id = strtoll(word, &end, 10);
+	return !*end;
+}
+
+/* parse one line of a road file, returning what was wrong with it */
+static const char *road_line(road_graph *g, char *line)
+{
+	char *save, *word = strtok_r(line, REF_SEPARATORS, &save);
+	int64_t id;
+
+	if (!word || '#' == *word) return NULL;
+	if (!road_id(&save, &id)) return "missing id";
+
+	if (!strcmp(word, "node"))
+	{
+		double v[2];
+		if (!ref_numbers(&save, v, 2) || strtok_r(NULL, REF_SEPARATORS, &save)) return "expected node ID LAT LON";
+		if (!ref_grow((void **)&g->nodes, &g->node_size, g->node_count, sizeof(road_node))) return "out of memory";
+
+		road_node *n = &g->nodes[g->node_count++];
+		n->id = id;
+		plane_project(&g->plane, v[0], v[1], &n->x, &n->y);
+		n->first = n->count = 0;
+		return NULL;
+	}
+
+	if (!strcmp(word, "way"))
+	{
+		if (!ref_grow((void **)&g->ways, &g->way_size, g->way_count, sizeof(road_way))) return "out of memory";
+
+		road_way *w = &g->ways[g->way_count];
+		char *end;
+		w->id = id;
+		w->first = g->ref_count;
+		w->count = 0;
+		while ((word = strtok_r(NULL, REF_SEPARATORS, &save)))
+		{
+			int64_t node = strtoll(word, &end, 10);
+			if (*end) return "node ids must be integers";
+			if (!ref_grow((void **)&g->refs, &g->ref_size, g->ref_count, sizeof(int64_t))) return "out of memory";
+			g->refs[g->ref_count++] = node;
+			w->count++;
+		}
+		if (w->count < 2) return "way needs at least two nodes";
+		g->way_count++;
+		return NULL;
+	}
+
+	return "expected node or way";
+}
+
+/* resolve ways into edges, then index the edges by cell */
+static const char *road_build(road_graph *g)
+{
+	if (!g->node_count || !g->way_count) return "no nodes or ways";
+
+	qsort(g->nodes, g->node_count, sizeof(road_node), compare_road_nodes);
+	for (uint32_t i = 1; i < g->node_count; i++)
+		if (g->nodes[i].id == g->nodes[i - 1].id) return "duplicate node";
+
+	for (uint32_t w = 0; w < g->way_count; w++)
+	{
+		const road_way *way = &g->ways[w];
+		for (uint32_t i = way->first; i + 1 < way->first + way->count; i++)
+		{
+			int32_t a = road_find_node(g, g->refs[i]), b = road_find_node(g, g->refs[i + 1]);
+			if (a < 0 || b < 0) return "way refers to an unknown node";
+			if (a == b) continue;
+			if (!ref_grow((void **)&g->edges, &g->edge_size, g->edge_count, sizeof(road_edge))) return "out of memory";
+
+			road_edge *e = &g->edges[g->edge_count++];
+			e->a = (uint32_t)a;
+			e->b = (uint32_t)b;
+			e->way = way->id;
+			e->length = hypot(g->nodes[b].x - g->nodes[a].x, g->nodes[b].y - g->nodes[a].y);
+			g->nodes[a].count++;
+			g->nodes[b].count++;
+		}
+	}
+	if (!g->edge_count) return "no roads";
+
+	/* edges of each node, side by side */
+	g->adjacent = malloc(2 * (size_t)g->edge_count * sizeof(uint32_t));
+	g->edge_seen = calloc(g->edge_count, sizeof(uint32_t));
+	g->dist = malloc(g->node_count * sizeof(double));
+	g->touched = malloc(g->node_count * sizeof(uint32_t));
+	if (!g->adjacent || !g->edge_seen || !g->dist || !g->touched) return "out of memory";
+
+	uint32_t next = 0;
+	for (uint32_t i = 0; i < g->node_count; i++)
+	{
+		g->nodes[i].first = next;
+		next += g->nodes[i].count;
+		g->nodes[i].count = 0;
+		g->dist[i] = INFINITY;
+	}
+	for (uint32_t i = 0; i < g->edge_count; i++)
+	{
+		road_node *a = &g->nodes[g->edges[i].a], *b = &g->nodes[g->edges[i].b];
+		g->adjacent[a->first + a->count++] = i;
+		g->adjacent[b->first + b->count++] = i;
+	}
+
+	for (uint32_t i = 0; i < g->edge_count; i++)
+	{
+		const road_node *a = &g->nodes[g->edges[i].a], *b = &g->nodes[g->edges[i].b];
+		int32_t cx0 = (int32_t)floor(fmin(a->x, b->x) / MATCH_CELL), cx1 = (int32_t)floor(fmax(a->x, b->x) / MATCH_CELL);
+		int32_t cy0 = (int32_t)floor(fmin(a->y, b->y) / MATCH_CELL), cy1 = (int32_t)floor(fmax(a->y, b->y) / MATCH_CELL);
+
+		if ((double)(cx1 - cx0 + 1) * (cy1 - cy0 + 1) > MATCH_MAX_ITEMS - g->item_count) return "roads cover too large an area";
+		for (int32_t cx = cx0; cx <= cx1; cx++)
+		{
+			for (int32_t cy = cy0; cy <= cy1; cy++)
+			{
+				if (!ref_grow((void **)&g->items, &g->item_size, g->item_count, sizeof(road_item))) return "out of memory";
+				g->items[g->item_count].cell = grid_key(cx, cy);
+				g->items[g->item_count].edge = i;
+				g->item_count++;
+			}
+		}
+	}
+	qsort(g->items, g->item_count, sizeof(road_item), compare_road_items);
+
+	/* only the graph is needed from here on */
+	free(g->refs);
+	free(g->ways);
+	g->refs = NULL;
+	g->ways = NULL;
+	g->ref_count = g->way_count = 0;
+	return NULL;
+}
+
+static void match_free(map_matcher *m)
+{
+	if (!m) return;
+	road_graph *g = &m->graph;
+	free(g->nodes);
+	free(g->edges);
+	free(g->adjacent);
+	free(g->ways);
+	free(g->refs);
+	free(g->items);
+	free(g->edge_seen);
+	free(g->dist);
+	free(g->touched);
+	free(g->heap);
+	free(m);
+}
+
+/* read a road network of nodes and ways, printing what's wrong if it can't be used */
+static map_matcher *match_load(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+	{
+		fprintf(stderr, "ERROR: unable to open %s\n", path);
+		return NULL;
+	}
+
+	map_matcher *m = calloc(1, sizeof(map_matcher));
+	char *line = NULL;
+	size_t line_size = 0;
+	uint32_t number = 0;
+	const char *error = m ? NULL : "out of memory";
+
+	while (!error && getline(&line, &line_size, fp) >= 0)
+	{
+		number++;
+		error = road_line(&m->graph, line);
+	}
+	free(line);
+
+	if (error)
+	{
+		fprintf(stderr, "ERROR: %s:%u: %s\n", path, number, error);
+	}
+	else
+	{
+		error = ferror(fp) ? "read error" : road_build(&m->graph);
+		if (error) fprintf(stderr, "ERROR: %s: %s\n", path, error);
+	}
+	fclose(fp);
+
+	if (error)
+	{
+		match_free(m);
+		return NULL;
+	}
+	return m;
+}
+
+static void road_heap_push(road_graph *g, double dist, uint32_t node)
+{
+	if (!ref_grow((void **)&g->heap, &g->heap_size, g->heap_count, sizeof(road_heap_entry))) return;
+
+	uint32_t i = g->heap_count++;
+	while (i && g->heap[(i - 1) / 2].dist > dist)
+	{
+		g->heap[i] = g->heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	g->heap[i].dist = dist;
+	g->heap[i].node = node;
+}
+
+static road_heap_entry road_heap_pop(road_graph *g)
+{
+	road_heap_entry top = g->heap[0], last = g->heap[--g->heap_count];
+	uint32_t i = 0;
+
+	for (;;)
+	{
+		uint32_t c = 2 * i + 1;
+		if (c >= g->heap_count) break;
+		if (c + 1 < g->heap_count && g->heap[c + 1].dist < g->heap[c].dist) c++;
+		if (g->heap[c].dist >= last.dist) break;
+		g->heap[i] = g->heap[c];
+		i = c;
+	}
+	if (g->heap_count) g->heap[i] = last;
+	return top;
+}
+
+static void road_relax(road_graph *g, uint32_t node, double dist)
+{
+	if (dist >= g->dist[node]) return;
+	if (isinf(g->dist[node])) g->touched[g->touched_count++] = node;
+	g->dist[node] = dist;
+	road_heap_push(g, dist, node);
+}
+
+/* shortest distances from a point on an edge to every node within "limit" */
+static void road_distances(road_graph *g, const match_candidate *from, double limit)
+{
+	const road_edge *e = &g->edges[from->edge];
+
+	for (uint32_t i = 0; i < g->touched_count; i++) g->dist[g->touched[i]] = INFINITY;
+	g->touched_count = 0;
+	g->heap_count = 0;
+
+	road_relax(g, e->a, from->f * e->length);
+	road_relax(g, e->b, (1.0 - from->f) * e->length);
+	while (g->heap_count)
+	{
+		road_heap_entry top = road_heap_pop(g);
+		if (top.dist > g->dist[top.node] || top.dist > limit) continue;
+
+		const road_node *n = &g->nodes[top.node];
+		for (uint32_t i = n->first; i < n->first + n->count; i++)
+		{
+			const road_edge *next = &g->edges[g->adjacent[i]];
+			road_relax(g, next->a == top.node ? next->b : next->a, top.dist + next->length);
+		}
+	}
+}
+
+/* the nearest points of the nearest roads, nearest first */
+static uint32_t match_candidates(road_graph *g, double x, double y, match_candidate *out)
+{
+	int32_t cx0 = (int32_t)floor((x - MATCH_RADIUS) / MATCH_CELL), cx1 = (int32_t)floor((x + MATCH_RADIUS) / MATCH_CELL);
+	int32_t cy0 = (int32_t)floor((y - MATCH_RADIUS) / MATCH_CELL), cy1 = (int32_t)floor((y + MATCH_RADIUS) / MATCH_CELL);
+	uint32_t count = 0;
+
+	g->search++;
+	for (int32_t cx = cx0; cx <= cx1; cx++)
+	{
+		for (int32_t cy = cy0; cy <= cy1; cy++)
+		{
+			int64_t cell = grid_key(cx, cy);
+			uint32_t lo = 0, hi = g->item_count;
+			while (lo < hi)
+			{
+				uint32_t mid = lo + (hi - lo) / 2;
+				if (g->items[mid].cell < cell) lo = mid + 1;
+				else hi = mid;
+			}
+
+			for (; lo < g->item_count && g->items[lo].cell == cell; lo++)
+			{
+				uint32_t edge = g->items[lo].edge;
+				if (g->edge_seen[edge] == g->search) continue;
+				g->edge_seen[edge] = g->search;
+
+				const road_edge *e = &g->edges[edge];
+				const road_node *a = &g->nodes[e->a], *b = &g->nodes[e->b];
+				double dx = b->x - a->x, dy = b->y - a->y;
+				double f = e->length > 0.0 ? fmax(0.0, fmin(1.0, ((x - a->x) * dx + (y - a->y) * dy) / (e->length * e->length))) : 0.0;
+				match_candidate c = { edge, f, a->x + f * dx, a->y + f * dy, 0.0, 0.0, 0 };
+				c.offset = hypot(x - c.x, y - c.y);
+				if (c.offset > MATCH_RADIUS) continue;
+
+				/* insertion into the few kept so far */
+				uint32_t i = count < MATCH_CANDIDATES ? count++ : MATCH_CANDIDATES;
+				if (i == MATCH_CANDIDATES && c.offset >= out[i - 1].offset) continue;
+				if (i == MATCH_CANDIDATES) i--;
+				while (i && out[i - 1].offset > c.offset)
+				{
+					out[i] = out[i - 1];
+					i--;
+				}
+				out[i] = c;
+			}
+		}
+	}
+	return count;
+}
+
+static void match_print(const output_options *out, const match_step *step)
+{
+	char ftimestr[64];
+
+	if (out->print_filepath)
+		printf("\"%s\", ", step->p.job->path);
+	else if (out->print_filename)
+		printf("\"%s\", ", step->p.job->display_name);
+	strftime(ftimestr, sizeof(ftimestr), "%Y-%m-%dT%H:%M:%S", gmtime(&step->p.time));
+	printf("%f, %s.%03dZ, %.6f, %.6f, ", step->p.t * 1000.0, ftimestr, (int)step->p.milliseconds, step->p.lat, step->p.lon);
+
+	if (!step->count)
+	{
+		printf(", , , \n");
+		return;
+	}
+
+	const match_candidate *c = &step->candidates[step->choice];
+	double lat, lon;
+	plane_unproject(&out->matcher->graph.plane, c->x, c->y, &lat, &lon);
+	printf("%.6f, %.6f, %lld, %.1f\n", lat, lon, (long long)out->matcher->graph.edges[c->edge].way, c->offset);
+}
+
+static uint32_t match_best(const match_step *step)
+{
+	uint32_t best = 0;
+	for (uint32_t i = 1; i < step->count; i++)
+		if (step->candidates[i].score > step->candidates[best].score) best = i;
+	return best;
+}
+
+/* decide every held fix along the best path to the newest, and print them */
+static void match_flush(output_options *out)
+{
+	map_matcher *m = out->matcher;
+	if (!m->count) return;
+
+	uint32_t k = match_best(&m->steps[(m->first + m->count - 1) % (MATCH_LAG + 1)]);
+	for (uint32_t i = m->count; i-- > 0; )
+	{
+		match_step *step = &m->steps[(m->first + i) % (MATCH_LAG + 1)];
+		step->choice = k;
+		k = step->candidates[k].back;
+	}
+	for (uint32_t i = 0; i < m->count; i++)
+		match_print(out, &m->steps[(m->first + i) % (MATCH_LAG + 1)]);
+	m->count = 0;
+}
+
+static double match_emission(const match_candidate *c)
+{
+	return -0.5 * (c->offset / MATCH_SIGMA) * (c->offset / MATCH_SIGMA);
+}
+
+static void match_sample(output_options *out, const file_job *job, const gps_sample *s)
+{
+	map_matcher *m = out->matcher;
+	road_graph *g = &m->graph;
+	segment_point p = { job, out->file_start + s->cts, s->time, s->milliseconds, s->lat, s->lon, s->fix >= 2.0 };
+
+	/* nothing is carried across an outage */
+	if (m->count)
+	{
+		const match_step *last = &m->steps[(m->first + m->count - 1) % (MATCH_LAG + 1)];
+		if (p.t - last->p.t > SEGMENT_GAP || p.t < last->p.t) match_flush(out);
+	}
+
+	match_step *prev = m->count ? &m->steps[(m->first + m->count - 1) % (MATCH_LAG + 1)] : NULL;
+	match_step *step = &m->steps[(m->first + m->count) % (MATCH_LAG + 1)];
+
+	step->p = p;
+	plane_project(&g->plane, s->lat, s->lon, &step->x, &step->y);
+	step->count = p.located ? match_candidates(g, step->x, step->y, step->candidates) : 0;
+	step->choice = 0;
+
+	for (uint32_t i = 0; i < step->count; i++)
+	{
+		step->candidates[i].score = prev ? -INFINITY : match_emission(&step->candidates[i]);
+		step->candidates[i].back = 0;
+	}
+
+	/* from each earlier candidate, by road, compared with as the crow flies */
+	double crow = prev ? hypot(step->x - prev->x, step->y - prev->y) : 0.0;
+	for (uint32_t j = 0; prev && j < prev->count; j++)
+	{
+		const match_candidate *from = &prev->candidates[j];
+		bool searched = false;
+
+		if (isinf(from->score)) continue;
+		for (uint32_t i = 0; i < step->count; i++)
+		{
+			match_candidate *c = &step->candidates[i];
+			const road_edge *e = &g->edges[c->edge];
+			double route;
+
+			if (from->edge == c->edge)
+			{
+				route = fabs(c->f - from->f) * e->length;
+			}
+			else
+			{
+				/* one search from each earlier candidate serves every candidate of this fix */
+				if (!searched) road_distances(g, from, 2.0 * crow + 2.0 * MATCH_RADIUS);
+				searched = true;
+				route = fmin(g->dist[e->a] + c->f * e->length, g->dist[e->b] + (1.0 - c->f) * e->length);
+			}
+			if (isinf(route)) continue;
+
+			double score = from->score + match_emission(c) - fabs(route - crow) / MATCH_BETA;
+			if (score > c->score)
+			{
+				c->score = score;
+				c->back = j;
+			}
+		}
+	}
+
+	/* a fix no road reaches starts afresh, and one with no road near is printed as it is */
+	bool reached = false;
+	for (uint32_t i = 0; i < step->count; i++)
+		if (!isinf(step->candidates[i].score)) reached = true;
+	if (prev && !reached)
+	{
+		match_step held = *step;
+		match_flush(out);
+		step = &m->steps[m->first];
+		*step = held;
+		for (uint32_t i = 0; i < step->count; i++)
+			step->candidates[i].score = match_emission(&step->candidates[i]);
+	}
+	if (!step->count)
+	{
+		match_print(out, step);
+		return;
+	}
+
+	m->count++;
+	if (m->count <= MATCH_LAG) return;
+
+	/* the oldest fix is decided by the best path to the newest */
+	uint32_t k = match_best(step);
+	for (uint32_t i = m->count - 1; i > 0; i--)
+		k = m->steps[(m->first + i) % (MATCH_LAG + 1)].candidates[k].back;
+	m->steps[m->first].choice = k;
+	match_print(out, &m->steps[m->first]);
+	m->first = (m->first + 1) % (MATCH_LAG + 1);
+	m->count--;
+}
+
+static void resample_print(const output_options *out, const segment_point *p, double distance, double alt)
+{
+	if (out->print_filepath)
+		printf("\"%s\", ", p->job->path);
+	else if (out->print_filename)
+		printf("\"%s\", ", p->job->display_name);
+	printf("%.3f, %f, ", distance, p->t * 1000.0);
+	print_segment_point(p);
+	printf(", %.6f, %.6f, %.3f\n", p->lat, p->lon, alt);
+}
+
+/* --every_distance: interpolate a sample at each multiple of the spacing along the track */
+static void resample_sample(output_options *out, const file_job *job, const gps_sample *s)
+{
+	resampler *rs = &out->rs;
+	segment_point p = { job, out->file_start + s->cts, s->time, s->milliseconds, s->lat, s->lon, true };
+
+	if (s->fix < 2.0) return;
+
+	if (!rs->started)
+	{
+		resample_print(out, &p, 0.0, s->alt);
+		rs->started = true;
+		rs->next = out->every_distance;
+	}
+	else if (p.t > rs->last.t)
+	{
+		double step = haversine(rs->last.lat, rs->last.lon, p.lat, p.lon);
+
+		if (p.t - rs->last.t > SEGMENT_GAP)
+		{
+			/* the track across an outage is unknown, so nothing is made up along it */
+			if (rs->next <= rs->distance + step)
+				rs->next += (floor((rs->distance + step - rs->next) / out->every_distance) + 1.0) * out->every_distance;
+		}
+		for (; rs->next <= rs->distance + step; rs->next += out->every_distance)
+		{
+			double u = (rs->next - rs->distance) / step;
+			segment_point q;
+			ref_interpolate(&rs->last, &p, u, &q);
+			resample_print(out, &q, rs->next, rs->alt + u * (s->alt - rs->alt));
+		}
+		rs->distance += step;
+	}
+	else
+	{
+		return; /* out of order or repeated */
+	}
+
+	rs->last = p;
+	rs->alt = s->alt;
+}
+
+/*
+--replay: samples are sent as NMEA GGA and RMC sentences, or as binary records, as their time on the stitched
+timeline comes round again (scaled by the replay speed); deadlines are absolute on the monotonic clock, so time
+spent decoding and writing never builds up as drift
+*/
+#define REPLAY_MEM_LIMIT (16u * 1024u * 1024u) /* how far the decoders may run ahead, unless --mem_limit says */
+#define REPLAY_RECORD 72                       /* bytes of a binary record: nine little-endian doubles */
+#define REPLAY_MIN_MOVE 1.0                    /* metres between fixes below which the course is kept */
+
+static void replay_wait(replayer *r, double t)
+{
+	struct timespec deadline;
+
+	if (!r->started)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &r->clock0);
+		r->first = t;
+		r->started = true;
+	}
+	if (t <= r->first) return;
+
+	double ahead = (t - r->first) / r->speed;
+	deadline.tv_sec = r->clock0.tv_sec + (time_t)ahead;
+	deadline.tv_nsec = r->clock0.tv_nsec + (long)((ahead - floor(ahead)) * 1e9);
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL));
+}
+
+/* one write per record, so each is one datagram over UDP; a UDP listener coming and going is no error */
+static void replay_write(replayer *r, const void *data, size_t length)
+{
+	ssize_t written;
+
+	while ((written = write(r->fd, data, length)) < 0 && EINTR == errno);
+	if (written < 0 && ECONNREFUSED != errno && !r->failed)
+	{
+		fprintf(stderr, "ERROR: --replay output failed: %s\n", strerror(errno));
+		r->failed = true;
+	}
+}
+
+/* "ddmm.mmmmm,N" from degrees, with "digits" of degrees */
+static int nmea_angle(char *text, size_t size, double degrees, int digits, char positive, char negative)
+{
+	uint64_t total = (uint64_t)llround(fabs(degrees) * 60.0 * 100000.0);
+	return snprintf(text, size, "%0*u%02u.%05u,%c", digits, (unsigned)(total / 6000000), (unsigned)(total / 100000 % 60),
+		(unsigned)(total % 100000), (degrees < 0.0) ? negative : positive);
+}
+
+/* append the checksum and line end to a sentence of "length" bytes, cutting a sentence too long for "size" short */
+static size_t nmea_finish(char *sentence, size_t length, size_t size)
+{
+	uint8_t sum = 0;
+
+	if (length + sizeof("*XX\r\n") > size) length = size - sizeof("*XX\r\n");
+
+	for (size_t i = 1; i < length; i++) sum ^= (uint8_t)sentence[i];
+	return length + (size_t)snprintf(sentence + length, size - length, "*%02X\r\n", sum);
+}
+
+static void replay_nmea(replayer *r, const gps_sample *s, double dop)
+{
+	char clock[16] = "", date[8] = "", lat[24], lon[24], text[256];
+	bool valid = s->fix >= 2.0;
+	size_t length;
+
+	if (s->time > 0)
+	{
+		struct tm tm;
+		gmtime_r(&s->time, &tm);
+		/* each field reduced to two digits, so the buffers provably hold them */
+		snprintf(clock, sizeof(clock), "%02u%02u%02u.%02u", (unsigned)tm.tm_hour % 100u, (unsigned)tm.tm_min % 100u,
+			(unsigned)tm.tm_sec % 100u, (unsigned)(s->milliseconds / 10.0) % 100u);
+		snprintf(date, sizeof(date), "%02u%02u%02u", (unsigned)tm.tm_mday % 100u, (unsigned)(tm.tm_mon + 1) % 100u, (unsigned)tm.tm_year % 100u);
+	}
+	nmea_angle(lat, sizeof(lat), s->lat, 2, 'N', 'S');
+	nmea_angle(lon, sizeof(lon), s->lon, 3, 'E', 'W');
+
+	length = (size_t)snprintf(text, sizeof(text), "$GPGGA,%s,%s,%s,%d,,%.1f,%.1f,M,,M,,", clock, lat, lon, valid ? 1 : 0, dop, s->alt);
+	length = nmea_finish(text, length, sizeof(text));
+	size_t gga = length;
+	length += (size_t)snprintf(text + length, sizeof(text) - length, "$GPRMC,%s,%c,%s,%s,%.2f,%.1f,%s,,,%c", clock, valid ? 'A' : 'V',
+		lat, lon, s->speed2d * 3600.0 / 1852.0, r->course, date, valid ? 'A' : 'N');
+	length = gga + nmea_finish(text + gga, length - gga, sizeof(text) - gga);
+	replay_write(r, text, length);
+}
+
+static void replay_binary(replayer *r, double t, const gps_sample *s, double dop)
+{
+	double values[REPLAY_RECORD / 8] = { t, (s->time > 0) ? (double)s->time + s->milliseconds / 1000.0 : NAN,
+		s->lat, s->lon, s->alt, s->speed2d, s->speed3d, s->fix, dop };
+	uint8_t record[REPLAY_RECORD];
+
+	for (int v = 0; v < REPLAY_RECORD / 8; v++)
+	{
+		uint64_t bits;
+		memcpy(&bits, &values[v], sizeof(bits));
+		for (int b = 0; b < 8; b++) record[8 * v + b] = (uint8_t)(bits >> (8 * b));
+	}
+	replay_write(r, record, sizeof(record));
+}
+
+static void replay_sample(output_options *out, const file_job *job, const gps_sample *s)
+{
+	replayer *r = out->replay;
+	history_sample h = { out->file_start + s->cts, s->speed2d, s->lat, s->lon };
+	double dop = s->gps9 ? s->precision : s->precision / 100.0; /* GPS5's GPSP is DOP x 100 */
+
+	/* course over ground, from the last fix far enough away to give one */
+	if (s->fix >= 2.0)
+	{
+		if (!r->have_last)
+		{
+			r->last = h;
+			r->have_last = true;
+		}
+		else if (haversine(r->last.lat, r->last.lon, h.lat, h.lon) >= REPLAY_MIN_MOVE)
+		{
+			r->course = fmod(bearing(&r->last, &h) * 180.0 / M_PI + 360.0, 360.0);
+			r->last = h;
+		}
+	}
+
+	replay_wait(r, h.t);
+	if (r->binary) replay_binary(r, h.t, s, dop);
+	else replay_nmea(r, s, dop);
+}
+
+/* "udp:HOST:PORT", a file or device such as a pty, or stdout if NULL or "-" */
+static bool replay_open(replayer *r, const char *to)
+{
+	r->fd = STDOUT_FILENO;
+	if (!to || !strcmp(to, "-")) return true;
+
+	if (!strncmp(to, "udp:", 4))
+	{
+		const char *port = strrchr(to + 4, ':');
+		struct addrinfo hints, *found = NULL, *a;
+		char host[256];
+
+		if (!port || (size_t)(port - (to + 4)) >= sizeof(host))
+		{
+			fprintf(stderr, "ERROR: --replay_to must be udp:HOST:PORT\n");
+			return false;
+		}
+		memcpy(host, to + 4, port - (to + 4));
+		host[port - (to + 4)] = '\0';
+		if ('[' == host[0] && strlen(host) > 1 && ']' == host[strlen(host) - 1])
+		{
+			memmove(host, host + 1, strlen(host) - 2);
+			host[strlen(host) - 2] = '\0';
+		}
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_DGRAM;
+		int status = getaddrinfo(host, port + 1, &hints, &found);
+		if (status)
+		{
+			fprintf(stderr, "ERROR: --replay_to %s: %s\n", to, gai_strerror(status));
+			return false;
+		}
+		for (a = found; a; a = a->ai_next)
+		{
+			if ((r->fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol)) < 0) continue;
+			if (0 == connect(r->fd, a->ai_addr, a->ai_addrlen)) break;
+			close(r->fd);
+			r->fd = -1;
+		}
+		freeaddrinfo(found);
+	}
+	else
+	{
+		r->fd = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_NOCTTY, 0644);
+	}
+
+	if (r->fd < 0)
+	{
+		fprintf(stderr, "ERROR: unable to open %s for --replay\n", to);
+		return false;
+	}
+	return true;
+}
+
+static void replay_close(replayer *r)
+{
+	if (r->fd >= 0 && STDOUT_FILENO != r->fd) close(r->fd);
+	r->fd = -1;
+}
+
+static void output_sample(output_options *out, const file_job *job, const gps_sample *s)
+{
+	if (s->filtered && !out->segments) return;
+	if (out->where && (s->accl || !where_sample(out->where, s))) return;
+	if (out->ev) event_sample(out, job, s);
+	else if (s->accl) return;
+	else if (out->replay) replay_sample(out, job, s);
+	else if (out->refs) reference_sample(out, job, s);
+	else if (out->matcher) match_sample(out, job, s);
+	else if (out->every_distance > 0.0) resample_sample(out, job, s);
+	else if (out->segments) segment_sample(out, job, s);
+	else print_sample(out, job, s);
+}
+
+/* everything a stream handler needs while decoding one file */
+typedef struct decode_context
+{
+	file_job *job;
+	decode_state *state;
+	const decode_options *opt;
+	const sample_sink *sink;
+	void *ctx;
+	double start, finish; /* time span of the current payload */
+	double file_finish;
+	stream_meta meta; /* metadata of the stream being walked, pointing into the current payload */
+	const char *abort_reason; /* set when a --safe limit is hit */
+} decode_context;
+
+/*
+a handler for one FOURCC
+init is called once per file, decode for every KLV with the handler's key, and flush after each payload
+*/
+typedef struct stream_handler
+{
+	uint32_t key;
+	void (*init)(decode_context *dc);
+	void (*decode)(decode_context *dc, GPMF_stream *ms, uint32_t samples);
+	void (*flush)(decode_context *dc);
+} stream_handler;
+
+static void stream_reset(decode_context *dc)
+{
+	memset(&dc->meta, 0, sizeof(dc->meta));
+}
+
+static void stream_begin(decode_context *dc, GPMF_stream *ms, uint32_t samples)
+{
+	stream_reset(dc);
+}
+
+static void stream_type(decode_context *dc, GPMF_stream *ms, uint32_t samples)
+{
+	stream_meta_set(&dc->meta, META_TYPE, ms);
+}
+
+static void stream_scale(decode_context *dc, GPMF_stream *ms, uint32_t samples)
+{
+	stream_meta_set(&dc->meta, META_SCAL, ms);
+}
+
+static void stream_name(decode_context *dc, GPMF_stream *ms, uint32_t samples)
+{
+	stream_meta_set(&dc->meta, META_STNM, ms);
+}
+
+static void stream_units(decode_context *dc, GPMF_stream *ms, uint32_t samples)
+{
+	/* prefer UNIT, but SIUN will do */
+	if ( (GPMF_KEY_UNITS == GPMF_Key(ms)) || !dc->meta.data[META_UNIT] )
+		stream_meta_set(&dc->meta, META_UNIT, ms);
+}
+
+/* GPSU's "yymmddhhmmss.sss" in milliseconds since 1970 */
+static int64_t gpsu_time(const char *gpsu_string)
+{
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+
+	/* GoPro provides the time as a fixed-size ASCII string, which we must convert to something useable */
+	tm.tm_year  = 10 * (gpsu_string[0]  - '0') + (gpsu_string[1]  - '0');
+	tm.tm_year += 100;
+	tm.tm_mon   = 10 * (gpsu_string[2]  - '0') + (gpsu_string[3]  - '0');
+	tm.tm_mon--; /* struct tm uses an ordinal month */
+	tm.tm_mday  = 10 * (gpsu_string[4]  - '0') + (gpsu_string[5]  - '0');
+	tm.tm_hour  = 10 * (gpsu_string[6]  - '0') + (gpsu_string[7]  - '0');
+	tm.tm_min   = 10 * (gpsu_string[8]  - '0') + (gpsu_string[9]  - '0');
+	tm.tm_sec   = 10 * (gpsu_string[10] - '0') + (gpsu_string[11] - '0');
+	return (int64_t)timegm(&tm) * 1000 + 100 * (gpsu_string[13] - '0') + 10 * (gpsu_string[14] - '0') + (gpsu_string[15] - '0');
+}
+
+static void gps5_clock_anchor(gps5_clock *c, int64_t utc)
+{
+	if (c->used)
+	{
+		uint32_t last = (c->next + GPS5_RATE_WINDOW - 1) % GPS5_RATE_WINDOW;
+		int64_t ms = utc - c->utc[last];
+		uint64_t count = c->samples - c->index[last];
+
+		/* without a fix GPSU can stand still, so the samples carry on from the last time that moved */
+		if (ms <= 0 || !count) return;
+
+		/* a jump that doesn't fit the nominal rate, such as the GPS time being set, starts the fit over */
+		if (ms * GPS5_RATE < 500.0 * count || ms * GPS5_RATE > 2000.0 * count) c->used = 0;
+	}
+
+	c->utc[c->next] = utc;
+	c->index[c->next] = c->samples;
+	c->next = (c->next + 1) % GPS5_RATE_WINDOW;
+	if (c->used < GPS5_RATE_WINDOW) c->used++;
+	c->at = c->samples;
+	c->base = (double)utc;
+	c->period = 0.0;
+	if (c->used < 2) return;
+
+	/* least squares, relative to this GPSU and oldest first so that every decode of it rounds the same */
+	double n = c->used, sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0;
+	for (uint32_t k = 0; k < c->used; k++)
+	{
+		uint32_t slot = (c->next + GPS5_RATE_WINDOW - c->used + k) % GPS5_RATE_WINDOW;
+		double x = (double)c->index[slot] - (double)c->samples;
+		double y = (double)(c->utc[slot] - utc);
+		sx += x; sy += y; sxx += x * x; sxy += x * y;
+	}
+	c->period = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+	c->base += (sy - c->period * sx) / n;
+}
+
+/* milliseconds since 1970 of the next GPS5 sample; "step" is the MP4's seconds per sample */
+static int64_t gps5_clock_next(gps5_clock *c, double step)
+{
+	double period = c->period > 0.0 ? c->period : step * 1000.0;
+	return llround(c->base + (double)(c->samples++ - c->at) * period);
+}
+
+static void gpsu_decode(decode_context *dc, GPMF_stream *ms, uint32_t samples)
+{
+	if (GPMF_StructSize(ms) < 16) return;
+
+	dc->file_finish = dc->finish;
+	gps5_clock_anchor(&dc->state->gps5, gpsu_time(GPMF_RawData(ms)));
+}
+
+static void gpsf_decode(decode_context *dc, GPMF_stream *ms, uint32_t samples)
+{
+	dc->file_finish = dc->finish;
+	dc->state->fix = (uint32_t)read_value(GPMF_RawData(ms), (char)GPMF_Type(ms));
+}
+
+static void gpsp_decode(decode_context *dc, GPMF_stream *ms, uint32_t samples)
+{
+	dc->file_finish = dc->finish;
+	dc->state->precision = (uint16_t)read_value(GPMF_RawData(ms), (char)GPMF_Type(ms));
+}
+
+/* run the stream's decode plan over this KLV's samples */
+static double *gps_rows(decode_context *dc, GPMF_stream *ms, uint32_t samples)
+{
+	const decode_plan *plan = stream_plan(dc->state, GPMF_Key(ms), &dc->meta, ms);
+	if (!plan || samples * plan->structsize > GPMF_RawDataSize(ms)) return NULL;
+
+	size_t bytes;
+	if (!checked_size(samples, COL_COUNT * sizeof(double), &bytes) || (dc->opt->max_alloc && bytes > dc->opt->max_alloc))
+	{
+		dc->abort_reason = "decoded stream exceeds --max_alloc";
+		return NULL;
+	}
+
+	double *rows = plan_rows(dc->job, dc->state, samples, bytes);
+	if (!rows) return NULL;
+
+	run_plan(plan, GPMF_RawData(ms), samples, rows);
+	dc->file_finish = dc->finish;
+	return rows;
+}
+
+static void gps5_decode(decode_context *dc, GPMF_stream *ms, uint32_t samples)
+{
+	decode_state *state = dc->state;
+	const decode_options *opt = dc->opt;
+
+	/* at this point, we should have all the data (with "GPS5" being at the highest sample rate) */
+	double *rows = gps_rows(dc, ms, samples);
+	if (!rows || state->use_gps9) return;
+
+	double step = (dc->finish - dc->start) / (double)samples;
+	double now = dc->start;
+
+	for (uint32_t i = 0; i < samples; i++, rows += COL_COUNT)
+	{
+		int64_t utc = gps5_clock_next(&state->gps5, step);
+
+		/* apply filters if specified */
+		bool passed = (opt->min_fix < 0 || (int)state->fix >= opt->min_fix) &&
+		              (opt->max_precision < 0 || (int)state->precision <= opt->max_precision);
+		if (passed || opt->keep_filtered)
+		{
+			gps_sample s;
+			s.cts = now;
+			s.time = (time_t)(utc / 1000);
+			s.milliseconds = (double)(utc % 1000);
+			s.lat = rows[COL_LAT]; s.lon = rows[COL_LON]; s.alt = rows[COL_ALT];
+			s.speed2d = rows[COL_SPEED2D]; s.speed3d = rows[COL_SPEED3D];
+			s.fix = state->fix;
+			s.precision = state->precision;
+			s.gps9 = false;
+			s.accl = false;
+			s.filtered = !passed;
+			dc->sink->sample(dc->ctx, dc->job, &s);
+			dc->job->samples += passed;
+		}
+
+		now += step;
+	}
+}
+
+static void gps9_decode(decode_context *dc, GPMF_stream *ms, uint32_t samples)
+{
+	decode_state *state = dc->state;
+	const decode_options *opt = dc->opt;
+
+	double *rows = gps_rows(dc, ms, samples);
+	if (!rows) return;
+
+	double step = (dc->finish - dc->start) / (double)samples;
+	int64_t epoch_ms = (int64_t)opt->gps9_epoch * 1000;
+
+	state->use_gps9 = true;
+
+	for (uint32_t i = 0; i < samples; i++, rows += COL_COUNT)
+	{
+		int gps9_fix = (int)rows[COL_FIX];
+		int gps9_precision = (int)rows[COL_DOP];
+		double now = dc->start + i * step;
+
+		/*
+		every sample has its own time, as whole days since 2000 and milliseconds since midnight; only a sample
+		without one (before the receiver has the time) is placed by its cts from the last sample that had one
+		*/
+		int64_t days = (int64_t)rows[COL_DAYS];
+		int64_t ms = llround(rows[COL_SECS] * 1000.0);
+		int64_t utc = epoch_ms + (days + 1) * 86400000 + ms;
+
+		if (days > 0 && ms >= 0 && ms < 86400000)
+		{
+			state->gps9_anchored = true;
+			state->gps9_anchor = utc;
+			state->gps9_anchor_cts = now;
+		}
+		else if (state->gps9_anchored)
+		{
+			utc = state->gps9_anchor + llround((now - state->gps9_anchor_cts) * 1000.0);
+		}
+
+		/* apply filters if specified */
+		bool passed = (opt->min_fix < 0 || gps9_fix >= opt->min_fix) &&
+		              (opt->max_precision < 0 || gps9_precision <= opt->max_precision);
+		if (passed || opt->keep_filtered)
+		{
+			gps_sample s;
+			s.cts = now;
+			s.time = (time_t)(utc / 1000);
+			s.milliseconds = (double)(utc % 1000);
+			s.lat = rows[COL_LAT]; s.lon = rows[COL_LON]; s.alt = rows[COL_ALT];
+			s.speed2d = rows[COL_SPEED2D]; s.speed3d = rows[COL_SPEED3D];
+			s.fix = rows[COL_FIX];
+			s.precision = rows[COL_DOP];
+			s.gps9 = true;
+			s.accl = false;
+			s.filtered = !passed;
+			dc->sink->sample(dc->ctx, dc->job, &s);
+			dc->job->samples += passed;
+		}
+	}
+}
+
+static void accl_decode(decode_context *dc, GPMF_stream *ms, uint32_t samples)
+{
+	char type = (char)GPMF_Type(ms);
+	uint32_t size = GPMF_SizeofType((GPMF_SampleType)type);
+	uint32_t structsize = GPMF_StructSize(ms);
+
+	if (!dc->opt->accl || !size || structsize != 3 * size || samples * structsize > GPMF_RawDataSize(ms)) return;
+
+	const uint8_t *data = GPMF_RawData(ms);
+	double scale[3] = { field_scale(&dc->meta, 0), field_scale(&dc->meta, 1), field_scale(&dc->meta, 2) };
+	double step = (dc->finish - dc->start) / (double)samples;
+	gps_sample s;
+
+	memset(&s, 0, sizeof(s));
+	s.accl = true;
+	for (uint32_t i = 0; i < samples; i++, data += structsize)
+	{
+		s.cts = dc->start + i * step;
+		for (int f = 0; f < 3; f++) s.accel[f] = read_value(data + f * size, type) / scale[f];
+		dc->sink->sample(dc->ctx, dc->job, &s);
+	}
+}
+
+/* everything the decoder understands; new sensors only need an entry here */
+static const stream_handler stream_handlers[] =
+{
+	{ GPMF_KEY_STREAM,      stream_reset, stream_begin, stream_reset },
+	{ GPMF_KEY_TYPE,        NULL, stream_type,  NULL },
+	{ GPMF_KEY_SCALE,       NULL, stream_scale, NULL },
+	{ GPMF_KEY_STREAM_NAME, NULL, stream_name,  NULL },
+	{ GPMF_KEY_UNITS,       NULL, stream_units, NULL },
+	{ GPMF_KEY_SI_UNITS,    NULL, stream_units, NULL },
+	{ MAKEID('G','P','S','U'), NULL, gpsu_decode, NULL },
+	{ MAKEID('G','P','S','F'), NULL, gpsf_decode, NULL },
+	{ MAKEID('G','P','S','P'), NULL, gpsp_decode, NULL },
+	{ MAKEID('G','P','S','5'), NULL, gps5_decode, NULL },
+	{ MAKEID('G','P','S','9'), NULL, gps9_decode, NULL },
+	{ MAKEID('A','C','C','L'), NULL, accl_decode, NULL },
 };
 
+#define HANDLER_COUNT (sizeof(stream_handlers) / sizeof(*stream_handlers))
+#define HANDLER_SLOT_BITS 6
+
+/* perfect hash from FOURCC to handler: one multiply, one shift and one compare per KLV */
+static uint8_t handler_slots[1 << HANDLER_SLOT_BITS]; /* index + 1 into stream_handlers, 0 if empty */
+static uint32_t handler_multiplier;
+
+static uint32_t handler_slot(uint32_t key)
+{
+	return (key * handler_multiplier) >> (32 - HANDLER_SLOT_BITS);
+}
+
+/* search for a multiplier that gives every registered FOURCC a slot of its own */
+static bool build_handler_table(void)
+{
+	uint32_t multiplier = 0x9e3779b1;
+
+	for (uint32_t attempt = 0; attempt < 100000; attempt++, multiplier += 0x6d2b79f6)
+	{
+		bool collision = false;
+
+		handler_multiplier = multiplier | 1;
+		memset(handler_slots, 0, sizeof(handler_slots));
+
+		for (uint32_t i = 0; i < HANDLER_COUNT && !collision; i++)
+		{
+			uint32_t slot = handler_slot(stream_handlers[i].key);
+			collision = (handler_slots[slot] != 0);
+			handler_slots[slot] = (uint8_t)(i + 1);
+		}
+
+		if (!collision) return true;
+	}
+	return false;
+}
+
+static const stream_handler *find_handler(uint32_t key)
+{
+	uint8_t slot = handler_slots[handler_slot(key)];
+	return (slot && stream_handlers[slot - 1].key == key) ? &stream_handlers[slot - 1] : NULL;
+}
+
+#define WALKED_FIX 1
+#define WALKED_PRECISION 2
+#define WALKED_GPS9 4
+
+/*
+apply one payload's GPSU, GPS5, GPS9, GPSF and GPSP headers to the decoder state as decoding would, without decoding
+any samples; returns which of the last three it had (WALKED_ flags), or -1 if it can't be read
+*/
+static int state_walk(decode_state *state, gpmf_source *src, uint32_t index, const decode_options *opt, GPMF_stream *ms)
+{
+	uint32_t size = source_payload_size(src, index);
+	uint32_t *payload;
+	int walked = 0;
+
+	if (opt->max_alloc && size > opt->max_alloc) return -1;
+	if (!(payload = source_payload(src, index))) return -1;
+	if (GPMF_Init(ms, payload, size) != GPMF_OK || GPMF_Validate(ms, GPMF_RECURSE_LEVELS) != GPMF_OK) return 0;
+	GPMF_ResetState(ms);
+
+	do
+	{
+		uint32_t key = GPMF_Key(ms);
+		if (STR2FOURCC("GPSU") == key && GPMF_StructSize(ms) >= 16)
+			gps5_clock_anchor(&state->gps5, gpsu_time(GPMF_RawData(ms)));
+		else if (STR2FOURCC("GPS5") == key && GPMF_StructSize(ms))
+			state->gps5.samples += GPMF_Repeat(ms);
+		else if (!GPMF_StructSize(ms) || !GPMF_Repeat(ms))
+			continue;
+		else if (STR2FOURCC("GPS9") == key)
+		{
+			state->use_gps9 = true;
+			walked |= WALKED_GPS9;
+		}
+		else if (STR2FOURCC("GPSF") == key)
+		{
+			state->fix = (uint32_t)read_value(GPMF_RawData(ms), (char)GPMF_Type(ms));
+			walked |= WALKED_FIX;
+		}
+		else if (STR2FOURCC("GPSP") == key)
+		{
+			state->precision = (uint16_t)read_value(GPMF_RawData(ms), (char)GPMF_Type(ms));
+			walked |= WALKED_PRECISION;
+		}
+	} while (GPMF_OK == GPMF_Next(ms, GPMF_RECURSE_LEVELS));
+
+	return walked;
+}
+
+/* the first payload decode_state_warm() reads for a job starting at "first" */
+static uint32_t warm_start(uint32_t first)
+{
+	return (first > 2 * GPS5_RATE_WINDOW) ? first - 2 * GPS5_RATE_WINDOW : 0;
+}
+
+/*
+a part starting part way into a file takes the GPS5 clock, the last GPSF/GPSP and the GPS9 choice up from the
+payloads before it, as if decoded in one go
+*/
+static void decode_state_warm(decode_state *state, gpmf_source *src, uint32_t first, const decode_options *opt)
+{
+	GPMF_stream metadata_stream, *ms = &metadata_stream;
+
+	memset(ms, 0, sizeof(*ms));
+	for (uint32_t index = warm_start(first); index < first; index++)
+		if (state_walk(state, src, index, opt, ms) < 0) break;
+	GPMF_Free(ms);
+}
+
+/*
+"carry" as it would be after a sequential run had decoded the job, which includes the payloads decode_state_warm()
+reads; the payloads are walked from the end back, and only as far as it takes to find the last GPSF and GPSP and
+whether there is any GPS9 (not needed once "carry" has it)
+*/
+static void carry_through(const file_job *job, carried_state *carry, const decode_options *opt)
+{
+	GPMF_stream metadata_stream, *ms = &metadata_stream;
+	gpmf_source src;
+	decode_state state;
+	int found = carry->use_gps9 ? WALKED_GPS9 : 0;
+
+	if (!source_open(&src, job->path, opt)) return;
+
+	uint32_t first = job->first_payload ? warm_start(job->first_payload) : 0;
+	uint32_t index = source_payloads(&src);
+	if (job->end_payload && job->end_payload < index) index = job->end_payload;
+
+	memset(ms, 0, sizeof(*ms));
+	memset(&state, 0, sizeof(state));
+	while (index-- > first && found != (WALKED_FIX | WALKED_PRECISION | WALKED_GPS9))
+	{
+		int walked = state_walk(&state, &src, index, opt, ms);
+		if (walked < 0) continue;
+		walked &= ~found;
+		if (walked & WALKED_FIX) carry->fix = state.fix;
+		if (walked & WALKED_PRECISION) carry->precision = state.precision;
+		if (walked & WALKED_GPS9) carry->use_gps9 = true;
+		found |= walked;
+	}
+	GPMF_Free(ms);
+	source_close(&src);
+}
+
+/*
+a job decoded apart from the ones before it starts with what a sequential run would have carried into it, so that
+--jobs doesn't change the output; worked out in job order and remembered, so each earlier job is walked at most once
+*/
+static void job_carry(file_job *job, decode_state *state, const decode_options *opt)
+{
+	uint32_t at = (uint32_t)(job - pipeline.jobs), known = at;
+	carried_state carry;
+
+	pthread_mutex_lock(&pipeline.carry_lock);
+	while (known && !pipeline.jobs[known].carry_known) known--;
+	if (known) carry = pipeline.jobs[known].carry;
+	else memset(&carry, 0, sizeof(carry));
+
+	for (; known < at; known++)
+	{
+		carry_through(&pipeline.jobs[known], &carry, opt);
+		pipeline.jobs[known + 1].carry = carry;
+		pipeline.jobs[known + 1].carry_known = true;
+	}
+	pthread_mutex_unlock(&pipeline.carry_lock);
+
+	state->use_gps9 = carry.use_gps9;
+	state->fix = carry.fix;
+	state->precision = carry.precision;
+}
+
+/* decode the job's payloads from a source that is already open */
+static void decode_payloads(file_job *job, gpmf_source *src, decode_state *state, const decode_options *opt, const sample_sink *sink, void *ctx)
+{
+	GPMF_ERR ret = GPMF_OK;
+	GPMF_stream metadata_stream, *ms = &metadata_stream;
+	decode_context dc;
+	struct timespec began;
+
+	memset(ms, 0, sizeof(*ms));
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &began);
+
+	job_update(job, JOB_RUNNING);
+	if (sink->opened) sink->opened(ctx, job);
+
+	memset(&dc, 0, sizeof(dc));
+	dc.job = job;
+	dc.state = state;
+	dc.opt = opt;
+	dc.sink = sink;
+	dc.ctx = ctx;
+
+	for (uint32_t h = 0; h < HANDLER_COUNT; h++)
+		if (stream_handlers[h].init) stream_handlers[h].init(&dc);
+
+	size_t payloadres_size = 0;
+
+	/* each MP4 has a given number of payloads, and we must iterate through all of them */
+	uint32_t payloads = source_payloads(src);
+	if (job->end_payload && job->end_payload < payloads) payloads = job->end_payload;
+
+	for (uint32_t index = job->first_payload; index < payloads; index++)
+	{
+		uint32_t payloadsize = source_payload_size(src, index);
+
+		if (pipeline_aborted()) break;
+
+		if ( (opt->cpu_limit > 0.0) && (seconds_since(CLOCK_THREAD_CPUTIME_ID, &began) > opt->cpu_limit) )
+		{
+			dc.abort_reason = "exceeded --cpu_limit";
+			break;
+		}
+
+		if (opt->max_alloc && payloadsize > opt->max_alloc)
+		{
+			dc.abort_reason = "payload exceeds --max_alloc";
+			break;
+		}
+
+		/* the payload buffer is only ever grown, so only the growth needs budgeting */
+		if (payloadsize > payloadres_size)
+		{
+			mem_acquire(job, payloadsize - payloadres_size);
+			payloadres_size = payloadsize;
+		}
+
+		uint32_t *payload = source_payload(src, index);
+		if (payload == NULL) break;
+
+		ret = source_payload_time(src, index, &dc.start, &dc.finish);
+		if (ret != GPMF_OK) break;
+
+		ret = GPMF_Init(ms, payload, payloadsize);
+		if (ret != GPMF_OK) break;
+
+		if (opt->safe)
+		{
+			ret = GPMF_Validate(ms, GPMF_RECURSE_LEVELS);
+			if (ret != GPMF_OK) break;
+			GPMF_ResetState(ms);
+		}
+
+		job->payloads++;
+		job->payload_bytes += payloadsize;
+
+		uint32_t klvs = 0;
+
+		/* iterate through all GPMF data in this particular payload, handing each KLV to its handler */
+		do
+		{
+			uint32_t samples = GPMF_Repeat(ms);
+
+			/* bound the work a hostile payload can cause */
+			if (opt->max_klv && ++klvs > opt->max_klv)
+			{
+				dc.abort_reason = "payload has more KLVs than --max_klv";
+				break;
+			}
+			if ( (opt->cpu_limit > 0.0) && !(klvs & 1023) && (seconds_since(CLOCK_THREAD_CPUTIME_ID, &began) > opt->cpu_limit) )
+			{
+				dc.abort_reason = "exceeded --cpu_limit";
+				break;
+			}
+
+			if (!samples || !GPMF_StructSize(ms)) continue;
+
+			const stream_handler *handler = find_handler(GPMF_Key(ms));
+			if (handler) handler->decode(&dc, ms, samples);
+
+		} while (!dc.abort_reason && GPMF_OK == GPMF_Next(ms, GPMF_RECURSE_LEVELS));
+
+		for (uint32_t h = 0; h < HANDLER_COUNT; h++)
+			if (stream_handlers[h].flush) stream_handlers[h].flush(&dc);
+
+		GPMF_ResetState(ms);
+
+		if (sink->payload_done) sink->payload_done(ctx, job);
+
+		if (dc.abort_reason) break;
+	}
+
+	if (ms) GPMF_Free(ms);
+	mem_release(payloadres_size);
+
+	job->ret = ret;
+	job->abort_reason = dc.abort_reason;
+	job->file_finish = dc.file_finish;
+	if (sink->closed) sink->closed(ctx, job);
+	job_update(job, JOB_FINISHED);
+}
+
+static void decode_file(file_job *job, decode_state *state, const decode_options *opt, const sample_sink *sink, void *ctx)
+{
+	/* search for GPMF Track */
+	gpmf_source src;
+
+	if (!source_open(&src, job->path, opt))
+	{
+		job_update(job, JOB_OPEN_FAILED);
+		return;
+	}
+
+	double metadataduration = source_duration(&src);
+	if (metadataduration <= 0.0)
+	{
+		source_close(&src);
+		job_update(job, JOB_NO_DURATION);
+		return;
+	}
+
+	/* sample times are never carried into another file or part, though a part picks GPS5's up from before it */
+	state->gps9_anchored = false;
+	memset(&state->gps5, 0, sizeof(state->gps5));
+	if (job->first_payload) decode_state_warm(state, &src, job->first_payload, opt);
+
+	size_t table_size = source_table_size(&src);
+	mem_acquire(job, table_size);
+	decode_payloads(job, &src, state, opt, sink, ctx);
+	source_close(&src);
+	mem_release(table_size);
+}
+
+/* single-threaded mode prints as it decodes */
+static void direct_opened(void *ctx, file_job *job)
+{
+	output_options *out = ctx;
+	if (!out->header_printed) print_header(out);
+}
+
+static void direct_sample(void *ctx, file_job *job, const gps_sample *s)
+{
+	output_sample(ctx, job, s);
+}
+
+static const sample_sink direct_sink = { direct_opened, direct_sample, NULL, NULL };
+
+/* parallel mode collects each payload's samples and queues them, in a batch, for the writer */
+static void batch_sample(void *ctx, file_job *job, const gps_sample *s)
+{
+	decode_worker *w = ctx;
+
+	if (w->scratch_count == w->scratch_size)
+	{
+		uint32_t size = w->scratch_size ? 2 * w->scratch_size : 64;
+		mem_acquire(job, (size - w->scratch_size) * sizeof(gps_sample));
+		gps_sample *scratch = realloc(w->scratch, size * sizeof(gps_sample));
+		if (!scratch)
+		{
+			mem_release((size - w->scratch_size) * sizeof(gps_sample));
+			return;
+		}
+		w->scratch = scratch;
+		w->scratch_size = size;
+	}
+	w->scratch[w->scratch_count++] = *s;
+}
+
+static void batch_flush(void *ctx, file_job *job)
+{
+	decode_worker *w = ctx;
+
+	if (!w->scratch_count) return;
+
+	size_t bytes;
+	if (!checked_size(w->scratch_count, sizeof(gps_sample), &bytes) || bytes > SIZE_MAX - sizeof(sample_batch))
+	{
+		w->scratch_count = 0;
+		return;
+	}
+	bytes += sizeof(sample_batch);
+	mem_acquire(job, bytes);
+	sample_batch *batch = malloc(bytes);
+	if (!batch)
+	{
+		mem_release(bytes);
+		w->scratch_count = 0;
+		return;
+	}
+	batch->next = NULL;
+	batch->count = w->scratch_count;
+	batch->bytes = bytes;
+	memcpy(batch->samples, w->scratch, w->scratch_count * sizeof(gps_sample));
+	w->scratch_count = 0;
+
+	pthread_mutex_lock(&pipeline.lock);
+	if (job->last) job->last->next = batch;
+	else job->first = batch;
+	job->last = batch;
+	job->queued += bytes;
+	pthread_cond_broadcast(&pipeline.cond);
+	pthread_mutex_unlock(&pipeline.lock);
+}
+
+static const sample_sink batch_sink = { NULL, batch_sample, batch_flush, NULL };
+
+static void *decode_thread(void *arg)
+{
+	decode_worker *w = arg;
+
+	for (;;)
+	{
+		file_job *job = NULL;
+
+		pthread_mutex_lock(&pipeline.lock);
+		if (!pipeline.abort && pipeline.next_job < pipeline.job_count)
+			job = &pipeline.jobs[pipeline.next_job++];
+		pthread_mutex_unlock(&pipeline.lock);
+
+		if (!job) break;
+
+		decode_state state;
+		memset(&state, 0, sizeof(state));
+		job_carry(job, &state, w->opt);
+		decode_file(job, &state, w->opt, &batch_sink, w);
+		decode_state_free(&state);
+	}
+
+	/* the scratch buffer was budgeted as it grew */
+	free(w->scratch);
+	mem_release((size_t)w->scratch_size * sizeof(gps_sample));
+	w->scratch = NULL;
+	w->scratch_size = 0;
+
+	return NULL;
+}
+
+/* report how a file ended and move the stitched timeline on; returns true if no further files should be processed */
+static bool finish_job(output_options *out, const file_job *job, int *result)
+{
+	if (JOB_OPEN_FAILED == job->state)
+	{
+		fprintf(stderr, "ERROR: %s is an invalid MP4/MOV or it has no GPMF data\n\n", job->path);
+		*result = -1;
+		return true;
+	}
+
+	if (JOB_NO_DURATION == job->state)
+	{
+		*result = -1;
+		return true;
+	}
+
+	/* a --safe limit only stops the file that hit it; what it wrote so far still takes its place on the timeline */
+	if (job->abort_reason)
+	{
+		fprintf(stderr, "ERROR: %s: %s\n", job->path, job->abort_reason);
+		*result = GPMF_ERROR_BAD_STRUCTURE;
+	}
+	else if (job->ret != GPMF_OK)
+	{
+		if (GPMF_ERROR_UNKNOWN_TYPE == job->ret)
+			fprintf(stderr, "ERROR: Unknown GPMF Type within\n");
+		else
+			fprintf(stderr, "ERROR: GPMF data has corruption\n");
+		*result = (int)job->ret;
+		return true;
+	}
+
+	/* the parts of a split file share its timeline, which moves on after the last */
+	if (job->file_finish > out->part_finish) out->part_finish = job->file_finish;
+	if (job->continues) return false;
+
+	out->file_start += out->part_finish;
+	out->part_finish = 0.0;
+	return false;
+}
+
+/* drain the decoder threads' queues in file order */
+static int write_jobs(output_options *out)
+{
+	int result = 0;
+
+	for (uint32_t index = 0; index < pipeline.job_count; index++)
+	{
+		file_job *job = &pipeline.jobs[index];
+
+		if (job->placed) out->file_start = job->placed_at;
+
+		pthread_mutex_lock(&pipeline.lock);
+		pipeline.head = index;
+		pthread_cond_broadcast(&pipeline.cond);
+
+		while (JOB_PENDING == job->state)
+			pthread_cond_wait(&pipeline.cond, &pipeline.lock);
+
+		if ( ((JOB_RUNNING == job->state) || (JOB_FINISHED == job->state)) && !out->header_printed )
+			print_header(out);
+
+		for (;;)
+		{
+			while (!job->first && (JOB_RUNNING == job->state))
+				pthread_cond_wait(&pipeline.cond, &pipeline.lock);
+
+			sample_batch *batch = job->first;
+			if (!batch) break;
+
+			job->first = batch->next;
+			if (!job->first) job->last = NULL;
+			job->queued -= batch->bytes;
+			pthread_mutex_unlock(&pipeline.lock);
+
+			for (uint32_t i = 0; i < batch->count; i++)
+				output_sample(out, job, &batch->samples[i]);
+
+			size_t bytes = batch->bytes;
+			free(batch);
+			mem_release(bytes);
+
+			pthread_mutex_lock(&pipeline.lock);
+		}
+		pthread_mutex_unlock(&pipeline.lock);
+
+		if (finish_job(out, job, &result)) break;
+	}
+
+	return result;
+}
+
+/*
+the ordered writer takes big files in parts (payload ranges), so one long chapter doesn't leave the other
+decoders idle; what a file costs to decode is estimated from the GPMF bytes in its sample table
+*/
+#define SPLIT_MIN_COST (1u << 20) /* GPMF bytes below which a part isn't worth its own job */
+#define SPLIT_PER_THREAD 4        /* parts aimed for per decoder, so the last few files finish together */
+
+static void *size_thread(void *arg)
+{
+	const decode_options *opt = arg;
+
+	for (;;)
+	{
+		file_job *job = NULL;
+		gpmf_source src;
+
+		pthread_mutex_lock(&pipeline.lock);
+		if (pipeline.next_job < pipeline.job_count)
+			job = &pipeline.jobs[pipeline.next_job++];
+		pthread_mutex_unlock(&pipeline.lock);
+
+		if (!job) break;
+
+		/* a file that won't open is left whole, for decode_file() to report */
+		if (!source_open(&src, job->path, opt)) continue;
+		uint32_t end = source_payloads(&src);
+		if (job->end_payload && job->end_payload < end) end = job->end_payload;
+		job->payload_count = (end > job->first_payload) ? end - job->first_payload : 0;
+		for (uint32_t index = job->first_payload; index < end; index++)
+			job->cost += source_payload_size(&src, index);
+		source_close(&src);
+	}
+
+	return NULL;
+}
+
+static uint32_t job_parts(const file_job *job, uint64_t share)
+{
+	uint64_t parts = (job->cost + share - 1) / share;
+	if (parts > job->payload_count) parts = job->payload_count;
+	return (parts > 1) ? (uint32_t)parts : 1;
+}
+
+/* replace the jobs of files costing more than their share of the work with jobs for each part */
+static bool split_jobs(const decode_options *opt, uint32_t threads)
+{
+	pthread_t *sizers = calloc(threads, sizeof(pthread_t));
+	uint32_t started = 0;
+	uint64_t total = 0, count = 0;
+
+	if (!sizers) return false;
+
+	pipeline.next_job = 0;
+	for (; started < threads; started++)
+		if (pthread_create(&sizers[started], NULL, size_thread, (void *)opt) != 0) break;
+	if (!started) size_thread((void *)opt);
+	for (uint32_t t = 0; t < started; t++)
+		pthread_join(sizers[t], NULL);
+	free(sizers);
+	pipeline.next_job = 0;
+
+	for (uint32_t index = 0; index < pipeline.job_count; index++)
+		total += pipeline.jobs[index].cost;
+
+	uint64_t share = total / ((uint64_t)threads * SPLIT_PER_THREAD);
+	if (share < SPLIT_MIN_COST) share = SPLIT_MIN_COST;
+
+	for (uint32_t index = 0; index < pipeline.job_count; index++)
+		count += job_parts(&pipeline.jobs[index], share);
+	if (count == pipeline.job_count) return true;
+	if (count > UINT32_MAX) return false;
+
+	file_job *jobs = calloc(count, sizeof(file_job));
+	if (!jobs) return false;
+
+	/* payloads are of much the same size, so parts are split by payload count */
+	uint32_t next = 0;
+	for (uint32_t index = 0; index < pipeline.job_count; index++)
+	{
+		const file_job *job = &pipeline.jobs[index];
+		uint32_t parts = job_parts(job, share);
+
+		for (uint32_t part = 0; part < parts; part++, next++)
+		{
+			jobs[next] = *job;
+			if (parts < 2) continue;
+			jobs[next].first_payload = job->first_payload + (uint32_t)((uint64_t)job->payload_count * part / parts);
+			jobs[next].end_payload = job->first_payload + (uint32_t)((uint64_t)job->payload_count * (part + 1) / parts);
+			jobs[next].continues = (part + 1 < parts) || job->continues;
+			jobs[next].cost = job->cost / parts;
+		}
+	}
+
+	free(pipeline.jobs);
+	pipeline.jobs = jobs;
+	pipeline.job_count = (uint32_t)count;
+	return true;
+}
+
+#define JOBS_MAX 4096 /* --jobs above this is taken for a mistake */
+
+/* CPUs this process may use: those online, capped by a cgroup CPU quota such as a container's */
+static uint32_t available_cpus(void)
+{
+	long online = sysconf(_SC_NPROCESSORS_ONLN);
+	long long quota = -1, period = 0;
+	uint32_t cpus = (online > 0) ? (uint32_t)online : 1;
+	FILE *fp;
+
+	/* cgroup v2 has "max" or the quota and period in one file, cgroup v1 in two */
+	if ((fp = fopen("/sys/fs/cgroup/cpu.max", "r")))
+	{
+		if (fscanf(fp, "%lld %lld", &quota, &period) != 2) quota = -1;
+		fclose(fp);
+	}
+	else if ((fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r")))
+	{
+		if (fscanf(fp, "%lld", &quota) != 1) quota = -1;
+		fclose(fp);
+		if ((fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r")))
+		{
+			if (fscanf(fp, "%lld", &period) != 1) period = 0;
+			fclose(fp);
+		}
+	}
+
+	if (quota > 0 && period > 0 && (quota + period - 1) / period < cpus)
+		cpus = (uint32_t)((quota + period - 1) / period);
+	return cpus;
+}
+
+/* per-thread context of the decoders feeding the tiles and heatmap modes, which need no ordered writer */
+typedef struct collect_worker
+{
+	pthread_t thread;
+	const decode_options *opt;
+	const sample_sink *sink;
+	void *ctx;
+} collect_worker;
+
+static void *collect_thread(void *arg)
+{
+	collect_worker *c = arg;
+
+	for (;;)
+	{
+		file_job *job = NULL;
+
+		pthread_mutex_lock(&pipeline.lock);
+		if (!pipeline.abort && pipeline.next_job < pipeline.job_count)
+			job = &pipeline.jobs[pipeline.next_job++];
+		pthread_mutex_unlock(&pipeline.lock);
+
+		if (!job) break;
+
+		decode_state state;
+		memset(&state, 0, sizeof(state));
+		job_carry(job, &state, c->opt);
+		decode_file(job, &state, c->opt, c->sink, c->ctx);
+		decode_state_free(&state);
+
+		/* nothing drains in order here, so the memory budget's exemption moves to the oldest file still decoding */
+		pthread_mutex_lock(&pipeline.lock);
+		while (pipeline.head < pipeline.job_count && pipeline.jobs[pipeline.head].state != JOB_PENDING && pipeline.jobs[pipeline.head].state != JOB_RUNNING)
+			pipeline.head++;
+		pthread_cond_broadcast(&pipeline.cond);
+		pthread_mutex_unlock(&pipeline.lock);
+	}
+
+	return NULL;
+}
+
+/* decode every file on up to "threads" threads, each with its own sink context; bad files are reported but don't stop the rest */
+static int collect_files(const decode_options *opt, const sample_sink *sink, void **contexts, uint32_t threads)
+{
+	uint32_t started = 0;
+	int result = 0;
+
+	if (threads > pipeline.job_count) threads = pipeline.job_count;
+
+	collect_worker *workers = calloc(threads, sizeof(collect_worker));
+	if (!workers)
+	{
+		fprintf(stderr, "ERROR: unable to allocate decoder threads\n");
+		return -1;
+	}
+
+	for (uint32_t t = 0; t < threads; t++)
+	{
+		workers[t].opt = opt;
+		workers[t].sink = sink;
+		workers[t].ctx = contexts[t];
+	}
+
+	if (threads > 1)
+		for (; started < threads; started++)
+			if (pthread_create(&workers[started].thread, NULL, collect_thread, &workers[started]) != 0) break;
+	if (!started) collect_thread(&workers[0]);
+	for (uint32_t t = 0; t < started; t++)
+		pthread_join(workers[t].thread, NULL);
+	free(workers);
+
+	for (uint32_t index = 0; index < pipeline.job_count; index++)
+	{
+		output_options out;
+		int status = 0;
+		memset(&out, 0, sizeof(out));
+		finish_job(&out, &pipeline.jobs[index], &status);
+		if (status) result = status;
+	}
+
+	return result;
+}
+
+/*
+collect_files() over just the jobs with a slot, which becomes the job's entry in the sink context; "done" gets
+those jobs as they ended, while the pipeline's own are left pending for decoding again
+*/
+static int collect_some(const decode_options *opt, uint32_t threads, const sample_sink *sink, void **slots, file_job *done)
+{
+	file_job *jobs = pipeline.jobs;
+	uint32_t job_count = pipeline.job_count, count = 0;
+	file_job *pending = calloc(job_count, sizeof(file_job));
+	void **compact = calloc(job_count, sizeof(void *));
+	void **contexts = calloc(threads, sizeof(void *));
+	int result = 0;
+
+	if (!pending || !compact || !contexts)
+	{
+		fprintf(stderr, "ERROR: unable to allocate decoder jobs\n");
+		result = -1;
+		job_count = 0;
+	}
+
+	for (uint32_t index = 0; index < job_count; index++)
+	{
+		if (!slots[index]) continue;
+		pending[count] = jobs[index];
+		compact[count++] = slots[index];
+	}
+
+	/* collect_files() works through the pipeline's jobs, so it is handed just these for now */
+	if (count)
+	{
+		for (uint32_t t = 0; t < threads; t++) contexts[t] = compact;
+		pipeline.jobs = pending;
+		pipeline.job_count = count;
+		pipeline.next_job = pipeline.head = 0;
+		result = collect_files(opt, sink, contexts, threads);
+		pipeline.jobs = jobs;
+		pipeline.job_count = job_count;
+		pipeline.next_job = pipeline.head = 0;
+	}
+
+	for (uint32_t index = 0, i = 0; index < job_count; index++)
+		if (slots[index]) done[index] = pending[i++];
+
+	free(pending);
+	free(compact);
+	free(contexts);
+	return result;
+}
+
+/*
+tiles mode: decoded tracks are simplified per zoom level, clipped to tile bounds and written as
+Mapbox Vector Tiles (one "tracks" layer of line features) inside a PMTiles v3 archive
+*/
+#define TILE_EXTENT 4096         /* MVT coordinate units across a tile */
+#define TILE_EXTENT_BITS 12
+#define TILE_BUFFER 64           /* units drawn beyond the tile edge so line joins render cleanly */
+#define TILE_TOLERANCE 2.0       /* simplification tolerance, in tile units */
+#define TILE_MAX_ZOOM 20         /* 2^32 world units leave no precision for deeper zooms */
+#define TILE_GAP_SECONDS 10.0    /* a longer silence starts a new line */
+#define TILE_WINDOW 1024         /* tiles encoded between writes, which bounds memory held in tile data */
+#define PMTILES_HEADER_SIZE 127
+#define PMTILES_ROOT_LIMIT (16384 - PMTILES_HEADER_SIZE)
+
+/* a track vertex in web mercator, 2^32 units to the world */
+typedef struct tile_vertex
+{
+	uint32_t x, y;
+	float weight; /* squared deviation at which Douglas-Peucker drops the vertex */
+} tile_vertex;
+
+typedef struct tile_track
+{
+	uint32_t file; /* index into pipeline.jobs */
+	uint32_t line; /* order within the file */
+	uint32_t count;
+	tile_vertex *vertices;
+} tile_track;
+
+/* part of a track crossing one tile: the vertices first to last, as kept at the zoom being encoded */
+typedef struct tile_run
+{
+	uint64_t tile_id;
+	uint32_t x, y;
+	uint32_t track;
+	uint32_t first, last;
+} tile_run;
+
+typedef struct pmtiles_entry
+{
+	uint64_t tile_id;
+	uint64_t offset;
+	uint32_t length;
+	uint32_t run_length;
+} pmtiles_entry;
+
+/* growable protobuf output */
+typedef struct pbf
+{
+	uint8_t *data;
+	size_t len, size;
+	bool failed;
+} pbf;
+
+typedef struct tile_worker
+{
+	pthread_t thread;
+	double tolerance; /* squared, in world units, at the deepest zoom */
+	tile_vertex *raw; /* line being collected from the decoder */
+	uint32_t raw_count, raw_size;
+	uint32_t lines; /* lines handed over from the current file */
+	double last_cts;
+	pbf geometry, feature, layer, tags;
+	int32_t *values;   /* per file, its index in the tile's value table or -1 */
+	uint32_t *files;   /* files in the tile's value table */
+	int32_t *piece; /* quantised points of the line piece being clipped */
+	uint32_t piece_count, piece_size;
+} tile_worker;
+
+/* decoded tracks and the zoom level being encoded, guarded by pipeline.lock */
+static struct
+{
+	tile_track *tracks;
+	uint32_t track_count, track_size;
+	uint8_t zoom;
+	double tolerance; /* squared, in world units, at this zoom */
+	tile_run *runs;
+	uint32_t *tiles;  /* index of each tile's first run, plus one past the end */
+	uint32_t window, window_count, next_tile;
+	pbf *results;
+	size_t kept;     /* bytes of tracks, runs and tile index counted against the memory budget */
+	bool incomplete; /* runs were dropped for want of memory */
+	bool over_budget; /* ...because they didn't fit in --mem_limit */
+} tileset;
+
+static void pbf_reserve(pbf *b, size_t more)
+{
+	if (b->failed || b->len + more <= b->size) return;
+
+	size_t size = b->size ? b->size : 256;
+	while (size < b->len + more) size *= 2;
+	uint8_t *data = realloc(b->data, size);
+	if (!data)
+	{
+		b->failed = true;
+		return;
+	}
+	b->data = data;
+	b->size = size;
+}
+
+static void pbf_varint(pbf *b, uint64_t value)
+{
+	pbf_reserve(b, 10);
+	if (b->failed) return;
+
+	while (value >= 0x80)
+	{
+		b->data[b->len++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	b->data[b->len++] = (uint8_t)value;
+}
+
+static void pbf_key(pbf *b, uint32_t field, uint32_t wire)
+{
+	pbf_varint(b, (field << 3) | wire);
+}
+
+/* length delimited field */
+static void pbf_bytes(pbf *b, uint32_t field, const void *data, size_t len)
+{
+	pbf_key(b, field, 2);
+	pbf_varint(b, len);
+	pbf_reserve(b, len);
+	if (b->failed) return;
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static uint32_t zigzag(int32_t value)
+{
+	return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+/* PMTiles tile id: tiles of all shallower zooms, then the position along this zoom's Hilbert curve */
+static uint64_t tile_id(uint8_t z, uint32_t x, uint32_t y)
+{
+	uint64_t id = ((1ull << (2 * z)) - 1) / 3;
+	uint64_t n = 1ull << z;
+
+	for (uint64_t s = n / 2; s > 0; s /= 2)
+	{
+		uint64_t rx = (x & s) ? 1 : 0;
+		uint64_t ry = (y & s) ? 1 : 0;
+		id += s * s * ((3 * rx) ^ ry);
+		if (!ry)
+		{
+			if (rx)
+			{
+				x = (uint32_t)(n - 1 - x);
+				y = (uint32_t)(n - 1 - y);
+			}
+			uint32_t t = x; x = y; y = t;
+		}
+	}
+	return id;
+}
+
+static double tile_lon(double x)
+{
+	return x / 4294967296.0 * 360.0 - 180.0;
+}
+
+static double tile_lat(double y)
+{
+	return atan(sinh(M_PI * (1.0 - 2.0 * y / 4294967296.0))) * 180.0 / M_PI;
+}
+
+/* web mercator position as a fraction of the world, 0,0 being the north west corner */
+static void mercator(double lat, double lon, double *x, double *y)
+{
+	lat = fmax(-85.0511287798, fmin(85.0511287798, lat)) * M_PI / 180.0;
+	*x = (lon + 180.0) / 360.0;
+	*y = (1.0 - log(tan(lat) + 1.0 / cos(lat)) / M_PI) / 2.0;
+}
+
+/* squared distance from p to the segment a-b */
+static double segment_distance(const tile_vertex *p, const tile_vertex *a, const tile_vertex *b)
+{
+	double x = a->x, y = a->y;
+	double dx = (double)b->x - x, dy = (double)b->y - y;
+
+	if (dx != 0.0 || dy != 0.0)
+	{
+		double t = (((double)p->x - x) * dx + ((double)p->y - y) * dy) / (dx * dx + dy * dy);
+		if (t > 1.0) { x = b->x; y = b->y; }
+		else if (t > 0.0) { x += dx * t; y += dy * t; }
+	}
+	dx = (double)p->x - x;
+	dy = (double)p->y - y;
+	return dx * dx + dy * dy;
+}
+
+/*
+Douglas-Peucker down to the deepest zoom's tolerance, recording the deviation at which each vertex was kept
+so every shallower zoom can simplify by filtering on it; returns the number of vertices kept
+*/
+static uint32_t simplify_track(tile_vertex *v, uint32_t count, double tolerance)
+{
+	uint32_t *stack = malloc(2 * count * sizeof(uint32_t));
+	uint32_t depth = 0, kept = 0;
+
+	if (!stack) return 0;
+
+	for (uint32_t i = 0; i < count; i++) v[i].weight = 0.0f;
+	v[0].weight = v[count - 1].weight = INFINITY;
+
+	stack[depth++] = 0;
+	stack[depth++] = count - 1;
+	while (depth)
+	{
+		uint32_t last = stack[--depth];
+		uint32_t first = stack[--depth];
+		double worst = tolerance;
+		uint32_t index = 0;
+
+		for (uint32_t i = first + 1; i < last; i++)
+		{
+			double d = segment_distance(&v[i], &v[first], &v[last]);
+			if (d > worst)
+			{
+				worst = d;
+				index = i;
+			}
+		}
+		if (!index) continue;
+
+		v[index].weight = (float)worst;
+		stack[depth++] = first;
+		stack[depth++] = index;
+		stack[depth++] = index;
+		stack[depth++] = last;
+	}
+	free(stack);
+
+	for (uint32_t i = 0; i < count; i++)
+		if (v[i].weight > 0.0f) v[kept++] = v[i];
+	return kept;
+}
+
+/* a decoder thread's line didn't make it into the tileset */
+static void tile_line_dropped(bool over_budget)
+{
+	pthread_mutex_lock(&pipeline.lock);
+	tileset.incomplete = true;
+	if (over_budget) tileset.over_budget = true;
+	pthread_mutex_unlock(&pipeline.lock);
+}
+
+/* simplify the line collected so far and hand it to the tileset */
+static void tile_line_end(void *ctx, file_job *job)
+{
+	tile_worker *w = ctx;
+	uint32_t count = w->raw_count;
+
+	w->raw_count = 0;
+	if (count < 2) return;
+
+	count = simplify_track(w->raw, count, w->tolerance);
+	if (!count) return;
+
+	/* every line is kept until the last zoom is encoded; its share of the tracks array is counted with it */
+	size_t bytes = count * sizeof(tile_vertex) + 2 * sizeof(tile_track);
+	if (!mem_keep(&tileset.kept, bytes))
+	{
+		tile_line_dropped(true);
+		return;
+	}
+	tile_vertex *vertices = malloc(count * sizeof(tile_vertex));
+	if (!vertices)
+	{
+		mem_unkeep(&tileset.kept, bytes);
+		tile_line_dropped(false);
+		return;
+	}
+	memcpy(vertices, w->raw, count * sizeof(tile_vertex));
+
+	pthread_mutex_lock(&pipeline.lock);
+	if (tileset.track_count == tileset.track_size)
+	{
+		uint32_t size = tileset.track_size ? 2 * tileset.track_size : 64;
+		tile_track *tracks = realloc(tileset.tracks, size * sizeof(tile_track));
+		if (tracks)
+		{
+			tileset.tracks = tracks;
+			tileset.track_size = size;
+		}
+	}
+	if (tileset.track_count < tileset.track_size)
+	{
+		tile_track *t = &tileset.tracks[tileset.track_count++];
+		t->file = (uint32_t)(job - pipeline.jobs);
+		t->line = w->lines++;
+		t->count = count;
+		t->vertices = vertices;
+		vertices = NULL;
+	}
+	pthread_mutex_unlock(&pipeline.lock);
+
+	if (vertices)
+	{
+		free(vertices);
+		mem_unkeep(&tileset.kept, bytes);
+		tile_line_dropped(false);
+	}
+}
+
+static void tile_opened(void *ctx, file_job *job)
+{
+	tile_worker *w = ctx;
+	w->raw_count = 0;
+	w->lines = 0;
+}
+
+static void tile_sample(void *ctx, file_job *job, const gps_sample *s)
+{
+	tile_worker *w = ctx;
+
+	if (s->lat == 0.0 && s->lon == 0.0) return; /* no position yet */
+
+	if (w->raw_count && s->cts - w->last_cts > TILE_GAP_SECONDS) tile_line_end(w, job);
+	w->last_cts = s->cts;
+
+	/* the line so far counts against --mem_limit; one that can't grow is ended there and carries on as a new line */
+	if (w->raw_count == w->raw_size)
+	{
+		uint32_t size = w->raw_size ? 2 * w->raw_size : 1024;
+		size_t bytes = (size_t)(size - w->raw_size) * sizeof(tile_vertex);
+		tile_vertex *raw = NULL;
+		bool kept = mem_keep(&tileset.kept, bytes);
+
+		if (kept && !(raw = realloc(w->raw, size * sizeof(tile_vertex)))) mem_unkeep(&tileset.kept, bytes);
+		if (raw)
+		{
+			w->raw = raw;
+			w->raw_size = size;
+		}
+		else if (w->raw_count >= 2)
+		{
+			tile_vertex last = w->raw[w->raw_count - 1];
+			tile_line_end(w, job);
+			w->raw[w->raw_count++] = last;
+		}
+		else
+		{
+			tile_line_dropped(!kept);
+			return;
+		}
+	}
+
+	double x, y;
+	mercator(s->lat, s->lon, &x, &y);
+
+	tile_vertex *v = &w->raw[w->raw_count++];
+	v->x = (uint32_t)fmin(fmax(x * 4294967296.0, 0.0), 4294967295.0);
+	v->y = (uint32_t)fmin(fmax(y * 4294967296.0, 0.0), 4294967295.0);
+}
+
+static const sample_sink tile_sink = { tile_opened, tile_sample, NULL, tile_line_end };
+
+static void tile_run_add(tile_run **runs, size_t *count, size_t *size, uint32_t track, uint32_t first, uint32_t last, uint32_t x, uint32_t y)
+{
+	if (*count)
+	{
+		tile_run *r = &(*runs)[*count - 1];
+		if (r->track == track && r->last == first && r->x == x && r->y == y)
+		{
+			r->last = last;
+			return;
+		}
+	}
+
+	if (*count == *size)
+	{
+		size_t bytes, grown = *size ? 2 * *size : 4096;
+		tile_run *more = NULL;
+		if (!checked_size(grown - *size, sizeof(tile_run), &bytes) || !mem_keep(&tileset.kept, bytes))
+		{
+			tileset.incomplete = tileset.over_budget = true;
+			return;
+		}
+		if (!(more = realloc(*runs, grown * sizeof(tile_run))))
+		{
+			mem_unkeep(&tileset.kept, bytes);
+			tileset.incomplete = true;
+			return;
+		}
+		*runs = more;
+		*size = grown;
+	}
+
+	tile_run *r = &(*runs)[(*count)++];
+	r->tile_id = tile_id(tileset.zoom, x, y);
+	r->x = x;
+	r->y = y;
+	r->track = track;
+	r->first = first;
+	r->last = last;
+}
+
+/* walk the tiles the segment a-b passes through */
+static void tile_segment(tile_run **runs, size_t *count, size_t *size, uint32_t track, uint32_t a, uint32_t b)
+{
+	const tile_vertex *v = tileset.tracks[track].vertices;
+	double scale = ldexp(1.0, tileset.zoom - 32);
+	int64_t limit = ((int64_t)1 << tileset.zoom) - 1;
+	double x0 = v[a].x * scale, y0 = v[a].y * scale;
+	double x1 = v[b].x * scale, y1 = v[b].y * scale;
+	int64_t tx = (int64_t)x0, ty = (int64_t)y0;
+	int64_t ex = (int64_t)x1, ey = (int64_t)y1;
+	double dx = x1 - x0, dy = y1 - y0;
+	int stepx = (dx > 0.0) ? 1 : -1, stepy = (dy > 0.0) ? 1 : -1;
+	double tmaxx = (dx != 0.0) ? ((stepx > 0 ? tx + 1 : tx) - x0) / dx : INFINITY;
+	double tmaxy = (dy != 0.0) ? ((stepy > 0 ? ty + 1 : ty) - y0) / dy : INFINITY;
+	double tdeltax = (dx != 0.0) ? stepx / dx : INFINITY;
+	double tdeltay = (dy != 0.0) ? stepy / dy : INFINITY;
+	int64_t steps = llabs(ex - tx) + llabs(ey - ty);
+
+	tile_run_add(runs, count, size, track, a, b, (uint32_t)tx, (uint32_t)ty);
+	while (steps-- > 0)
+	{
+		if (tmaxx < tmaxy && tx != ex)
+		{
+			tx += stepx;
+			tmaxx += tdeltax;
+		}
+		else if (ty != ey)
+		{
+			ty += stepy;
+			tmaxy += tdeltay;
+		}
+		else
+		{
+			tx += stepx;
+			tmaxx += tdeltax;
+		}
+		if (tx < 0 || ty < 0 || tx > limit || ty > limit) break;
+		tile_run_add(runs, count, size, track, a, b, (uint32_t)tx, (uint32_t)ty);
+	}
+}
+
+static int compare_tracks(const void *a, const void *b)
+{
+	const tile_track *ta = a, *tb = b;
+
+	if (ta->file != tb->file) return (ta->file < tb->file) ? -1 : 1;
+	return (ta->line < tb->line) ? -1 : (ta->line > tb->line);
+}
+
+static int compare_runs(const void *a, const void *b)
+{
+	const tile_run *ra = a, *rb = b;
+
+	if (ra->tile_id != rb->tile_id) return (ra->tile_id < rb->tile_id) ? -1 : 1;
+	if (ra->track != rb->track) return (ra->track < rb->track) ? -1 : 1;
+	return (ra->first < rb->first) ? -1 : (ra->first > rb->first);
+}
+
+static bool tile_kept(const tile_vertex *v, uint32_t i)
+{
+	return v[i].weight > tileset.tolerance;
+}
+
+/* write out the line piece collected so far as MoveTo + LineTo commands */
+static void tile_piece_end(tile_worker *w, int32_t *cursor)
+{
+	if (w->piece_count >= 2)
+	{
+		int32_t *p = w->piece;
+		pbf_varint(&w->geometry, 1 | (1 << 3));
+		pbf_varint(&w->geometry, zigzag(p[0] - cursor[0]));
+		pbf_varint(&w->geometry, zigzag(p[1] - cursor[1]));
+		pbf_varint(&w->geometry, 2 | ((w->piece_count - 1) << 3));
+		for (uint32_t i = 1; i < w->piece_count; i++)
+		{
+			pbf_varint(&w->geometry, zigzag(p[2 * i] - p[2 * i - 2]));
+			pbf_varint(&w->geometry, zigzag(p[2 * i + 1] - p[2 * i - 1]));
+		}
+		cursor[0] = p[2 * w->piece_count - 2];
+		cursor[1] = p[2 * w->piece_count - 1];
+	}
+	w->piece_count = 0;
+}
+
+static void tile_piece_add(tile_worker *w, double x, double y)
+{
+	int32_t px = (int32_t)lround(x), py = (int32_t)lround(y);
+
+	if (w->piece_count && w->piece[2 * w->piece_count - 2] == px && w->piece[2 * w->piece_count - 1] == py) return;
+
+	if (w->piece_count == w->piece_size)
+	{
+		uint32_t size = w->piece_size ? 2 * w->piece_size : 256;
+		int32_t *piece = realloc(w->piece, 2 * size * sizeof(int32_t));
+		if (!piece)
+		{
+			w->geometry.failed = true;
+			return;
+		}
+		w->piece = piece;
+		w->piece_size = size;
+	}
+	w->piece[2 * w->piece_count] = px;
+	w->piece[2 * w->piece_count + 1] = py;
+	w->piece_count++;
+}
+
+/* Liang-Barsky against the buffered tile; false if the segment misses it */
+static bool clip_segment(double *x0, double *y0, double *x1, double *y1, bool *clipped_end)
+{
+	const double lo = -TILE_BUFFER, hi = TILE_EXTENT + TILE_BUFFER;
+	double dx = *x1 - *x0, dy = *y1 - *y0;
+	double p[4] = { -dx, dx, -dy, dy };
+	double q[4] = { *x0 - lo, hi - *x0, *y0 - lo, hi - *y0 };
+	double t0 = 0.0, t1 = 1.0;
+
+	for (int i = 0; i < 4; i++)
+	{
+		if (p[i] == 0.0)
+		{
+			if (q[i] < 0.0) return false;
+			continue;
+		}
+		double t = q[i] / p[i];
+		if (p[i] < 0.0) { if (t > t1) return false; if (t > t0) t0 = t; }
+		else { if (t < t0) return false; if (t < t1) t1 = t; }
+	}
+
+	*clipped_end = t1 < 1.0;
+	*x1 = *x0 + dx * t1;
+	*y1 = *y0 + dy * t1;
+	*x0 += dx * t0;
+	*y0 += dy * t0;
+	return true;
+}
+
+/* encode the tile whose runs are runs[begin] to runs[end - 1] */
+static void encode_tile(tile_worker *w, uint32_t begin, uint32_t end, pbf *out)
+{
+	const tile_run *runs = tileset.runs;
+	uint32_t shift = 32 - tileset.zoom;
+	double unit = ldexp(1.0, shift - TILE_EXTENT_BITS);
+	double ox = (double)((uint64_t)runs[begin].x << shift), oy = (double)((uint64_t)runs[begin].y << shift);
+	uint32_t file_count = 0;
+
+	w->layer.len = 0;
+	w->layer.failed = false;
+	pbf_bytes(&w->layer, 1, "tracks", 6);
+
+	for (uint32_t r = begin; r < end; )
+	{
+		uint32_t track = runs[r].track;
+		const tile_vertex *v = tileset.tracks[track].vertices;
+		int32_t cursor[2] = { 0, 0 };
+
+		w->geometry.len = 0;
+		w->geometry.failed = false;
+		w->piece_count = 0;
+
+		for (; r < end && runs[r].track == track; r++)
+		{
+			/* a run that carries straight on from the last keeps its line piece open */
+			if (r == begin || runs[r - 1].track != track || runs[r - 1].last != runs[r].first)
+				tile_piece_end(w, cursor);
+
+			uint32_t a = runs[r].first;
+			for (uint32_t b = a + 1; b <= runs[r].last; b++)
+			{
+				if (b != runs[r].last && !tile_kept(v, b)) continue;
+
+				double x0 = (v[a].x - ox) / unit, y0 = (v[a].y - oy) / unit;
+				double x1 = (v[b].x - ox) / unit, y1 = (v[b].y - oy) / unit;
+				bool clipped_end;
+				a = b;
+
+				if (!clip_segment(&x0, &y0, &x1, &y1, &clipped_end)) continue;
+
+				int32_t qx = (int32_t)lround(x0), qy = (int32_t)lround(y0);
+				if (!w->piece_count || w->piece[2 * w->piece_count - 2] != qx || w->piece[2 * w->piece_count - 1] != qy)
+				{
+					tile_piece_end(w, cursor);
+					tile_piece_add(w, x0, y0);
+				}
+				tile_piece_add(w, x1, y1);
+				if (clipped_end) tile_piece_end(w, cursor);
+			}
+		}
+		tile_piece_end(w, cursor);
+
+		if (!w->geometry.len) continue;
+
+		/* one feature per line, tagged with its file */
+		uint32_t file = tileset.tracks[track].file;
+		if (w->values[file] < 0)
+		{
+			w->values[file] = (int32_t)file_count;
+			w->files[file_count++] = file;
+		}
+
+		w->tags.len = 0;
+		w->tags.failed = false;
+		pbf_varint(&w->tags, 0);
+		pbf_varint(&w->tags, (uint32_t)w->values[file]);
+		w->feature.len = 0;
+		w->feature.failed = false;
+		pbf_bytes(&w->feature, 2, w->tags.data, w->tags.len);
+		pbf_key(&w->feature, 3, 0);
+		pbf_varint(&w->feature, 2); /* LINESTRING */
+		pbf_bytes(&w->feature, 4, w->geometry.data, w->geometry.len);
+		if (w->feature.failed || w->geometry.failed || w->tags.failed) w->layer.failed = true;
+		else pbf_bytes(&w->layer, 2, w->feature.data, w->feature.len);
+	}
+
+	if (!file_count) return; /* every run clipped away */
+
+	pbf_bytes(&w->layer, 3, "file", 4);
+	for (uint32_t i = 0; i < file_count; i++)
+	{
+		pbf value = { 0 };
+		const char *name = pipeline.jobs[w->files[i]].display_name;
+		w->values[w->files[i]] = -1;
+		pbf_bytes(&value, 1, name, strlen(name));
+		if (value.failed) w->layer.failed = true;
+		else pbf_bytes(&w->layer, 4, value.data, value.len);
+		free(value.data);
+	}
+	pbf_key(&w->layer, 5, 0);
+	pbf_varint(&w->layer, TILE_EXTENT);
+	pbf_key(&w->layer, 15, 0);
+	pbf_varint(&w->layer, 2);
+
+	if (w->layer.failed)
+	{
+		out->failed = true;
+		return;
+	}
+	pbf_bytes(out, 3, w->layer.data, w->layer.len);
+}
+
+static void *tile_encode_thread(void *arg)
+{
+	tile_worker *w = arg;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&pipeline.lock);
+		uint32_t index = tileset.next_tile;
+		if (index < tileset.window_count) tileset.next_tile++;
+		pthread_mutex_unlock(&pipeline.lock);
+
+		if (index >= tileset.window_count) break;
+
+		uint32_t tile = tileset.window + index;
+		encode_tile(w, tileset.tiles[tile], tileset.tiles[tile + 1], &tileset.results[index]);
+	}
+
+	return NULL;
+}
+
+static void put_le(uint8_t *p, uint64_t value, int bytes)
+{
+	for (int i = 0; i < bytes; i++) p[i] = (uint8_t)(value >> (8 * i));
+}
+
+/* PMTiles directory: counts, then delta coded ids, run lengths, lengths and offsets, each as its own column */
+static void pmtiles_directory(pbf *b, const pmtiles_entry *entries, size_t count)
+{
+	uint64_t last = 0;
+
+	pbf_varint(b, count);
+	for (size_t i = 0; i < count; i++)
+	{
+		pbf_varint(b, entries[i].tile_id - last);
+		last = entries[i].tile_id;
+	}
+	for (size_t i = 0; i < count; i++) pbf_varint(b, entries[i].run_length);
+	for (size_t i = 0; i < count; i++) pbf_varint(b, entries[i].length);
+	for (size_t i = 0; i < count; i++)
+	{
+		if (i && entries[i].offset == entries[i - 1].offset + entries[i - 1].length) pbf_varint(b, 0);
+		else pbf_varint(b, entries[i].offset + 1);
+	}
+}
+
+/* split the directory into leaves until the root fits alongside the header */
+static bool pmtiles_directories(const pmtiles_entry *entries, size_t count, pbf *root, pbf *leaves)
+{
+	pmtiles_directory(root, entries, count);
+	if (root->failed) return false;
+	if (root->len <= PMTILES_ROOT_LIMIT) return true;
+
+	for (size_t leaf_size = 4096; ; leaf_size *= 2)
+	{
+		size_t leaf_count = (count + leaf_size - 1) / leaf_size;
+		pmtiles_entry *index = malloc(leaf_count * sizeof(pmtiles_entry));
+		if (!index) return false;
+
+		root->len = leaves->len = 0;
+		for (size_t i = 0; i < leaf_count; i++)
+		{
+			size_t first = i * leaf_size;
+			size_t n = (count - first < leaf_size) ? count - first : leaf_size;
+			index[i].tile_id = entries[first].tile_id;
+			index[i].offset = leaves->len;
+			index[i].run_length = 0;
+			pmtiles_directory(leaves, entries + first, n);
+			index[i].length = (uint32_t)(leaves->len - index[i].offset);
+		}
+		pmtiles_directory(root, index, leaf_count);
+		free(index);
+
+		if (root->failed || leaves->failed) return false;
+		if (root->len <= PMTILES_ROOT_LIMIT) return true;
+	}
+}
+
+static bool pmtiles_write(const char *path, FILE *data, uint64_t data_length, const pmtiles_entry *entries, size_t count, uint8_t min_zoom, uint8_t max_zoom)
+{
+	pbf root = { 0 }, leaves = { 0 }, metadata = { 0 };
+	uint8_t header[PMTILES_HEADER_SIZE];
+	uint32_t min_x = UINT32_MAX, min_y = UINT32_MAX, max_x = 0, max_y = 0;
+	char json[512];
+	bool ok = false;
+
+	for (uint32_t t = 0; t < tileset.track_count; t++)
+	{
+		for (uint32_t i = 0; i < tileset.tracks[t].count; i++)
+		{
+			const tile_vertex *v = &tileset.tracks[t].vertices[i];
+			if (v->x < min_x) min_x = v->x;
+			if (v->x > max_x) max_x = v->x;
+			if (v->y < min_y) min_y = v->y;
+			if (v->y > max_y) max_y = v->y;
+		}
+	}
+
+	int length = snprintf(json, sizeof(json),
+		"{\"name\":\"gpstelemetry\",\"format\":\"pbf\",\"vector_layers\":[{\"id\":\"tracks\",\"fields\":{\"file\":\"String\"},\"minzoom\":%u,\"maxzoom\":%u}]}",
+		min_zoom, max_zoom);
+	pbf_reserve(&metadata, (size_t)length);
+	if (!metadata.failed)
+	{
+		memcpy(metadata.data, json, (size_t)length);
+		metadata.len = (size_t)length;
+	}
+
+	FILE *fp = NULL;
+	if (!metadata.failed && pmtiles_directories(entries, count, &root, &leaves) && (fp = fopen(path, "wb")))
+	{
+		uint64_t root_offset = PMTILES_HEADER_SIZE;
+		uint64_t metadata_offset = root_offset + root.len;
+		uint64_t leaves_offset = metadata_offset + metadata.len;
+		uint64_t data_offset = leaves_offset + leaves.len;
+
+		memset(header, 0, sizeof(header));
+		memcpy(header, "PMTiles", 7);
+		header[7] = 3;
+		put_le(header + 8, root_offset, 8);
+		put_le(header + 16, root.len, 8);
+		put_le(header + 24, metadata_offset, 8);
+		put_le(header + 32, metadata.len, 8);
+		put_le(header + 40, leaves_offset, 8);
+		put_le(header + 48, leaves.len, 8);
+		put_le(header + 56, data_offset, 8);
+		put_le(header + 64, data_length, 8);
+		put_le(header + 72, count, 8); /* addressed tiles */
+		put_le(header + 80, count, 8); /* tile entries */
+		put_le(header + 88, count, 8); /* tile contents */
+		header[96] = 1;  /* clustered */
+		header[97] = 1;  /* internal compression: none */
+		header[98] = 1;  /* tile compression: none */
+		header[99] = 1;  /* tile type: MVT */
+		header[100] = min_zoom;
+		header[101] = max_zoom;
+		put_le(header + 102, (uint32_t)(int32_t)lround(tile_lon(min_x) * 1e7), 4);
+		put_le(header + 106, (uint32_t)(int32_t)lround(tile_lat(max_y) * 1e7), 4);
+		put_le(header + 110, (uint32_t)(int32_t)lround(tile_lon(max_x) * 1e7), 4);
+		put_le(header + 114, (uint32_t)(int32_t)lround(tile_lat(min_y) * 1e7), 4);
+		header[118] = min_zoom;
+		put_le(header + 119, (uint32_t)(int32_t)lround(tile_lon(((double)min_x + max_x) / 2.0) * 1e7), 4);
+		put_le(header + 123, (uint32_t)(int32_t)lround(tile_lat(((double)min_y + max_y) / 2.0) * 1e7), 4);
+
+		ok = fwrite(header, 1, sizeof(header), fp) == sizeof(header) &&
+			fwrite(root.data, 1, root.len, fp) == root.len &&
+			fwrite(metadata.data, 1, metadata.len, fp) == metadata.len &&
+			(!leaves.len || fwrite(leaves.data, 1, leaves.len, fp) == leaves.len);
+
+		char buffer[65536];
+		size_t n;
+		rewind(data);
+		while (ok && (n = fread(buffer, 1, sizeof(buffer), data)) > 0)
+			ok = fwrite(buffer, 1, n, fp) == n;
+
+		if (fclose(fp) != 0) ok = false;
+	}
+
+	free(root.data);
+	free(leaves.data);
+	free(metadata.data);
+	return ok;
+}
+
+/* decode every file, then build the tile pyramid zoom by zoom */
+static int make_tiles(const char *path, const decode_options *opt, uint32_t threads, uint8_t min_zoom, uint8_t max_zoom)
+{
+	tile_worker *workers = calloc(threads, sizeof(tile_worker));
+	void **contexts = calloc(threads, sizeof(void *));
+	pmtiles_entry *entries = NULL;
+	size_t entry_count = 0, entry_size = 0;
+	uint64_t data_length = 0;
+	FILE *data = tmpfile();
+	bool ready = true, incomplete = false;
+	int result = 0;
+
+	if (!workers || !contexts || !data)
+	{
+		fprintf(stderr, "ERROR: unable to allocate tile workers\n");
+		free(workers);
+		free(contexts);
+		if (data) fclose(data);
+		return -1;
+	}
+
+	double tolerance = TILE_TOLERANCE * ldexp(1.0, 32 - max_zoom - TILE_EXTENT_BITS);
+	for (uint32_t t = 0; t < threads; t++)
+	{
+		contexts[t] = &workers[t];
+		workers[t].tolerance = tolerance * tolerance;
+		workers[t].values = malloc(pipeline.job_count * sizeof(int32_t));
+		workers[t].files = malloc(pipeline.job_count * sizeof(uint32_t));
+		if (!workers[t].values || !workers[t].files) ready = false;
+		else memset(workers[t].values, 0xff, pipeline.job_count * sizeof(int32_t));
+	}
+
+	if (!ready)
+	{
+		fprintf(stderr, "ERROR: unable to allocate tile workers\n");
+		result = -1;
+	}
+	else
+	{
+		result = collect_files(opt, &tile_sink, contexts, threads);
+	}
+
+	/* the decoders' line buffers are done with, and give their share of the budget to the zooms' runs */
+	for (uint32_t t = 0; t < threads; t++)
+	{
+		free(workers[t].raw);
+		mem_unkeep(&tileset.kept, (size_t)workers[t].raw_size * sizeof(tile_vertex));
+		workers[t].raw = NULL;
+		workers[t].raw_size = 0;
+	}
+
+	/* decoders finish in any order, so put the tracks back into file order for repeatable output */
+	if (tileset.track_count) qsort(tileset.tracks, tileset.track_count, sizeof(tile_track), compare_tracks);
+
+	for (uint8_t z = min_zoom; ready && z <= max_zoom; z++)
+	{
+		tile_run *runs = NULL;
+		size_t run_count = 0, run_size = 0;
+
+		tileset.zoom = z;
+		tolerance = TILE_TOLERANCE * ldexp(1.0, 32 - z - TILE_EXTENT_BITS);
+		tileset.tolerance = (z == max_zoom) ? 0.0 : tolerance * tolerance;
+
+		for (uint32_t t = 0; t < tileset.track_count; t++)
+		{
+			const tile_vertex *v = tileset.tracks[t].vertices;
+			uint32_t a = 0;
+			for (uint32_t b = 1; b < tileset.tracks[t].count; b++)
+			{
+				if (b != tileset.tracks[t].count - 1 && !tile_kept(v, b)) continue;
+				tile_segment(&runs, &run_count, &run_size, t, a, b);
+				a = b;
+			}
+		}
+		if (run_count) qsort(runs, run_count, sizeof(tile_run), compare_runs);
+
+		/* where each tile's runs start */
+		uint32_t tile_count = 0;
+		size_t zoom_bytes = run_size * sizeof(tile_run);
+		uint32_t *tiles = NULL;
+		if (!mem_keep(&tileset.kept, (run_count + 1) * sizeof(uint32_t))) tileset.over_budget = true;
+		else if (!(tiles = malloc((run_count + 1) * sizeof(uint32_t)))) mem_unkeep(&tileset.kept, (run_count + 1) * sizeof(uint32_t));
+		if (!tiles)
+		{
+			free(runs);
+			mem_unkeep(&tileset.kept, zoom_bytes);
+			incomplete = true;
+			break;
+		}
+		zoom_bytes += (run_count + 1) * sizeof(uint32_t);
+		for (uint32_t r = 0; r < run_count; r++)
+			if (!r || runs[r].tile_id != runs[r - 1].tile_id) tiles[tile_count++] = r;
+		tiles[tile_count] = (uint32_t)run_count;
+
+		tileset.runs = runs;
+		tileset.tiles = tiles;
+
+		for (uint32_t window = 0; window < tile_count; window += TILE_WINDOW)
+		{
+			pbf results[TILE_WINDOW];
+			memset(results, 0, sizeof(results));
+
+			tileset.window = window;
+			tileset.window_count = (tile_count - window < TILE_WINDOW) ? tile_count - window : TILE_WINDOW;
+			tileset.next_tile = 0;
+			tileset.results = results;
+
+			uint32_t started = 0;
+			if (threads > 1)
+				for (; started < threads; started++)
+					if (pthread_create(&workers[started].thread, NULL, tile_encode_thread, &workers[started]) != 0) break;
+			if (!started) tile_encode_thread(&workers[0]);
+			for (uint32_t t = 0; t < started; t++)
+				pthread_join(workers[t].thread, NULL);
+
+			for (uint32_t i = 0; i < tileset.window_count; i++)
+			{
+				if (results[i].failed) incomplete = true;
+				if (results[i].len && !results[i].failed)
+				{
+					if (entry_count == entry_size)
+					{
+						size_t size = entry_size ? 2 * entry_size : 1024;
+						pmtiles_entry *more = realloc(entries, size * sizeof(pmtiles_entry));
+						if (!more) incomplete = true;
+						else
+						{
+							entries = more;
+							entry_size = size;
+						}
+					}
+					if (entry_count < entry_size && fwrite(results[i].data, 1, results[i].len, data) == results[i].len)
+					{
+						pmtiles_entry *e = &entries[entry_count++];
+						e->tile_id = runs[tiles[window + i]].tile_id;
+						e->offset = data_length;
+						e->length = (uint32_t)results[i].len;
+						e->run_length = 1;
+						data_length += results[i].len;
+					}
+					else
+					{
+						incomplete = true;
+					}
+				}
+				free(results[i].data);
+			}
+		}
+
+		free(tiles);
+		free(runs);
+		mem_unkeep(&tileset.kept, zoom_bytes);
+	}
+
+	if (tileset.incomplete) incomplete = true;
+
+	if (ready && !entry_count)
+	{
+		if (tileset.over_budget) fprintf(stderr, "ERROR: tiling needs more than --mem_limit, no tiles written\n");
+		else fprintf(stderr, "ERROR: no GPS positions to tile\n");
+		result = -1;
+	}
+	else if (ready && !pmtiles_write(path, data, data_length, entries, entry_count, min_zoom, max_zoom))
+	{
+		fprintf(stderr, "ERROR: unable to write %s\n", path);
+		result = -1;
+	}
+	else if (incomplete)
+	{
+		fprintf(stderr, "ERROR: %s, %s is missing tiles\n", tileset.over_budget ? "tiling needs more than --mem_limit" : "out of memory", path);
+		result = -1;
+	}
+
+	fclose(data);
+	free(entries);
+	for (uint32_t t = 0; t < tileset.track_count; t++)
+		free(tileset.tracks[t].vertices);
+	free(tileset.tracks);
+	mem_unkeep(&tileset.kept, tileset.kept);
+	for (uint32_t t = 0; t < threads; t++)
+	{
+		free(workers[t].geometry.data);
+		free(workers[t].feature.data);
+		free(workers[t].layer.data);
+		free(workers[t].piece);
+		free(workers[t].tags.data);
+		free(workers[t].values);
+		free(workers[t].files);
+	}
+	free(workers);
+	free(contexts);
+
+	return result;
+}
+
+/*
+heatmap mode: every fix adds one to its pixel of a web mercator grid, 256 << zoom pixels around the world
+each decoder thread counts into its own sparse set of 256 x 256 tiles, which are merged once decoding is done
+*/
+#define HEAT_TILE_BITS 8
+#define HEAT_TILE (1 << HEAT_TILE_BITS)
+#define HEAT_MAX_ZOOM 22
+#define HEAT_MAX_PIXELS (1ull << 32) /* larger rasters need a lower --zoom */
+
+typedef struct heat_tile
+{
+	uint32_t x, y;
+	uint32_t counts[HEAT_TILE * HEAT_TILE];
+} heat_tile;
+
+/* open addressed set of tiles keyed on their position */
+typedef struct heat_map
+{
+	heat_tile **slots;
+	uint32_t count, size; /* size is a power of two */
+	heat_tile *last;      /* tile of the previous fix, which the next one usually shares */
+	uint32_t min_x, min_y, max_x, max_y; /* pixel bounds of everything counted */
+	uint8_t zoom;
+	size_t *kept;         /* bytes of every thread's tiles and slots, counted against the memory budget */
+	bool failed;
+	bool over_budget;     /* ...because the tiles didn't fit in --mem_limit */
+} heat_map;
+
+/* IDAT stream of a PNG, deflated by run length alone */
+typedef struct png_writer
+{
+	FILE *fp;
+	uint8_t chunk[65536]; /* IDAT bytes not yet written */
+	size_t len;
+	uint64_t bits;        /* deflate bit buffer, least significant bit first */
+	uint32_t nbits;
+	uint32_t adler_a, adler_b;
+	int last;             /* previous byte, -1 at the start */
+	uint32_t run;         /* copies of "last" not yet emitted */
+	bool failed;
+} png_writer;
+
+static uint32_t heat_hash(uint32_t x, uint32_t y)
+{
+	return (x * 0x9E3779B1u) ^ (y * 0x85EBCA77u);
+}
+
+static void heat_insert(heat_map *map, heat_tile *tile)
+{
+	uint32_t i = heat_hash(tile->x, tile->y) & (map->size - 1);
+	while (map->slots[i]) i = (i + 1) & (map->size - 1);
+	map->slots[i] = tile;
+	map->count++;
+}
+
+static heat_tile *heat_find(const heat_map *map, uint32_t x, uint32_t y)
+{
+	if (!map->size) return NULL;
+
+	for (uint32_t i = heat_hash(x, y) & (map->size - 1); map->slots[i]; i = (i + 1) & (map->size - 1))
+		if (map->slots[i]->x == x && map->slots[i]->y == y) return map->slots[i];
+	return NULL;
+}
+
+/* make room for one more tile, keeping the table at most half full */
+static bool heat_reserve(heat_map *map)
+{
+	if (2 * (map->count + 1) <= map->size) return true;
+
+	uint32_t size = map->size ? 2 * map->size : 64;
+	heat_tile **old = map->slots;
+	uint32_t old_size = map->size;
+
+	if (!mem_keep(map->kept, size * sizeof(heat_tile *)))
+	{
+		map->failed = map->over_budget = true;
+		return false;
+	}
+	map->slots = calloc(size, sizeof(heat_tile *));
+	if (!map->slots)
+	{
+		mem_unkeep(map->kept, size * sizeof(heat_tile *));
+		map->slots = old;
+		map->failed = true;
+		return false;
+	}
+	map->size = size;
+	map->count = 0;
+	for (uint32_t i = 0; i < old_size; i++)
+		if (old[i]) heat_insert(map, old[i]);
+	free(old);
+	mem_unkeep(map->kept, old_size * sizeof(heat_tile *));
+	return true;
+}
+
+static void heat_add(heat_map *map, uint32_t px, uint32_t py, uint32_t count)
+{
+	uint32_t x = px >> HEAT_TILE_BITS, y = py >> HEAT_TILE_BITS;
+	heat_tile *tile = map->last;
+
+	if (!tile || tile->x != x || tile->y != y)
+	{
+		tile = heat_find(map, x, y);
+		if (!tile)
+		{
+			if (!heat_reserve(map)) return;
+			if (!mem_keep(map->kept, sizeof(heat_tile)))
+			{
+				map->failed = map->over_budget = true;
+				return;
+			}
+			if (!(tile = calloc(1, sizeof(heat_tile))))
+			{
+				mem_unkeep(map->kept, sizeof(heat_tile));
+				map->failed = true;
+				return;
+			}
+			tile->x = x;
+			tile->y = y;
+			heat_insert(map, tile);
+		}
+		map->last = tile;
+	}
+
+	tile->counts[((py & (HEAT_TILE - 1)) << HEAT_TILE_BITS) | (px & (HEAT_TILE - 1))] += count;
+	if (px < map->min_x) map->min_x = px;
+	if (px > map->max_x) map->max_x = px;
+	if (py < map->min_y) map->min_y = py;
+	if (py > map->max_y) map->max_y = py;
+}
+
+static void heat_sample(void *ctx, file_job *job, const gps_sample *s)
+{
+	heat_map *map = ctx;
+	double x, y, scale = ldexp(1.0, map->zoom + HEAT_TILE_BITS);
+
+	if (s->lat == 0.0 && s->lon == 0.0) return; /* no position yet */
+
+	mercator(s->lat, s->lon, &x, &y);
+	heat_add(map, (uint32_t)fmin(fmax(x * scale, 0.0), scale - 1.0), (uint32_t)fmin(fmax(y * scale, 0.0), scale - 1.0), 1);
+}
+
+static const sample_sink heat_sink = { NULL, heat_sample, NULL, NULL };
+
+/* fold src's tiles into dst, taking over those dst doesn't have */
+static void heat_merge(heat_map *dst, heat_map *src)
+{
+	for (uint32_t i = 0; i < src->size; i++)
+	{
+		heat_tile *tile = src->slots[i];
+		if (!tile) continue;
+
+		heat_tile *into = heat_find(dst, tile->x, tile->y);
+		if (into)
+		{
+			for (uint32_t p = 0; p < HEAT_TILE * HEAT_TILE; p++) into->counts[p] += tile->counts[p];
+			free(tile);
+			mem_unkeep(src->kept, sizeof(heat_tile));
+		}
+		else if (heat_reserve(dst))
+		{
+			heat_insert(dst, tile);
+		}
+		else
+		{
+			free(tile);
+			mem_unkeep(src->kept, sizeof(heat_tile));
+		}
+		src->slots[i] = NULL;
+	}
+	if (src->min_x < dst->min_x) dst->min_x = src->min_x;
+	if (src->max_x > dst->max_x) dst->max_x = src->max_x;
+	if (src->min_y < dst->min_y) dst->min_y = src->min_y;
+	if (src->max_y > dst->max_y) dst->max_y = src->max_y;
+	if (src->failed) dst->failed = true;
+	if (src->over_budget) dst->over_budget = true;
+}
+
+static void heat_free(heat_map *map)
+{
+	for (uint32_t i = 0; i < map->size; i++) free(map->slots[i]);
+	free(map->slots);
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len)
+{
+	static uint32_t table[256];
+
+	if (!table[1])
+	{
+		for (uint32_t n = 0; n < 256; n++)
+		{
+			uint32_t c = n;
+			for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			table[n] = c;
+		}
+	}
+
+	crc = ~crc;
+	for (size_t i = 0; i < len; i++) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void put_be32(uint8_t *p, uint32_t value)
+{
+	p[0] = (uint8_t)(value >> 24);
+	p[1] = (uint8_t)(value >> 16);
+	p[2] = (uint8_t)(value >> 8);
+	p[3] = (uint8_t)value;
+}
+
+static void png_chunk(png_writer *w, const char *type, const uint8_t *data, size_t len)
+{
+	uint8_t header[8], crc[4];
+
+	put_be32(header, (uint32_t)len);
+	memcpy(header + 4, type, 4);
+	put_be32(crc, crc32_update(crc32_update(0, header + 4, 4), data, len));
+
+	if (fwrite(header, 1, 8, w->fp) != 8 || (len && fwrite(data, 1, len, w->fp) != len) || fwrite(crc, 1, 4, w->fp) != 4)
+		w->failed = true;
+}
+
+static void png_byte(png_writer *w, uint8_t b)
+{
+	w->chunk[w->len++] = b;
+	if (w->len == sizeof(w->chunk))
+	{
+		png_chunk(w, "IDAT", w->chunk, w->len);
+		w->len = 0;
+	}
+}
+
+static void png_bits(png_writer *w, uint32_t value, uint32_t count)
+{
+	w->bits |= (uint64_t)value << w->nbits;
+	w->nbits += count;
+	while (w->nbits >= 8)
+	{
+		png_byte(w, (uint8_t)w->bits);
+		w->bits >>= 8;
+		w->nbits -= 8;
+	}
+}
+
+/* Huffman codes go out most significant bit first */
+static void png_code(png_writer *w, uint32_t code, uint32_t length)
+{
+	uint32_t reversed = 0;
+	for (uint32_t i = 0; i < length; i++) reversed |= ((code >> i) & 1) << (length - 1 - i);
+	png_bits(w, reversed, length);
+}
+
+/* fixed Huffman literal/length symbol */
+static void png_symbol(png_writer *w, uint32_t symbol)
+{
+	if (symbol < 144) png_code(w, 0x30 + symbol, 8);
+	else if (symbol < 256) png_code(w, 0x190 + symbol - 144, 9);
+	else if (symbol < 280) png_code(w, symbol - 256, 7);
+	else png_code(w, 0xC0 + symbol - 280, 8);
+}
+
+/* emit the pending run as a copy at distance 1, or as literals if too short */
+static void png_run(png_writer *w)
+{
+	static const uint16_t base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	static const uint8_t extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+
+	if (w->run >= 3)
+	{
+		uint32_t i = 28;
+		while (base[i] > w->run) i--;
+		png_symbol(w, 257 + i);
+		png_bits(w, w->run - base[i], extra[i]);
+		png_code(w, 0, 5); /* distance 1 */
+	}
+	else
+	{
+		for (uint32_t i = 0; i < w->run; i++) png_symbol(w, (uint32_t)w->last);
+	}
+	w->run = 0;
+}
+
+static void png_data(png_writer *w, const uint8_t *data, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+	{
+		w->adler_a = (w->adler_a + data[i]) % 65521;
+		w->adler_b = (w->adler_b + w->adler_a) % 65521;
+
+		if (data[i] == w->last && w->run < 258)
+		{
+			w->run++;
+			continue;
+		}
+		png_run(w);
+		if (data[i] == w->last)
+		{
+			w->run = 1;
+			continue;
+		}
+		png_symbol(w, data[i]);
+		w->last = data[i];
+	}
+}
+
+/* log scaled density to a blue, cyan, yellow, red ramp, transparent where nothing was recorded */
+static void heat_colour(uint32_t count, double scale, uint8_t *rgba)
+{
+	static const double ramp[4][3] = { { 0, 0, 255 }, { 0, 255, 255 }, { 255, 255, 0 }, { 255, 0, 0 } };
+
+	if (!count)
+	{
+		memset(rgba, 0, 4);
+		return;
+	}
+
+	double v = log1p(count) * scale * 3.0;
+	int i = (v >= 3.0) ? 2 : (int)v;
+	double f = v - i;
+	for (int c = 0; c < 3; c++) rgba[c] = (uint8_t)lround(ramp[i][c] + (ramp[i + 1][c] - ramp[i][c]) * f);
+	rgba[3] = (uint8_t)lround(96.0 + 159.0 * v / 3.0);
+}
+
+/* write the merged grid as a PNG, or as little-endian float32 rows for any other extension */
+static bool heat_write(const char *path, heat_map *map)
+{
+	uint32_t width = map->max_x - map->min_x + 1, height = map->max_y - map->min_y + 1;
+	uint32_t peak = 0;
+	size_t dot = strlen(path) > 4 ? strlen(path) - 4 : 0;
+	bool png = !strcasecmp(path + dot, ".png");
+
+	if ((uint64_t)width * height > HEAT_MAX_PIXELS)
+	{
+		fprintf(stderr, "ERROR: heatmap would be %u x %u pixels, use a lower --zoom\n", width, height);
+		return false;
+	}
+
+	for (uint32_t i = 0; i < map->size; i++)
+	{
+		if (!map->slots[i]) continue;
+		for (uint32_t p = 0; p < HEAT_TILE * HEAT_TILE; p++)
+			if (map->slots[i]->counts[p] > peak) peak = map->slots[i]->counts[p];
+	}
+
+	size_t stride = png ? 1 + 4 * (size_t)width : 4 * (size_t)width;
+	if (!mem_keep(map->kept, stride + sizeof(png_writer)))
+	{
+		fprintf(stderr, "ERROR: a heatmap row %u pixels wide needs more than --mem_limit, use a lower --zoom\n", width);
+		return false;
+	}
+	uint8_t *row = malloc(stride);
+	png_writer *w = calloc(1, sizeof(png_writer));
+	FILE *fp = fopen(path, "wb");
+	bool ok = row && w && fp;
+
+	if (ok && png)
+	{
+		static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+		uint8_t ihdr[13] = { 0 };
+
+		put_be32(ihdr, width);
+		put_be32(ihdr + 4, height);
+		ihdr[8] = 8; /* bits per channel */
+		ihdr[9] = 6; /* RGBA */
+
+		w->fp = fp;
+		w->adler_a = 1;
+		w->last = -1;
+		if (fwrite(signature, 1, sizeof(signature), fp) != sizeof(signature)) w->failed = true;
+		png_chunk(w, "IHDR", ihdr, sizeof(ihdr));
+		png_byte(w, 0x78); /* zlib header: deflate, 32K window */
+		png_byte(w, 0x01);
+		png_bits(w, 1, 1); /* final block */
+		png_bits(w, 1, 2); /* fixed Huffman codes */
+	}
+
+	double scale = peak ? 1.0 / log1p(peak) : 0.0;
+	for (uint32_t y = map->min_y; ok && y <= map->max_y; y++)
+	{
+		uint8_t *p = row;
+		if (png) *p++ = 0; /* no filter */
+
+		for (uint32_t x = map->min_x; x <= map->max_x; )
+		{
+			const heat_tile *tile = heat_find(map, x >> HEAT_TILE_BITS, y >> HEAT_TILE_BITS);
+			uint32_t end = (x | (HEAT_TILE - 1)) < map->max_x ? (x | (HEAT_TILE - 1)) : map->max_x;
+
+			for (; x <= end; x++, p += 4)
+			{
+				uint32_t count = tile ? tile->counts[((y & (HEAT_TILE - 1)) << HEAT_TILE_BITS) | (x & (HEAT_TILE - 1))] : 0;
+				if (png)
+				{
+					heat_colour(count, scale, p);
+				}
+				else
+				{
+					float f = (float)count;
+					uint32_t bits;
+					memcpy(&bits, &f, sizeof(bits));
+					put_le(p, bits, 4);
+				}
+			}
+		}
+
+		if (png) png_data(w, row, stride);
+		else ok = fwrite(row, 1, stride, fp) == stride;
+		if (w->failed) ok = false;
+	}
+
+	if (ok && png)
+	{
+		uint8_t adler[4];
+
+		png_run(w);
+		png_symbol(w, 256); /* end of block */
+		png_bits(w, 0, (8 - w->nbits) & 7);
+		put_be32(adler, (w->adler_b << 16) | w->adler_a);
+		for (int i = 0; i < 4; i++) png_byte(w, adler[i]);
+		if (w->len) png_chunk(w, "IDAT", w->chunk, w->len);
+		png_chunk(w, "IEND", NULL, 0);
+		ok = !w->failed;
+	}
+
+	if (fp && fclose(fp) != 0) ok = false;
+	free(row);
+	free(w);
+	mem_unkeep(map->kept, stride + sizeof(png_writer));
+
+	if (!ok)
+	{
+		fprintf(stderr, "ERROR: unable to write %s\n", path);
+		return false;
+	}
+
+	/* georeferencing, as CSV on stdout */
+	double unit = ldexp(1.0, 32 - map->zoom - HEAT_TILE_BITS);
+	printf("width,height,zoom,west,south,east,north,peak\n");
+	printf("%u,%u,%u,%.7f,%.7f,%.7f,%.7f,%u\n", width, height, map->zoom,
+		tile_lon(map->min_x * unit), tile_lat((map->max_y + 1.0) * unit),
+		tile_lon((map->max_x + 1.0) * unit), tile_lat(map->min_y * unit), peak);
+	return true;
+}
+
+static int make_heatmap(const char *path, const decode_options *opt, uint32_t threads, uint8_t zoom)
+{
+	heat_map *maps = calloc(threads, sizeof(heat_map));
+	void **contexts = calloc(threads, sizeof(void *));
+	size_t kept = 0;
+	int result;
+
+	if (!maps || !contexts)
+	{
+		fprintf(stderr, "ERROR: unable to allocate heatmap workers\n");
+		free(maps);
+		free(contexts);
+		return -1;
+	}
+
+	for (uint32_t t = 0; t < threads; t++)
+	{
+		maps[t].zoom = zoom;
+		maps[t].min_x = maps[t].min_y = UINT32_MAX;
+		maps[t].kept = &kept;
+		contexts[t] = &maps[t];
+	}
+
+	result = collect_files(opt, &heat_sink, contexts, threads);
+
+	for (uint32_t t = 1; t < threads; t++)
+		heat_merge(&maps[0], &maps[t]);
+
+	if (!maps[0].count)
+	{
+		if (maps[0].over_budget) fprintf(stderr, "ERROR: the heatmap needs more than --mem_limit, nothing written\n");
+		else fprintf(stderr, "ERROR: no GPS positions to rasterise\n");
+		result = -1;
+	}
+	else if (!heat_write(path, &maps[0]))
+	{
+		result = -1;
+	}
+	else if (maps[0].failed)
+	{
+		fprintf(stderr, "ERROR: %s, %s is missing samples\n", maps[0].over_budget ? "the heatmap needs more than --mem_limit" : "out of memory", path);
+		result = -1;
+	}
+
+	for (uint32_t t = 0; t < threads; t++) heat_free(&maps[t]);
+	mem_unkeep(&kept, kept);
+	free(maps);
+	free(contexts);
+
+	return result;
+}
+
+/*
+sidecar mode: a telemetry-only MP4 for each file, holding the GPMF payloads copied byte for byte into a new "mdat"
+and a minimal "moov" (the movie header, user data and the GPMF track's own boxes, with only its sample size and
+chunk tables written afresh), so that later extractions read megabytes instead of seeking through the video
+*/
+#define SIDECAR_BOX_LIMIT (64u * 1024u * 1024u) /* largest box copied into the new moov */
+
+static void box_bytes(pbf *b, const void *data, size_t len)
+{
+	pbf_reserve(b, len);
+	if (b->failed) return;
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void box_be32(pbf *b, uint32_t value)
+{
+	uint8_t bytes[4];
+	put_be32(bytes, value);
+	box_bytes(b, bytes, 4);
+}
+
+/* start a box, returning where its size is filled in by box_close() */
+static size_t box_open(pbf *b, uint32_t type)
+{
+	size_t at = b->len;
+	uint8_t id[4];
+
+	put_le(id, type, 4); /* MAKEID() packs the first character lowest */
+	box_be32(b, 0);
+	box_bytes(b, id, 4);
+	return at;
+}
+
+static void box_close(pbf *b, size_t at)
+{
+	if (b->failed) return;
+	if (b->len - at > UINT32_MAX) b->failed = true;
+	else put_be32(b->data + at, (uint32_t)(b->len - at));
+}
+
+/* copy a box, header and all, from the source */
+static void box_copy(pbf *b, gpmf_track *t, const mp4_box *box)
+{
+	uint64_t size = box->end - box->head;
+
+	if (size > SIDECAR_BOX_LIMIT) b->failed = true;
+	pbf_reserve(b, size);
+	if (b->failed) return;
+
+	if (fseeko(t->fp, (off_t)box->head, SEEK_SET) != 0 || fread(b->data + b->len, 1, size, t->fp) != size)
+	{
+		b->failed = true;
+		return;
+	}
+	/* a box that ran to the end of its parent may not be last any more */
+	if (!be32(b->data + b->len)) put_be32(b->data + b->len, (uint32_t)size);
+	b->len += size;
+}
+
+/* rebuild one of the GPMF track's containers; every chunk of the copy holds one payload, at "offsets" */
+static void sidecar_container(pbf *b, gpmf_track *t, const mp4_box *box, const uint64_t *offsets, bool co64)
+{
+	uint64_t pos = box->start;
+	size_t at = box_open(b, box->type);
+	mp4_box child;
+
+	while (next_box(t, &pos, box->end, &child))
+	{
+		switch (child.type)
+		{
+		case MAKEID('m','d','i','a'):
+		case MAKEID('m','i','n','f'):
+		case MAKEID('s','t','b','l'):
+			sidecar_container(b, t, &child, offsets, co64);
+			break;
+
+		case MAKEID('s','t','s','z'):
+		case MAKEID('s','t','s','c'):
+		case MAKEID('s','t','c','o'):
+		case MAKEID('c','o','6','4'):
+			break; /* written afresh below */
+
+		default:
+			box_copy(b, t, &child);
+			break;
+		}
+	}
+
+	if (box->type == MAKEID('s','t','b','l'))
+	{
+		size_t table = box_open(b, MAKEID('s','t','s','z'));
+		box_be32(b, 0); /* version and flags */
+		box_be32(b, 0); /* sizes vary */
+		box_be32(b, t->count);
+		for (uint32_t i = 0; i < t->count; i++) box_be32(b, t->sizes[i]);
+		box_close(b, table);
+
+		table = box_open(b, MAKEID('s','t','s','c'));
+		box_be32(b, 0);
+		box_be32(b, 1); /* one entry: from the first chunk on, one payload per chunk, sample description 1 */
+		box_be32(b, 1);
+		box_be32(b, 1);
+		box_be32(b, 1);
+		box_close(b, table);
+
+		table = box_open(b, co64 ? MAKEID('c','o','6','4') : MAKEID('s','t','c','o'));
+		box_be32(b, 0);
+		box_be32(b, t->count);
+		for (uint32_t i = 0; i < t->count; i++)
+		{
+			if (co64) box_be32(b, (uint32_t)(offsets[i] >> 32));
+			box_be32(b, (uint32_t)offsets[i]);
+		}
+		box_close(b, table);
+	}
+
+	box_close(b, at);
+}
+
+static void sidecar_moov(pbf *b, gpmf_track *t, const uint64_t *offsets, bool co64)
+{
+	uint64_t pos = t->moov.start;
+	size_t at = box_open(b, MAKEID('m','o','o','v'));
+	mp4_box child;
+
+	t->boxes_left = MP4_BOX_LIMIT;
+	while (next_box(t, &pos, t->moov.end, &child))
+	{
+		if (child.type == MAKEID('m','v','h','d') || child.type == MAKEID('u','d','t','a'))
+			box_copy(b, t, &child);
+		else if (child.head == t->trak.head)
+			sidecar_container(b, t, &child, offsets, co64);
+	}
+
+	box_close(b, at);
+}
+
+/* write the sidecar of one file into "dir"; returns why it failed, NULL on success */
+static const char *write_sidecar(const file_job *job, const char *dir, const decode_options *opt)
+{
+	uint64_t table_limit = (opt->max_alloc && opt->max_alloc < MP4_TABLE_LIMIT) ? opt->max_alloc : MP4_TABLE_LIMIT;
+	gpmf_track *t = open_gpmf_track(job->path, table_limit);
+	const char *error = NULL;
+
+	if (!t) return "not an MP4/MOV with a GPMF track";
+
+	char *path = malloc(strlen(dir) + strlen(job->display_name) + 2);
+	char *tmp = malloc(strlen(dir) + strlen(job->display_name) + 6);
+	uint64_t *offsets = malloc(t->count * sizeof(uint64_t) + 1);
+	uint8_t *payload = NULL;
+	pbf moov = { 0 };
+	FILE *fp = NULL;
+
+	if (!path || !tmp || !offsets)
+	{
+		error = "out of memory";
+		goto done;
+	}
+	sprintf(path, "%s/%s", dir, job->display_name);
+	sprintf(tmp, "%s.tmp", path);
+
+	/* the sidecar has the recording's name, so mustn't be written over the recording itself */
+	struct stat in, out;
+	if (stat(path, &out) == 0 && fstat(fileno(t->fp), &in) == 0 && in.st_dev == out.st_dev && in.st_ino == out.st_ino)
+	{
+		error = "the sidecar would replace the recording";
+		goto done;
+	}
+
+	uint8_t ftyp[24] = { 0, 0, 0, 24, 'f', 't', 'y', 'p', 'm', 'p', '4', '1', 0, 0, 0, 0, 'm', 'p', '4', '1', 'i', 's', 'o', 'm' };
+	uint64_t total = 0;
+	uint32_t largest = 0;
+	for (uint32_t i = 0; i < t->count; i++)
+	{
+		total += t->sizes[i];
+		if (t->sizes[i] > largest) largest = t->sizes[i];
+	}
+	if (opt->max_alloc && largest > opt->max_alloc)
+	{
+		error = "payload exceeds --max_alloc";
+		goto done;
+	}
+
+	uint8_t mdat[16];
+	uint32_t mdat_header = (8 + total > UINT32_MAX) ? 16 : 8;
+	put_be32(mdat, (16 == mdat_header) ? 1 : (uint32_t)(8 + total));
+	memcpy(mdat + 4, "mdat", 4);
+	put_be32(mdat + 8, (uint32_t)((16 + total) >> 32));
+	put_be32(mdat + 12, (uint32_t)(16 + total));
+
+	uint64_t offset = sizeof(ftyp) + mdat_header;
+	for (uint32_t i = 0; i < t->count; i++)
+	{
+		offsets[i] = offset;
+		offset += t->sizes[i];
+	}
+	sidecar_moov(&moov, t, offsets, offset > UINT32_MAX);
+	payload = malloc(largest + 1);
+	if (moov.failed || !payload)
+	{
+		error = moov.failed ? "unable to copy the GPMF track's boxes" : "out of memory";
+		goto done;
+	}
+
+	/* written under another name first, so an interrupted run leaves no half sidecar behind; never one another writer has */
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if (fd < 0 || !(fp = fdopen(fd, "wb")))
+	{
+		error = (fd < 0 && EEXIST == errno) ? "the sidecar's .tmp file already exists" : "unable to create the sidecar";
+		if (fd >= 0)
+		{
+			close(fd);
+			remove(tmp);
+		}
+		goto done;
+	}
+
+	bool ok = fwrite(ftyp, 1, sizeof(ftyp), fp) == sizeof(ftyp) && fwrite(mdat, 1, mdat_header, fp) == mdat_header;
+	for (uint32_t i = 0; ok && i < t->count; i++)
+	{
+		if (pipeline_aborted()) ok = false;
+		else if (fseeko(t->fp, (off_t)t->offsets[i], SEEK_SET) != 0 || fread(payload, 1, t->sizes[i], t->fp) != t->sizes[i]) error = "unable to read a payload";
+		else ok = fwrite(payload, 1, t->sizes[i], fp) == t->sizes[i];
+		if (error) ok = false;
+	}
+	ok = ok && fwrite(moov.data, 1, moov.len, fp) == moov.len;
+	if (fclose(fp) != 0) ok = false;
+
+	if (!ok || rename(tmp, path) != 0)
+	{
+		if (!error) error = "unable to write the sidecar";
+		remove(tmp);
+	}
+
+done:
+	free(path);
+	free(tmp);
+	free(offsets);
+	free(payload);
+	free(moov.data);
+	close_gpmf_track(t);
+	return error;
+}
+
+typedef struct sidecar_worker
+{
+	pthread_t thread;
+	const char *dir;
+	const decode_options *opt;
+} sidecar_worker;
+
+static void *sidecar_thread(void *arg)
+{
+	sidecar_worker *w = arg;
+
+	for (;;)
+	{
+		file_job *job = NULL;
+
+		pthread_mutex_lock(&pipeline.lock);
+		if (!pipeline.abort && pipeline.next_job < pipeline.job_count)
+			job = &pipeline.jobs[pipeline.next_job++];
+		pthread_mutex_unlock(&pipeline.lock);
+
+		if (!job) break;
+
+		job_update(job, JOB_RUNNING);
+		job->abort_reason = write_sidecar(job, w->dir, w->opt);
+		job_update(job, JOB_FINISHED);
+	}
+
+	return NULL;
+}
+
+/* write every file's sidecar into "dir", on up to "threads" threads; a bad file is reported but doesn't stop the rest */
+static int sidecar_name_compare(const void *a, const void *b)
+{
+	return strcmp((*(const file_job * const *)a)->display_name, (*(const file_job * const *)b)->display_name);
+}
+
+/* sidecars are named after the recording alone, so two recordings of the same name would write the same sidecar */
+static bool sidecar_names_unique(void)
+{
+	const file_job **sorted = malloc(pipeline.job_count * sizeof(file_job *) + 1);
+	bool unique = true;
+
+	if (!sorted)
+	{
+		fprintf(stderr, "ERROR: unable to allocate sidecar names\n");
+		return false;
+	}
+	for (uint32_t index = 0; index < pipeline.job_count; index++) sorted[index] = &pipeline.jobs[index];
+	if (pipeline.job_count) qsort(sorted, pipeline.job_count, sizeof(file_job *), sidecar_name_compare);
+
+	for (uint32_t index = 1; index < pipeline.job_count; index++)
+	{
+		if (strcmp(sorted[index - 1]->display_name, sorted[index]->display_name)) continue;
+		fprintf(stderr, "ERROR: %s and %s would both write the sidecar %s\n", sorted[index - 1]->path, sorted[index]->path, sorted[index]->display_name);
+		unique = false;
+	}
+
+	free(sorted);
+	return unique;
+}
+
+static int make_sidecars(const char *dir, const decode_options *opt, uint32_t threads)
+{
+	if (!sidecar_names_unique()) return -1;
+
+	sidecar_worker *workers = calloc(threads, sizeof(sidecar_worker));
+	uint32_t started = 0;
+	int result = 0;
+
+	if (!workers)
+	{
+		fprintf(stderr, "ERROR: unable to allocate sidecar threads\n");
+		return -1;
+	}
+
+	for (uint32_t t = 0; t < threads; t++)
+	{
+		workers[t].dir = dir;
+		workers[t].opt = opt;
+	}
+
+	if (threads > 1)
+		for (; started < threads; started++)
+			if (pthread_create(&workers[started].thread, NULL, sidecar_thread, &workers[started]) != 0) break;
+	if (!started) sidecar_thread(&workers[0]);
+	for (uint32_t t = 0; t < started; t++)
+		pthread_join(workers[t].thread, NULL);
+	free(workers);
+
+	for (uint32_t index = 0; index < pipeline.job_count; index++)
+	{
+		if (!pipeline.jobs[index].abort_reason) continue;
+		fprintf(stderr, "ERROR: %s: %s\n", pipeline.jobs[index].path, pipeline.jobs[index].abort_reason);
+		result = -1;
+	}
+
+	return result;
+}
+
+/*
+verify mode: every payload of every file is checked with GPMF's structural validation, its MP4 and GPSU times
+for going backwards and its GPS sample count against the stream's nominal rate, without decoding samples for output
+*/
+#define VERIFY_GPS5_RATE 18.0      /* Hz, nominal */
+#define VERIFY_GPS9_RATE 10.0
+#define VERIFY_RATE_TOLERANCE 0.25 /* fraction of the expected count a payload may be off by, at least VERIFY_RATE_SLACK samples */
+#define VERIFY_RATE_SLACK 2.0
+
+/* outcome of one job, which may be part of a file */
+typedef struct verify_result
+{
+	uint32_t checked;          /* payloads */
+	uint32_t bad_payload;      /* first that failed, counting from the start of the file */
+	const char *reason;        /* why, NULL if all passed */
+	double first_start, last_finish; /* MP4 time of the payloads checked */
+	char first_gpsu[16], last_gpsu[16]; /* "yymmddhhmmss.sss", which sorts in time order; empty if none */
+} verify_result;
+
+static void verify_fail(verify_result *r, uint32_t payload, const char *reason)
+{
+	if (r->reason) return;
+	r->bad_payload = payload;
+	r->reason = reason;
+}
+
+static void verify_job(file_job *job, const decode_options *opt, verify_result *r)
+{
+	GPMF_stream metadata_stream, *ms = &metadata_stream;
+	gpmf_source src;
+	char previous_gpsu[16] = { 0 };
+	double previous_start = 0.0;
+
+	memset(ms, 0, sizeof(*ms));
+	r->first_start = r->last_finish = NAN;
+
+	if (!source_open(&src, job->path, opt))
+	{
+		verify_fail(r, job->first_payload, "not an MP4/MOV with a GPMF track");
+		return;
+	}
+
+	uint32_t payloads = source_payloads(&src);
+	if (job->end_payload && job->end_payload < payloads) payloads = job->end_payload;
+
+	for (uint32_t index = job->first_payload; index < payloads && !r->reason && !pipeline_aborted(); index++)
+	{
+		uint32_t payloadsize = source_payload_size(&src, index);
+		double start, finish;
+
+		if (opt->max_alloc && payloadsize > opt->max_alloc)
+		{
+			verify_fail(r, index, "payload exceeds --max_alloc");
+			break;
+		}
+
+		uint32_t *payload = source_payload(&src, index);
+		if (!payload)
+		{
+			verify_fail(r, index, "payload can't be read");
+			break;
+		}
+
+		if (source_payload_time(&src, index, &start, &finish) != GPMF_OK || finish < start || (index > job->first_payload && start < previous_start))
+		{
+			verify_fail(r, index, "payload time goes backwards");
+			break;
+		}
+		if (isnan(r->first_start)) r->first_start = start;
+		r->last_finish = finish;
+		previous_start = start;
+
+		if (GPMF_Init(ms, payload, payloadsize) != GPMF_OK || GPMF_Validate(ms, GPMF_RECURSE_LEVELS) != GPMF_OK)
+		{
+			verify_fail(r, index, "GPMF structure is invalid");
+			break;
+		}
+		GPMF_ResetState(ms);
+		r->checked++;
+
+		/* only the KLV headers are looked at; GPS9 is preferred where both are present, as when decoding */
+		uint32_t gps5 = 0, gps9 = 0, klvs = 0;
+		bool has_gps5 = false, has_gps9 = false;
+		do
+		{
+			uint32_t key = GPMF_Key(ms);
+
+			if (opt->max_klv && ++klvs > opt->max_klv)
+			{
+				verify_fail(r, index, "payload has more KLVs than --max_klv");
+				break;
+			}
+
+			if (STR2FOURCC("GPS5") == key)
+			{
+				has_gps5 = true;
+				gps5 += GPMF_Repeat(ms);
+			}
+			else if (STR2FOURCC("GPS9") == key)
+			{
+				has_gps9 = true;
+				gps9 += GPMF_Repeat(ms);
+			}
+			else if (STR2FOURCC("GPSU") == key && GPMF_StructSize(ms) >= 16)
+			{
+				const char *gpsu = GPMF_RawData(ms);
+				if (previous_gpsu[0] && memcmp(gpsu, previous_gpsu, 16) < 0) verify_fail(r, index, "GPSU time goes backwards");
+				memcpy(previous_gpsu, gpsu, 16);
+				if (!r->first_gpsu[0]) memcpy(r->first_gpsu, gpsu, 16);
+				memcpy(r->last_gpsu, gpsu, 16);
+			}
+		} while (!r->reason && GPMF_OK == GPMF_Next(ms, GPMF_RECURSE_LEVELS));
+
+		if (!r->reason && (has_gps5 || has_gps9))
+		{
+			double expected = (finish - start) * (has_gps9 ? VERIFY_GPS9_RATE : VERIFY_GPS5_RATE);
+			double slack = expected * VERIFY_RATE_TOLERANCE;
+			if (slack < VERIFY_RATE_SLACK) slack = VERIFY_RATE_SLACK;
+			if (fabs((has_gps9 ? gps9 : gps5) - expected) > slack)
+				verify_fail(r, index, has_gps9 ? "GPS9 sample count is off the nominal rate" : "GPS5 sample count is off the nominal rate");
+		}
+		GPMF_ResetState(ms);
+	}
+
+	GPMF_Free(ms);
+	source_close(&src);
+}
+
+typedef struct verify_worker
+{
+	pthread_t thread;
+	const decode_options *opt;
+	verify_result *results;
+} verify_worker;
+
+static void *verify_thread(void *arg)
+{
+	verify_worker *w = arg;
+
+	for (;;)
+	{
+		file_job *job = NULL;
+
+		pthread_mutex_lock(&pipeline.lock);
+		if (!pipeline.abort && pipeline.next_job < pipeline.job_count)
+			job = &pipeline.jobs[pipeline.next_job++];
+		pthread_mutex_unlock(&pipeline.lock);
+
+		if (!job) break;
+
+		job_update(job, JOB_RUNNING);
+		verify_job(job, w->opt, &w->results[job - pipeline.jobs]);
+		job_update(job, JOB_FINISHED);
+	}
+
+	return NULL;
+}
+
+/* check every file on up to "threads" threads and print one row per file; big files are checked in parts */
+static int verify_files(const output_options *out, const decode_options *opt, uint32_t threads)
+{
+	verify_result *results = calloc(pipeline.job_count, sizeof(verify_result));
+	verify_worker *workers = calloc(threads, sizeof(verify_worker));
+	uint32_t started = 0;
+	int result = 0;
+
+	if (!results || !workers)
+	{
+		fprintf(stderr, "ERROR: unable to allocate verify threads\n");
+		free(results);
+		free(workers);
+		return -1;
+	}
+
+	for (uint32_t t = 0; t < threads; t++)
+	{
+		workers[t].opt = opt;
+		workers[t].results = results;
+	}
+
+	if (threads > 1)
+		for (; started < threads; started++)
+			if (pthread_create(&workers[started].thread, NULL, verify_thread, &workers[started]) != 0) break;
+	if (!started) verify_thread(&workers[0]);
+	for (uint32_t t = 0; t < started; t++)
+		pthread_join(workers[t].thread, NULL);
+	free(workers);
+
+	/* the parts of a file are joined up again, checking the seams between them too */
+	printf("\"file\",\"result\",\"payloads\",\"first bad payload\",\"reason\"\n");
+	for (uint32_t first = 0, last; first < pipeline.job_count; first = last + 1)
+	{
+		uint32_t checked = 0, bad_payload = 0;
+		const char *reason = NULL;
+
+		for (last = first; last + 1 < pipeline.job_count && pipeline.jobs[last].continues; last++);
+		for (uint32_t index = first; index <= last && !reason; index++)
+		{
+			const verify_result *r = &results[index], *previous = (index > first) ? &results[index - 1] : NULL;
+			const file_job *job = &pipeline.jobs[index];
+
+			if (previous && r->first_gpsu[0] && previous->last_gpsu[0] && memcmp(r->first_gpsu, previous->last_gpsu, 16) < 0)
+				reason = "GPSU time goes backwards";
+			else if (previous && !isnan(r->first_start) && !isnan(previous->last_finish) && r->first_start < previous->last_finish - 1e-6)
+				reason = "payload time goes backwards";
+			if (reason)
+			{
+				bad_payload = job->first_payload;
+				break;
+			}
+
+			checked += r->checked;
+			reason = r->reason;
+			bad_payload = r->bad_payload;
+		}
+
+		const file_job *job = &pipeline.jobs[first];
+		printf("\"%s\", %s, %u, ", out->print_filepath ? job->path : job->display_name, reason ? "fail" : "pass", checked);
+		if (reason)
+		{
+			printf("%u, \"%s\"\n", bad_payload, reason);
+			result = -1;
+		}
+		else
+		{
+			printf(", \"\"\n");
+		}
+	}
+
+	free(results);
+	return result;
+}
+
+/*
+catalogue mode: which camera recorded each file, from the moov's "mvhd" and "udta" boxes and the first GPMF
+payload alone; no samples are decoded and files are read on up to --jobs threads
+*/
+#define CATALOGUE_LABEL 64
+#define MP4_EPOCH_OFFSET 2082844800ull /* seconds from 1904, where MP4 times start, to 1970 */
+
+typedef struct camera_record
+{
+	bool ok;
+	char camera[CATALOGUE_LABEL];   /* udta "MINF", else the first payload's "DVNM" */
+	char serial[CATALOGUE_LABEL];   /* "CASN" */
+	char firmware[CATALOGUE_LABEL]; /* udta "FIRM", else "FMWR" */
+	bool gps5, gps9;                /* streams in the first payload */
+	uint64_t created;               /* "mvhd" creation time, seconds since 1904, 0 if unset */
+	double duration;
+	uint32_t payloads;
+} camera_record;
+
+typedef struct catalogue_worker
+{
+	pthread_t thread;
+	const decode_options *opt;
+	camera_record *records;
+} catalogue_worker;
+
+/* a GPMF or MP4 string up to its first NUL, without trailing spaces, or anything that would break the CSV */
+static void copy_label(char *label, const void *text, uint32_t length)
+{
+	const char *s = text;
+	uint32_t n = 0;
+
+	for (uint32_t i = 0; i < length && s[i] && n + 1 < CATALOGUE_LABEL; i++)
+		if ('"' != s[i] && (unsigned char)s[i] >= ' ') label[n++] = s[i];
+	while (n && ' ' == label[n - 1]) n--;
+	label[n] = '\0';
+}
+
+/* pick out the labels and GPS streams of a GPMF buffer; labels already found are kept */
+static void catalogue_gpmf(camera_record *r, uint32_t *buffer, uint32_t size, const decode_options *opt)
+{
+	GPMF_stream metadata_stream, *ms = &metadata_stream;
+	uint32_t klvs = 0;
+
+	memset(ms, 0, sizeof(*ms));
+	if (GPMF_Init(ms, buffer, size) != GPMF_OK || GPMF_Validate(ms, GPMF_RECURSE_LEVELS) != GPMF_OK) return;
+	GPMF_ResetState(ms);
+
+	do
+	{
+		uint32_t key = GPMF_Key(ms);
+		char *label = NULL;
+
+		if (opt->max_klv && ++klvs > opt->max_klv) break;
+
+		if (STR2FOURCC("GPS5") == key) r->gps5 = true;
+		else if (STR2FOURCC("GPS9") == key) r->gps9 = true;
+		else if (STR2FOURCC("MINF") == key) label = r->camera;
+		else if (STR2FOURCC("DVNM") == key && !r->camera[0]) label = r->camera;
+		else if (STR2FOURCC("CASN") == key && !r->serial[0]) label = r->serial;
+		else if (STR2FOURCC("FMWR") == key && !r->firmware[0]) label = r->firmware;
+
+		if (label && GPMF_TYPE_STRING_ASCII == GPMF_Type(ms))
+			copy_label(label, GPMF_RawData(ms), GPMF_StructSize(ms) * GPMF_Repeat(ms));
+	} while (GPMF_OK == GPMF_Next(ms, GPMF_RECURSE_LEVELS));
+
+	GPMF_Free(ms);
+}
+
+static void catalogue_job(const file_job *job, const decode_options *opt, camera_record *r)
+{
+	uint64_t limit = (opt->max_alloc && opt->max_alloc < MP4_TABLE_LIMIT) ? opt->max_alloc : MP4_TABLE_LIMIT;
+	gpmf_track *t = open_gpmf_track(job->path, limit);
+	uint64_t pos;
+	mp4_box box, child;
+	uint8_t *body;
+	uint32_t length;
+
+	if (!t) return;
+
+	r->duration = (double)t->duration / t->timescale;
+	r->payloads = t->count;
+
+	/* udta's "MINF" is the fuller model name, so it goes in ahead of the payload's "DVNM" */
+	pos = t->moov.start;
+	while (next_box(t, &pos, t->moov.end, &box))
+	{
+		if (MAKEID('m','v','h','d') == box.type && (body = read_box(t->fp, &box, 4096, &length)))
+		{
+			if (length >= 8 && 0 == body[0]) r->created = be32(body + 4);
+			else if (length >= 12 && 1 == body[0]) r->created = be64(body + 4);
+			free(body);
+			continue;
+		}
+		if (MAKEID('u','d','t','a') != box.type) continue;
+
+		uint64_t udta_pos = box.start;
+		while (next_box(t, &udta_pos, box.end, &child))
+		{
+			if (MAKEID('F','I','R','M') == child.type && (body = read_box(t->fp, &child, 4096, &length)))
+			{
+				copy_label(r->firmware, body, length);
+				free(body);
+			}
+			else if (MAKEID('G','P','M','F') == child.type && (body = read_box(t->fp, &child, limit, &length)))
+			{
+				catalogue_gpmf(r, (uint32_t *)body, length, opt);
+				free(body);
+			}
+		}
+	}
+
+	mp4_box payload = { 0, t->offsets[0], t->offsets[0], t->offsets[0] + t->sizes[0] };
+	if ((body = read_box(t->fp, &payload, limit, &length)))
+	{
+		catalogue_gpmf(r, (uint32_t *)body, length, opt);
+		free(body);
+	}
+
+	close_gpmf_track(t);
+	r->ok = true;
+}
+
+static void *catalogue_thread(void *arg)
+{
+	catalogue_worker *w = arg;
+
+	for (;;)
+	{
+		file_job *job = NULL;
+
+		pthread_mutex_lock(&pipeline.lock);
+		if (pipeline.next_job < pipeline.job_count)
+			job = &pipeline.jobs[pipeline.next_job++];
+		pthread_mutex_unlock(&pipeline.lock);
+
+		if (!job) break;
+
+		catalogue_job(job, w->opt, &w->records[job - pipeline.jobs]);
+	}
+
+	return NULL;
+}
+
+/* one row per file, in the order given */
+static int make_catalogue(const output_options *out, const decode_options *opt, uint32_t threads)
+{
+	camera_record *records = calloc(pipeline.job_count, sizeof(camera_record));
+	catalogue_worker *workers = calloc(threads ? threads : 1, sizeof(catalogue_worker));
+	uint32_t started = 0;
+	int result = 0;
+
+	if (!records || !workers)
+	{
+		fprintf(stderr, "ERROR: unable to allocate catalogue threads\n");
+		free(records);
+		free(workers);
+		return -1;
+	}
+
+	for (uint32_t t = 0; t < (threads ? threads : 1); t++)
+	{
+		workers[t].opt = opt;
+		workers[t].records = records;
+	}
+
+	if (threads > 1)
+		for (; started < threads; started++)
+			if (pthread_create(&workers[started].thread, NULL, catalogue_thread, &workers[started]) != 0) break;
+	if (!started) catalogue_thread(&workers[0]);
+	for (uint32_t t = 0; t < started; t++)
+		pthread_join(workers[t].thread, NULL);
+	free(workers);
+
+	printf("\"file\",\"camera\",\"serial\",\"firmware\",\"gps\",\"created\",\"duration [s]\",\"payloads\"\n");
+	for (uint32_t index = 0; index < pipeline.job_count; index++)
+	{
+		const camera_record *r = &records[index];
+		const file_job *job = &pipeline.jobs[index];
+		char created[32] = "";
+
+		if (!r->ok)
+		{
+			fprintf(stderr, "ERROR: %s is an invalid MP4/MOV or it has no GPMF data\n", job->path);
+			result = -1;
+			continue;
+		}
+
+		if (r->created > MP4_EPOCH_OFFSET)
+		{
+			time_t seconds = (time_t)(r->created - MP4_EPOCH_OFFSET);
+			strftime(created, sizeof(created), "%Y-%m-%dT%H:%M:%SZ", gmtime(&seconds));
+		}
+
+		printf("\"%s\", \"%s\", \"%s\", \"%s\", %s, %s, %f, %u\n", out->print_filepath ? job->path : job->display_name,
+			r->camera, r->serial, r->firmware, r->gps9 ? "GPS9" : r->gps5 ? "GPS5" : "none", created, r->duration, r->payloads);
+	}
+
+	free(records);
+	return result;
+}
+
+/*
+similar mode: each recording is summarised by a MinHash signature of the geohash cells its track passes through,
+and only recordings whose signatures agree on a whole band of hashes are compared (locality sensitive hashing)
+*/
+#define SIMILAR_HASHES 128
+#define SIMILAR_BANDS 32          /* of SIMILAR_HASHES / SIMILAR_BANDS hashes each, for a threshold near 0.4 */
+#define SIMILAR_GEOHASH_BITS 35   /* geohash precision 7, cells of about 150 m */
+#define SIMILAR_INDEX_HEADER "# gpstelemetry route signatures: geohash 7, 128 minhashes"
+
+typedef struct route_signature
+{
+	char *path;            /* owned, for signatures read from an index */
+	const char *name;
+	uint64_t last_cell;
+	uint32_t cells;        /* cells entered, not counting repeats of the last one */
+	uint32_t minhash[SIMILAR_HASHES];
+} route_signature;
+
+typedef struct band_entry
+{
+	uint64_t key;
+	uint32_t record;
+} band_entry;
+
+typedef struct similar_pair
+{
+	uint32_t a, b;
+} similar_pair;
+
+/* the geohash of the cell containing a position, as an integer of SIMILAR_GEOHASH_BITS bits */
+static uint64_t geohash_cell(double lat, double lon)
+{
+	const int lon_bits = (SIMILAR_GEOHASH_BITS + 1) / 2, lat_bits = SIMILAR_GEOHASH_BITS / 2;
+	uint64_t x = (uint64_t)fmin(fmax((lon + 180.0) / 360.0, 0.0) * (double)(1ull << lon_bits), (double)((1ull << lon_bits) - 1));
+	uint64_t y = (uint64_t)fmin(fmax((lat + 90.0) / 180.0, 0.0) * (double)(1ull << lat_bits), (double)((1ull << lat_bits) - 1));
+	uint64_t cell = 0;
+
+	/* longitude takes the first and every other bit */
+	for (int i = lon_bits - 1; i >= 0; i--)
+	{
+		cell = (cell << 1) | ((x >> i) & 1);
+		if (i < lat_bits) cell = (cell << 1) | ((y >> i) & 1);
+	}
+	return cell;
+}
+
+/* splitmix64's finaliser */
+static uint64_t mix64(uint64_t x)
+{
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	return x ^ (x >> 31);
+}
+
+static void signature_reset(route_signature *sig)
+{
+	sig->last_cell = UINT64_MAX;
+	sig->cells = 0;
+	for (int i = 0; i < SIMILAR_HASHES; i++) sig->minhash[i] = UINT32_MAX;
+}
+
+static void similar_sample(void *ctx, file_job *job, const gps_sample *s)
+{
+	route_signature *sig = (route_signature *)ctx + (job - pipeline.jobs);
+
+	if (s->fix < 2.0) return;
+
+	uint64_t cell = geohash_cell(s->lat, s->lon);
+	if (cell == sig->last_cell) return;
+	sig->last_cell = cell;
+	sig->cells++;
+
+	for (int i = 0; i < SIMILAR_HASHES; i++)
+	{
+		uint32_t h = (uint32_t)mix64(cell + 0x9e3779b97f4a7c15ull * (uint64_t)(i + 1));
+		if (h < sig->minhash[i]) sig->minhash[i] = h;
+	}
+}
+
+static const sample_sink similar_sink = { NULL, similar_sample, NULL, NULL };
+
+static double signature_similarity(const route_signature *a, const route_signature *b)
+{
+	int same = 0;
+	for (int i = 0; i < SIMILAR_HASHES; i++) same += a->minhash[i] == b->minhash[i];
+	return (double)same / SIMILAR_HASHES;
+}
+
+static int compare_band_entries(const void *a, const void *b)
+{
+	const band_entry *x = a, *y = b;
+	if (x->key != y->key) return (x->key > y->key) - (x->key < y->key);
+	return (x->record > y->record) - (x->record < y->record);
+}
+
+static int compare_pairs(const void *a, const void *b)
+{
+	const similar_pair *x = a, *y = b;
+	if (x->a != y->a) return (x->a > y->a) - (x->a < y->a);
+	return (x->b > y->b) - (x->b < y->b);
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/* read the signatures saved by earlier runs; a missing index is just empty */
+static bool signatures_load(const char *path, route_signature **records, uint32_t *count, uint32_t *size, bool *exists)
+{
+	FILE *fp = fopen(path, "r");
+	char *line = NULL;
+	size_t line_size = 0;
+	uint32_t number = 0;
+	bool ok = true;
+
+	*exists = fp != NULL;
+	if (!fp && ENOENT == errno) return true;
+	if (!fp)
+	{
+		fprintf(stderr, "ERROR: unable to open %s\n", path);
+		return false;
+	}
+
+	while (ok && getline(&line, &line_size, fp) >= 0)
+	{
+		number++;
+		if ('#' == line[0] || '\n' == line[0]) continue;
+
+		char *p = line, *end;
+		if (strlen(line) < SIMILAR_HASHES * 8 + 4)
+		{
+			fprintf(stderr, "ERROR: %s:%u: not a route signature\n", path, number);
+			ok = false;
+			break;
+		}
+		if (!ref_grow((void **)records, size, *count, sizeof(route_signature)))
+		{
+			fprintf(stderr, "ERROR: out of memory reading %s\n", path);
+			ok = false;
+			break;
+		}
+
+		route_signature *sig = &(*records)[*count];
+		signature_reset(sig);
+		for (int i = 0; ok && i < SIMILAR_HASHES; i++)
+		{
+			char hex[9];
+			memcpy(hex, p, 8);
+			hex[8] = '\0';
+			sig->minhash[i] = (uint32_t)strtoul(hex, &end, 16);
+			ok = (end == hex + 8);
+			p += ok ? 8 : 0;
+		}
+		if (ok) sig->cells = (uint32_t)strtoul(p, &end, 10);
+		ok = ok && ' ' == *p && ' ' == *end && end[1] && '\n' != end[1];
+		if (!ok)
+		{
+			fprintf(stderr, "ERROR: %s:%u: not a route signature\n", path, number);
+			break;
+		}
+
+		end[1 + strcspn(end + 1, "\r\n")] = '\0';
+		sig->path = strdup(end + 1);
+		if (!sig->path)
+		{
+			fprintf(stderr, "ERROR: out of memory reading %s\n", path);
+			ok = false;
+			break;
+		}
+		sig->name = strrchr(sig->path, '/') ? strrchr(sig->path, '/') + 1 : sig->path;
+		(*count)++;
+	}
+	free(line);
+	if (ok && ferror(fp))
+	{
+		fprintf(stderr, "ERROR: unable to read %s\n", path);
+		ok = false;
+	}
+	fclose(fp);
+	return ok;
+}
+
+static bool signatures_append(const char *path, const route_signature *records, uint32_t first, uint32_t count, bool header)
+{
+	FILE *fp = fopen(path, "a");
+	if (!fp)
+	{
+		fprintf(stderr, "ERROR: unable to write %s\n", path);
+		return false;
+	}
+
+	if (header) fprintf(fp, "%s\n", SIMILAR_INDEX_HEADER);
+	for (uint32_t r = first; r < first + count; r++)
+	{
+		if (!records[r].path) continue; /* failed to decode */
+		for (int i = 0; i < SIMILAR_HASHES; i++) fprintf(fp, "%08x", records[r].minhash[i]);
+		fprintf(fp, " %u %s\n", records[r].cells, records[r].path);
+	}
+
+	bool ok = !ferror(fp);
+	if (fclose(fp) != 0) ok = false;
+	if (!ok) fprintf(stderr, "ERROR: unable to write %s\n", path);
+	return ok;
+}
+
+static void print_similar(const output_options *out, const route_signature *a, const route_signature *b, double similarity)
+{
+	printf("\"%s\", \"%s\", %.3f\n", out->print_filepath ? a->path : a->name, out->print_filepath ? b->path : b->name, similarity);
+}
+
+/* signatures for the files (or from the index), then the pairs at least "threshold" similar */
+static int make_similar(const output_options *out, const decode_options *opt, uint32_t threads, const char *index_path, const char *query, double threshold)
+{
+	route_signature *records = NULL;
+	uint32_t count = 0, size = 0;
+	bool exists = false, compare = true;
+	int result = 0;
+
+	if (index_path && !signatures_load(index_path, &records, &count, &size, &exists))
+	{
+		for (uint32_t r = 0; r < count; r++) free(records[r].path);
+		free(records);
+		return -1;
+	}
+
+	/* files already in the index needn't be decoded again */
+	const char **paths = malloc((count + 1) * sizeof(char *));
+	if (!paths)
+	{
+		fprintf(stderr, "ERROR: unable to allocate route signatures\n");
+		compare = false;
+		result = -1;
+		pipeline.job_count = 0;
+	}
+	else
+	{
+		uint32_t kept = 0;
+		for (uint32_t r = 0; r < count; r++) paths[r] = records[r].path;
+		qsort(paths, count, sizeof(char *), compare_paths);
+		for (uint32_t index = 0; index < pipeline.job_count; index++)
+			if (!bsearch(&pipeline.jobs[index].path, paths, count, sizeof(char *), compare_paths))
+				pipeline.jobs[kept++] = pipeline.jobs[index];
+		pipeline.job_count = kept;
+		free(paths);
+	}
+
+	if (pipeline.job_count)
+	{
+		uint32_t indexed = count;
+		route_signature *grown = realloc(records, ((size_t)count + pipeline.job_count) * sizeof(route_signature));
+		void **contexts = calloc(threads, sizeof(void *));
+
+		if (!grown || !contexts)
+		{
+			fprintf(stderr, "ERROR: unable to allocate route signatures\n");
+			if (grown) records = grown;
+			free(contexts);
+			compare = false;
+			result = -1;
+		}
+		else
+		{
+			records = grown;
+			for (uint32_t index = 0; index < pipeline.job_count; index++)
+			{
+				signature_reset(&records[count + index]);
+				records[count + index].path = NULL;
+			}
+			for (uint32_t t = 0; t < threads; t++) contexts[t] = &records[count];
+			result = collect_files(opt, &similar_sink, contexts, threads);
+			free(contexts);
+
+			/* files that failed are left out */
+			for (uint32_t index = 0; index < pipeline.job_count; index++)
+			{
+				const file_job *job = &pipeline.jobs[index];
+				route_signature *sig = &records[count + index];
+				if (JOB_FINISHED != job->state || job->abort_reason || GPMF_OK != job->ret) continue;
+				sig->path = strdup(job->path);
+				if (sig->path) sig->name = strrchr(sig->path, '/') ? strrchr(sig->path, '/') + 1 : sig->path;
+			}
+			count += pipeline.job_count;
+
+			if (index_path && !signatures_append(index_path, records, indexed, count - indexed, !exists))
+				result = -1;
+		}
+	}
+
+	/* the query, if any */
+	uint32_t target = UINT32_MAX;
+	if (compare && query)
+	{
+		for (uint32_t r = 0; r < count && UINT32_MAX == target; r++)
+			if (records[r].path && (!strcmp(records[r].path, query) || !strcmp(records[r].name, query))) target = r;
+		if (UINT32_MAX == target)
+		{
+			fprintf(stderr, "ERROR: %s is not among the recordings\n", query);
+			compare = false;
+			result = -1;
+		}
+	}
+
+	/* recordings that agree on a whole band are candidates */
+	band_entry *bands = (compare && count) ? malloc((size_t)count * SIMILAR_BANDS * sizeof(band_entry)) : NULL;
+	similar_pair *pairs = NULL;
+	uint32_t band_count = 0, pair_count = 0, pair_size = 0;
+
+	if (compare && count && !bands)
+	{
+		fprintf(stderr, "ERROR: unable to allocate similarity bands\n");
+		result = -1;
+	}
+	for (uint32_t r = 0; bands && r < count; r++)
+	{
+		if (!records[r].path || !records[r].cells) continue;
+		for (uint32_t b = 0; b < SIMILAR_BANDS; b++)
+		{
+			uint64_t key = mix64(b + 1);
+			for (uint32_t i = b * (SIMILAR_HASHES / SIMILAR_BANDS); i < (b + 1) * (SIMILAR_HASHES / SIMILAR_BANDS); i++)
+				key = mix64(key ^ records[r].minhash[i]);
+			bands[band_count].key = key;
+			bands[band_count].record = r;
+			band_count++;
+		}
+	}
+	if (band_count) qsort(bands, band_count, sizeof(band_entry), compare_band_entries);
+
+	bool full = false;
+	for (uint32_t first = 0, last; first < band_count && !full; first = last)
+	{
+		for (last = first + 1; last < band_count && bands[last].key == bands[first].key; last++);
+		for (uint32_t i = first; i < last && !full; i++)
+		{
+			for (uint32_t j = i + 1; j < last && !full; j++)
+			{
+				uint32_t a = bands[i].record, b = bands[j].record;
+				if (UINT32_MAX != target && a != target && b != target) continue;
+				full = !ref_grow((void **)&pairs, &pair_size, pair_count, sizeof(similar_pair));
+				if (full) break;
+				pairs[pair_count].a = a;
+				pairs[pair_count].b = b;
+				pair_count++;
+			}
+		}
+	}
+	free(bands);
+	if (full)
+	{
+		fprintf(stderr, "ERROR: out of memory, some similar pairs are missing\n");
+		result = -1;
+	}
+
+	/* each candidate once, kept if its signatures really are close */
+	if (pair_count) qsort(pairs, pair_count, sizeof(similar_pair), compare_pairs);
+	if (compare) printf("\"file\",\"similar file\",\"similarity\"\n");
+	for (uint32_t i = 0; i < pair_count; i++)
+	{
+		if (i && pairs[i].a == pairs[i - 1].a && pairs[i].b == pairs[i - 1].b) continue;
+
+		const route_signature *a = &records[pairs[i].a], *b = &records[pairs[i].b];
+		double similarity = signature_similarity(a, b);
+		if (similarity < threshold) continue;
+		if (pairs[i].b == target) print_similar(out, b, a, similarity);
+		else print_similar(out, a, b, similarity);
+	}
+	free(pairs);
+
+	for (uint32_t r = 0; r < count; r++) free(records[r].path);
+	free(records);
+
+	return result;
+}
+
+/*
+--at_utc: the sample nearest a UTC time across chapters given in time order, found by binary search over
+each chapter's payload start times so that only a couple of payloads are decoded; --utc_index caches those times
+*/
+#define UTC_INDEX_HEADER "# gpstelemetry utc index v1: size mtime duration payloads utc... path"
+
+typedef struct utc_chapter
+{
+	char *path;            /* NULL if the chapter couldn't be indexed */
+	long long size, mtime; /* of the file when indexed, so a changed file is noticed */
+	double duration;       /* length on the stitched timeline */
+	double *utc;           /* time of each payload's first sample, NAN if it has none */
+	uint32_t count, utc_size;
+	bool fresh;            /* indexed by this run, so not in the cache yet */
+} utc_chapter;
+
+/* the sample nearest the target among those decoded */
+typedef struct utc_nearest
+{
+	double target;
+	double distance;       /* seconds from the target, INFINITY until a sample is seen */
+	const file_job *job;
+	gps_sample sample;
+} utc_nearest;
+
+static double sample_utc(const gps_sample *s)
+{
+	return (double)s->time + s->milliseconds / 1000.0;
+}
+
+/* make room for the times of the first "count" payloads */
+static bool utc_reach(utc_chapter *c, uint32_t count)
+{
+	while (c->count < count)
+	{
+		if (!ref_grow((void **)&c->utc, &c->utc_size, c->count, sizeof(double))) return false;
+		c->utc[c->count++] = NAN;
+	}
+	return true;
+}
+
+static void utc_nearest_sample(void *ctx, file_job *job, const gps_sample *s)
+{
+	utc_nearest *n = ctx;
+
+	if (s->accl || s->time <= 0 || fabs(sample_utc(s) - n->target) >= n->distance) return;
+	n->distance = fabs(sample_utc(s) - n->target);
+	n->job = job;
+	n->sample = *s;
+}
+
+static const sample_sink utc_nearest_sink = { NULL, utc_nearest_sample, NULL, NULL };
+
+static bool file_stamp(const char *path, long long *size, long long *mtime)
+{
+	struct stat st;
+
+	if (stat(path, &st) != 0) return false;
+	*size = (long long)st.st_size;
+	*mtime = (long long)st.st_mtime;
+	return true;
+}
+
+static void utc_chapters_free(utc_chapter *chapters, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++)
+	{
+		free(chapters[i].path);
+		free(chapters[i].utc);
+	}
+	free(chapters);
+}
+
+/* read the chapters indexed by earlier runs; a missing index is just empty, and later lines supersede earlier ones */
+static bool utc_index_load(const char *path, utc_chapter **chapters, uint32_t *count, bool *exists)
+{
+	FILE *fp = fopen(path, "r");
+	char *line = NULL;
+	size_t line_size = 0;
+	uint32_t number = 0, size = 0;
+	bool ok = true;
+
+	*exists = fp != NULL;
+	if (!fp && ENOENT == errno) return true;
+	if (!fp)
+	{
+		fprintf(stderr, "ERROR: unable to open %s\n", path);
+		return false;
+	}
+
+	while (ok && getline(&line, &line_size, fp) >= 0)
+	{
+		number++;
+		if ('#' == line[0] || '\n' == line[0]) continue;
+
+		utc_chapter c;
+		char *p = line, *end = line;
+		uint32_t payloads = 0;
+		memset(&c, 0, sizeof(c));
+
+		c.size = strtoll(p, &end, 10);
+		ok = end != p && ' ' == *end;
+		if (ok) c.mtime = strtoll(p = end, &end, 10);
+		ok = ok && end != p && ' ' == *end;
+		if (ok) c.duration = strtod(p = end, &end);
+		ok = ok && end != p && ' ' == *end;
+		if (ok) payloads = (uint32_t)strtoul(p = end, &end, 10);
+		ok = ok && end != p && ' ' == *end;
+		if (ok && !utc_reach(&c, payloads))
+		{
+			fprintf(stderr, "ERROR: out of memory reading %s\n", path);
+			free(c.utc);
+			ok = false;
+			break;
+		}
+		for (uint32_t i = 0; ok && i < payloads; i++)
+		{
+			c.utc[i] = strtod(p = end, &end);
+			ok = end != p && ' ' == *end;
+		}
+		ok = ok && end[1] && '\n' != end[1];
+		if (!ok)
+		{
+			fprintf(stderr, "ERROR: %s:%u: not a chapter index\n", path, number);
+			free(c.utc);
+			break;
+		}
+
+		end[1 + strcspn(end + 1, "\r\n")] = '\0';
+		c.path = strdup(end + 1);
+		if (!c.path || !ref_grow((void **)chapters, &size, *count, sizeof(utc_chapter)))
+		{
+			fprintf(stderr, "ERROR: out of memory reading %s\n", path);
+			free(c.path);
+			free(c.utc);
+			ok = false;
+			break;
+		}
+		(*chapters)[(*count)++] = c;
+	}
+	free(line);
+	if (ok && ferror(fp))
+	{
+		fprintf(stderr, "ERROR: unable to read %s\n", path);
+		ok = false;
+	}
+	fclose(fp);
+	return ok;
+}
+
+/* add the chapters indexed by this run */
+static bool utc_index_append(const char *path, const utc_chapter *chapters, uint32_t count, bool header)
+{
+	FILE *fp = fopen(path, "a");
+	if (!fp)
+	{
+		fprintf(stderr, "ERROR: unable to write %s\n", path);
+		return false;
+	}
+
+	if (header) fprintf(fp, "%s\n", UTC_INDEX_HEADER);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (!chapters[i].fresh) continue;
+		fprintf(fp, "%lld %lld %.6f %u", chapters[i].size, chapters[i].mtime, chapters[i].duration, chapters[i].count);
+		for (uint32_t p = 0; p < chapters[i].count; p++)
+		{
+			if (isnan(chapters[i].utc[p])) fprintf(fp, " nan");
+			else fprintf(fp, " %.3f", chapters[i].utc[p]);
+		}
+		fprintf(fp, " %s\n", chapters[i].path);
+	}
+
+	bool ok = !ferror(fp);
+	if (fclose(fp) != 0) ok = false;
+	if (!ok) fprintf(stderr, "ERROR: unable to write %s\n", path);
+	return ok;
+}
+
+/* time of a chapter's first payload with a sample */
+static double chapter_utc(const utc_chapter *c)
+{
+	for (uint32_t i = 0; i < c->count; i++)
+		if (!isnan(c->utc[i])) return c->utc[i];
+	return NAN;
+}
+
+/* how many of the chapters, or else the payload times, start at or before "target"; entries with no time are skipped */
+static uint32_t utc_search(const utc_chapter *chapters, const double *utc, uint32_t count, double target)
+{
+	uint32_t lo = 0, hi = count;
+
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2, probe;
+		double t = NAN;
+
+		for (probe = mid; probe < hi; probe++)
+			if (!isnan(t = chapters ? chapter_utc(&chapters[probe]) : utc[probe])) break;
+
+		if (probe == hi) hi = mid;
+		else if (t <= target) lo = probe + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/* "YYYY-MM-DDTHH:MM:SS[.fff][Z]" as seconds since the epoch */
+static bool parse_utc(const char *str, double *utc)
+{
+	struct tm tm;
+	double seconds;
+	int used = 0;
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(str, "%d-%d-%dT%d:%d:%lf%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &seconds, &used) != 6)
+		return false;
+	if ('Z' == str[used]) used++;
+	if (str[used] || tm.tm_mon < 1 || tm.tm_mon > 12 || tm.tm_mday < 1 || tm.tm_mday > 31 || tm.tm_hour > 23 || tm.tm_min > 59 || seconds < 0.0 || seconds >= 61.0)
+		return false;
+
+	tm.tm_year -= 1900;
+	tm.tm_mon--;
+	*utc = (double)timegm(&tm) + seconds;
+	return true;
+}
+
+/*
+a chapter's payload times from the KLV headers alone, as --verify walks them: the first GPS9 sample's own time
+where there is one, else the payload's GPSU; nothing is decoded, so a GPS5 payload's time is its raw GPSU and
+may be off its samples' fitted times by the GPSU's jitter, which is why find_utc() also decodes the payload before
+*/
+static const char *utc_index_job(file_job *job, const decode_options *opt, utc_chapter *c)
+{
+	GPMF_stream metadata_stream, *ms = &metadata_stream;
+	gpmf_source src;
+	const char *reason = NULL;
+	int64_t epoch_ms = (int64_t)opt->gps9_epoch * 1000;
+
+	memset(ms, 0, sizeof(*ms));
+	if (!source_open(&src, job->path, opt)) return "not an MP4/MOV with a GPMF track";
+
+	uint32_t payloads = source_payloads(&src);
+	for (uint32_t index = 0; index < payloads && !reason && !pipeline_aborted(); index++)
+	{
+		uint32_t payloadsize = source_payload_size(&src, index);
+		uint32_t *payload = NULL;
+		double start, finish;
+
+		/* a payload that would stop the decoder ends the index there too; what came before still counts */
+		if (opt->max_alloc && payloadsize > opt->max_alloc) reason = "payload exceeds --max_alloc";
+		else if (!(payload = source_payload(&src, index))) break;
+		else if (source_payload_time(&src, index, &start, &finish) != GPMF_OK || GPMF_Init(ms, payload, payloadsize) != GPMF_OK) reason = "GPMF structure is invalid";
+		else if (opt->safe && GPMF_Validate(ms, GPMF_RECURSE_LEVELS) != GPMF_OK) reason = "GPMF structure is invalid";
+		else if (!utc_reach(c, index + 1)) reason = "unable to allocate the UTC index";
+		if (reason) break;
+		GPMF_ResetState(ms);
+
+		/* GPS9 is preferred where both are present, as when decoding */
+		double gpsu = NAN, gps9 = NAN;
+		uint32_t klvs = 0;
+		do
+		{
+			uint32_t key = GPMF_Key(ms);
+
+			if (opt->max_klv && ++klvs > opt->max_klv)
+			{
+				reason = "payload has more KLVs than --max_klv";
+				break;
+			}
+
+			if (STR2FOURCC("GPS9") == key && isnan(gps9))
+			{
+				double first[16];
+				uint32_t elements = GPMF_ElementsInStruct(ms);
+				job->file_finish = finish;
+				if (elements < sizeof(gps9_layout) || elements > 16 || GPMF_ScaledData(ms, first, sizeof(first), 0, 1, GPMF_TYPE_DOUBLE) != GPMF_OK)
+					continue;
+
+				int64_t days = (int64_t)first[5], ms_of_day = llround(first[6] * 1000.0); /* as laid out in gps9_layout */
+				if (days > 0 && ms_of_day >= 0 && ms_of_day < 86400000)
+					gps9 = (double)(epoch_ms + (days + 1) * 86400000 + ms_of_day) / 1000.0;
+			}
+			else if (STR2FOURCC("GPSU") == key && GPMF_StructSize(ms) >= 16)
+			{
+				job->file_finish = finish;
+				if (isnan(gpsu)) gpsu = (double)gpsu_time(GPMF_RawData(ms)) / 1000.0;
+			}
+			else if (STR2FOURCC("GPS5") == key || STR2FOURCC("GPSF") == key || STR2FOURCC("GPSP") == key)
+			{
+				job->file_finish = finish;
+			}
+		} while (GPMF_OK == GPMF_Next(ms, GPMF_RECURSE_LEVELS));
+
+		c->utc[index] = !isnan(gps9) ? gps9 : (gpsu > 0.0 ? gpsu : NAN);
+		GPMF_ResetState(ms);
+	}
+
+	GPMF_Free(ms);
+	source_close(&src);
+	return reason;
+}
+
+typedef struct utc_index_worker
+{
+	pthread_t thread;
+	const decode_options *opt;
+	utc_chapter *chapters;
+	const char **reasons;
+} utc_index_worker;
+
+static void *utc_index_thread(void *arg)
+{
+	utc_index_worker *w = arg;
+
+	for (;;)
+	{
+		file_job *job = NULL;
+
+		pthread_mutex_lock(&pipeline.lock);
+		while (!pipeline.abort && pipeline.next_job < pipeline.job_count && w->chapters[pipeline.next_job].path)
+			pipeline.next_job++;
+		if (!pipeline.abort && pipeline.next_job < pipeline.job_count)
+			job = &pipeline.jobs[pipeline.next_job++];
+		pthread_mutex_unlock(&pipeline.lock);
+
+		if (!job) break;
+
+		job_update(job, JOB_RUNNING);
+		w->reasons[job - pipeline.jobs] = utc_index_job(job, w->opt, &w->chapters[job - pipeline.jobs]);
+		job_update(job, JOB_FINISHED);
+	}
+
+	return NULL;
+}
+
+/* index the chapters the cache didn't have, in parallel; returns how many were indexed */
+static uint32_t utc_index_build(const decode_options *opt, uint32_t threads, utc_chapter *chapters, int *result)
+{
+	uint32_t job_count = pipeline.job_count, indexed = 0;
+	const char **reasons = calloc(job_count, sizeof(const char *));
+	utc_index_worker *workers = calloc(threads, sizeof(utc_index_worker));
+	uint32_t started = 0;
+
+	if (!reasons || !workers)
+	{
+		fprintf(stderr, "ERROR: unable to allocate the UTC index\n");
+		free(reasons);
+		free(workers);
+		*result = -1;
+		return 0;
+	}
+
+	for (uint32_t t = 0; t < threads; t++)
+	{
+		workers[t].opt = opt;
+		workers[t].chapters = chapters;
+		workers[t].reasons = reasons;
+	}
+
+	if (threads > 1)
+		for (; started < threads; started++)
+			if (pthread_create(&workers[started].thread, NULL, utc_index_thread, &workers[started]) != 0) break;
+	if (!started) utc_index_thread(&workers[0]);
+	for (uint32_t t = 0; t < started; t++)
+		pthread_join(workers[t].thread, NULL);
+
+	/* files that failed are left out */
+	for (uint32_t index = 0; index < job_count; index++)
+	{
+		utc_chapter *c = &chapters[index];
+		const file_job *job = &pipeline.jobs[index];
+		if (c->path || JOB_FINISHED != job->state) continue;
+		if (reasons[index])
+		{
+			fprintf(stderr, "ERROR: %s: %s\n", job->path, reasons[index]);
+			*result = -1;
+			continue;
+		}
+		if (!file_stamp(job->path, &c->size, &c->mtime)) continue;
+		c->path = strdup(job->path);
+		c->duration = job->file_finish;
+		c->fresh = c->path != NULL;
+		indexed += c->fresh;
+	}
+
+	free(reasons);
+	free(workers);
+	return indexed;
+}
+
+/* print the sample nearest "target", decoding only the payloads either side of it */
+static int find_utc(output_options *out, const decode_options *opt, uint32_t threads, double target, const char *index_path)
+{
+	utc_chapter *cached = NULL, *chapters = calloc(pipeline.job_count, sizeof(utc_chapter));
+	uint32_t cached_count = 0;
+	bool exists = false;
+	int result = 0;
+
+	if (!chapters)
+	{
+		fprintf(stderr, "ERROR: unable to allocate the UTC index\n");
+		return -1;
+	}
+	if (index_path && !utc_index_load(index_path, &cached, &cached_count, &exists))
+	{
+		utc_chapters_free(cached, cached_count);
+		free(chapters);
+		return -1;
+	}
+
+	/* take over the latest cached entry of each file, if the file hasn't changed since */
+	for (uint32_t index = 0; index < pipeline.job_count; index++)
+	{
+		long long size, mtime;
+		if (!file_stamp(pipeline.jobs[index].path, &size, &mtime)) continue;
+		for (uint32_t i = cached_count; i-- > 0;)
+		{
+			if (!cached[i].path || strcmp(cached[i].path, pipeline.jobs[index].path)) continue;
+			if (cached[i].size == size && cached[i].mtime == mtime)
+			{
+				chapters[index] = cached[i];
+				memset(&cached[i], 0, sizeof(utc_chapter));
+			}
+			break;
+		}
+	}
+	utc_chapters_free(cached, cached_count);
+
+	if (utc_index_build(opt, threads ? threads : 1, chapters, &result) && index_path && !utc_index_append(index_path, chapters, pipeline.job_count, !exists))
+		result = -1;
+
+	/* the chapter holding the target, and the next in case the target falls in the gap before it */
+	uint32_t next = utc_search(chapters, NULL, pipeline.job_count, target);
+	uint32_t candidates[2] = { next - 1, next };
+	utc_nearest nearest;
+	uint32_t found = UINT32_MAX;
+
+	memset(&nearest, 0, sizeof(nearest));
+	nearest.target = target;
+	nearest.distance = INFINITY;
+
+	for (int k = 0; k < 2; k++)
+	{
+		uint32_t index = candidates[k];
+		if (index >= pipeline.job_count || !chapters[index].path || !chapters[index].count) continue;
+
+		/*
+		samples of the last payload starting at or before the target are all nearer than earlier ones, so the
+		nearest is in that payload or the next one with a sample; but the index has a GPS5 payload's raw GPSU while
+		its samples are timed by the fitted clock, so its first sample may come after a target the GPSU is before,
+		leaving the nearest at the end of the payload before, which is decoded too (a chapter's first GPSU is its
+		first sample's time, so the chapter before never needs the same)
+		*/
+		const utc_chapter *c = &chapters[index];
+		uint32_t payload = k ? 0 : utc_search(NULL, c->utc, c->count, target);
+		if (payload) payload--;
+		uint32_t first = payload;
+		while (first > 0 && isnan(c->utc[--first]));
+		uint32_t end = payload + 1;
+		while (end < c->count && isnan(c->utc[end])) end++;
+
+		decode_state state;
+		file_job *job = &pipeline.jobs[index];
+		const file_job *before = nearest.job;
+
+		job->first_payload = first;
+		job->end_payload = (end < c->count) ? end + 1 : c->count;
+		pipeline.head = index;
+		memset(&state, 0, sizeof(state));
+		decode_file(job, &state, opt, &utc_nearest_sink, &nearest);
+		decode_state_free(&state);
+
+		if (nearest.job != before) found = index;
+	}
+
+	if (UINT32_MAX == found)
+	{
+		fprintf(stderr, "ERROR: no sample near the requested time\n");
+		result = -1;
+	}
+	else
+	{
+		/* on the stitched timeline, as if every chapter had been decoded */
+		out->file_start = 0.0;
+		for (uint32_t index = 0; index < found; index++) out->file_start += chapters[index].duration;
+		print_header(out);
+		print_sample(out, nearest.job, &nearest.sample);
+	}
+
+	utc_chapters_free(chapters, pipeline.job_count);
+	return result;
+}
+
+/*
+random access: a file kept open with a table of its payload times and of the decoder state before each payload,
+so the telemetry at any time in it comes from reading and decoding just the one or two payloads around that time,
+however far into the file (scrubbing through a video, say)
+*/
+typedef struct telemetry_file
+{
+	file_job job;
+	gpmf_source src;
+	decode_options opt;
+	double *start, *finish; /* each payload's time span, from source_payload_time() */
+	gps5_clock *clock;      /* the GPS5 clock and carried state before each payload, walked once on opening */
+	carried_state *carry;
+	uint32_t count;
+} telemetry_file;
+
+/* the sample nearest the target among those decoded */
+typedef struct cts_nearest
+{
+	double target;
+	double distance;       /* seconds from the target, INFINITY until a sample is seen */
+	gps_sample sample;
+} cts_nearest;
+
+static void cts_nearest_sample(void *ctx, file_job *job, const gps_sample *s)
+{
+	cts_nearest *n = ctx;
+
+	if (s->accl || fabs(s->cts - n->target) >= n->distance) return;
+	n->distance = fabs(s->cts - n->target);
+	n->sample = *s;
+}
+
+static const sample_sink cts_nearest_sink = { NULL, cts_nearest_sample, NULL, NULL };
+
+static void telemetry_close(telemetry_file *f)
+{
+	if (!f) return;
+	source_close(&f->src);
+	free(f->start);
+	free(f->finish);
+	free(f->clock);
+	free(f->carry);
+	free(f);
+}
+
+static telemetry_file *telemetry_open(char *path, const decode_options *opt)
+{
+	telemetry_file *f = calloc(1, sizeof(telemetry_file));
+
+	if (!f) return NULL;
+	f->opt = *opt;
+	f->job.path = path;
+	f->job.display_name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+
+	if (!source_open(&f->src, path, opt) || source_duration(&f->src) <= 0.0)
+	{
+		telemetry_close(f);
+		return NULL;
+	}
+
+	f->count = source_payloads(&f->src);
+	f->start = malloc(f->count * sizeof(double) + 1);
+	f->finish = malloc(f->count * sizeof(double) + 1);
+	f->clock = malloc(f->count * sizeof(gps5_clock) + 1);
+	f->carry = malloc(f->count * sizeof(carried_state) + 1);
+	if (!f->start || !f->finish || !f->clock || !f->carry)
+	{
+		telemetry_close(f);
+		return NULL;
+	}
+	for (uint32_t index = 0; index < f->count; index++)
+	{
+		if (source_payload_time(&f->src, index, &f->start[index], &f->finish[index]) != GPMF_OK)
+		{
+			telemetry_close(f);
+			return NULL;
+		}
+	}
+
+	/* the state decoding from the start would reach at each payload, so no seek has to read the payloads before it */
+	GPMF_stream metadata_stream, *ms = &metadata_stream;
+	decode_state state;
+
+	memset(ms, 0, sizeof(*ms));
+	memset(&state, 0, sizeof(state));
+	for (uint32_t index = 0; index < f->count; index++)
+	{
+		f->clock[index] = state.gps5;
+		f->carry[index].use_gps9 = state.use_gps9;
+		f->carry[index].fix = state.fix;
+		f->carry[index].precision = state.precision;
+		state_walk(&state, &f->src, index, opt, ms);
+	}
+	GPMF_Free(ms);
+	return f;
+}
+
+/* the last payload starting at or before "seconds", or the first if none does */
+static uint32_t telemetry_payload(const telemetry_file *f, double seconds)
+{
+	uint32_t lo = 0, hi = f->count;
+
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (f->start[mid] <= seconds) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo ? lo - 1 : 0;
+}
+
+/* hand the samples of payloads first up to end to "sink"; false if they couldn't be decoded */
+static bool telemetry_decode(telemetry_file *f, uint32_t first, uint32_t end, const sample_sink *sink, void *ctx)
+{
+	decode_state state;
+
+	memset(&state, 0, sizeof(state));
+	state.gps5 = f->clock[first];
+	state.use_gps9 = f->carry[first].use_gps9;
+	state.fix = f->carry[first].fix;
+	state.precision = f->carry[first].precision;
+	f->job.first_payload = first;
+	f->job.end_payload = end;
+	f->job.abort_reason = NULL;
+	f->job.ret = GPMF_OK;
+	decode_payloads(&f->job, &f->src, &state, &f->opt, sink, ctx);
+	decode_state_free(&state);
+
+	return !f->job.abort_reason && GPMF_OK == f->job.ret;
+}
+
+/* the sample nearest "seconds" into the file */
+static bool telemetry_at(telemetry_file *f, double seconds, gps_sample *sample)
+{
+	cts_nearest nearest;
+
+	if (!f->count) return false;
+
+	memset(&nearest, 0, sizeof(nearest));
+	nearest.target = seconds;
+	nearest.distance = INFINITY;
+
+	/* the payload covering the time, then whichever neighbour lies on the side its samples don't reach */
+	uint32_t payload = telemetry_payload(f, seconds);
+	if (!telemetry_decode(f, payload, payload + 1, &cts_nearest_sink, &nearest)) return false;
+
+	if (isinf(nearest.distance) || nearest.sample.cts < seconds)
+	{
+		if (payload + 1 < f->count && !telemetry_decode(f, payload + 1, payload + 2, &cts_nearest_sink, &nearest)) return false;
+	}
+	if (isinf(nearest.distance) || nearest.sample.cts > seconds)
+	{
+		if (payload > 0 && !telemetry_decode(f, payload - 1, payload, &cts_nearest_sink, &nearest)) return false;
+	}
+
+	if (isinf(nearest.distance)) return false;
+	*sample = nearest.sample;
+	return true;
+}
+
+/* --at: print the sample nearest each of a comma separated list of times, all looked up in the one open file */
+static int find_at(output_options *out, const decode_options *opt, const char *times)
+{
+	telemetry_file *f = telemetry_open(pipeline.jobs[0].path, opt);
+	int result = 0;
+
+	if (!f)
+	{
+		fprintf(stderr, "ERROR: %s is an invalid MP4/MOV or it has no GPMF data\n", pipeline.jobs[0].path);
+		return -1;
+	}
+
+	print_header(out);
+	while (*times)
+	{
+		char *end;
+		gps_sample sample;
+		double seconds = strtod(times, &end);
+
+		if (end == times || (*end && ',' != *end))
+		{
+			fprintf(stderr, "ERROR: --at must be seconds into the file, or a comma separated list of them\n");
+			result = -1;
+			break;
+		}
+		times = *end ? end + 1 : end;
+
+		if (telemetry_at(f, seconds, &sample))
+		{
+			print_sample(out, &f->job, &sample);
+		}
+		else
+		{
+			fprintf(stderr, "ERROR: no sample near %g seconds in %s\n", seconds, f->job.path);
+			result = -1;
+		}
+	}
+
+	telemetry_close(f);
+	return result;
+}
+
+/*
+zone maps: the least and greatest of each --where column, and the sample count, of every payload of a file, kept
+in an append-only catalog keyed like the UTC index; a --where query decodes just the payloads whose zones may match
+*/
+#define ZONE_HEADER "# gpstelemetry zone maps v1: file size mtime duration payloads path, then zone payload count min max... for lat lon alt speed2d speed3d fix precision"
+
+typedef struct zone
+{
+	uint32_t payload, count;
+	double min[ZONE_COLUMNS], max[ZONE_COLUMNS];
+} zone;
+
+typedef struct zone_file
+{
+	char *path;            /* NULL if the file couldn't be indexed */
+	long long size, mtime; /* of the file when indexed, so a changed file is noticed */
+	double duration;       /* length on the stitched timeline */
+	uint32_t payloads;
+	zone *zones;           /* of the payloads with samples, in order */
+	uint32_t count, zone_size;
+	zone all;              /* the whole file */
+	bool failed;           /* ran out of memory while indexing */
+	bool fresh;            /* indexed by this run, so not in the catalog yet */
+} zone_file;
+
+static void zone_init(zone *z, uint32_t payload)
+{
+	z->payload = payload;
+	z->count = 0;
+	for (uint32_t c = 0; c < ZONE_COLUMNS; c++)
+	{
+		z->min[c] = INFINITY;
+		z->max[c] = -INFINITY;
+	}
+}
+
+static void zone_merge(zone *z, const zone *other)
+{
+	z->count += other->count;
+	for (uint32_t c = 0; c < ZONE_COLUMNS; c++)
+	{
+		if (other->min[c] < z->min[c]) z->min[c] = other->min[c];
+		if (other->max[c] > z->max[c]) z->max[c] = other->max[c];
+	}
+}
+
+/* whether any sample within the zone could satisfy every term */
+static bool where_zone(const where_filter *w, const zone *z)
+{
+	if (!z->count) return false;
+
+	for (uint32_t i = 0; i < w->count; i++)
+	{
+		const where_term *t = &w->terms[i];
+		double min = z->min[t->column], max = z->max[t->column];
+		bool may = false;
+
+		switch (t->op)
+		{
+		case WHERE_LT: may = min < t->value; break;
+		case WHERE_LE: may = min <= t->value; break;
+		case WHERE_EQ: may = min <= t->value && t->value <= max; break;
+		case WHERE_GE: may = max >= t->value; break;
+		case WHERE_GT: may = max > t->value; break;
+		}
+		if (!may) return false;
+	}
+	return true;
+}
+
+/* the sink context is the zone_file of each job being indexed */
+static void zone_index_sample(void *ctx, file_job *job, const gps_sample *s)
+{
+	zone_file *f = ((zone_file **)ctx)[job - pipeline.jobs];
+	uint32_t payload = job->payloads - 1;
+	double v[ZONE_COLUMNS];
+
+	if (s->accl || f->failed) return;
+	if (!f->count || f->zones[f->count - 1].payload != payload)
+	{
+		if (!ref_grow((void **)&f->zones, &f->zone_size, f->count, sizeof(zone)))
+		{
+			f->failed = true;
+			return;
+		}
+		zone_init(&f->zones[f->count++], payload);
+	}
+
+	zone *z = &f->zones[f->count - 1];
+	sample_columns(s, v);
+	z->count++;
+	for (uint32_t c = 0; c < ZONE_COLUMNS; c++)
+	{
+		if (v[c] < z->min[c]) z->min[c] = v[c];
+		if (v[c] > z->max[c]) z->max[c] = v[c];
+	}
+}
+
+static const sample_sink zone_index_sink = { NULL, zone_index_sample, NULL, NULL };
+
+static void zone_files_free(zone_file *files, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++)
+	{
+		free(files[i].path);
+		free(files[i].zones);
+	}
+	free(files);
+}
+
+/* read the files indexed by earlier runs; a missing catalog is just empty, and later entries supersede earlier ones */
+static bool zone_catalog_load(const char *path, zone_file **files, uint32_t *count, bool *exists)
+{
+	FILE *fp = fopen(path, "r");
+	char *line = NULL;
+	size_t line_size = 0;
+	uint32_t number = 0, size = 0;
+	zone_file *f = NULL;
+	bool ok = true;
+
+	*exists = fp != NULL;
+	if (!fp && ENOENT == errno) return true;
+	if (!fp)
+	{
+		fprintf(stderr, "ERROR: unable to open %s\n", path);
+		return false;
+	}
+
+	while (ok && getline(&line, &line_size, fp) >= 0)
+	{
+		char *p = line, *end = line;
+
+		number++;
+		if ('#' == line[0] || '\n' == line[0]) continue;
+
+		if (!strncmp(line, "file ", 5))
+		{
+			zone_file file;
+			memset(&file, 0, sizeof(file));
+			zone_init(&file.all, 0);
+
+			file.size = strtoll(p = line + 5, &end, 10);
+			ok = end != p && ' ' == *end;
+			if (ok) file.mtime = strtoll(p = end, &end, 10);
+			ok = ok && end != p && ' ' == *end;
+			if (ok) file.duration = strtod(p = end, &end);
+			ok = ok && end != p && ' ' == *end;
+			if (ok) file.payloads = (uint32_t)strtoul(p = end, &end, 10);
+			ok = ok && end != p && ' ' == *end && end[1] && '\n' != end[1];
+			if (!ok) break;
+
+			end[1 + strcspn(end + 1, "\r\n")] = '\0';
+			file.path = strdup(end + 1);
+			if (!file.path || !ref_grow((void **)files, &size, *count, sizeof(zone_file)))
+			{
+				fprintf(stderr, "ERROR: out of memory reading %s\n", path);
+				free(file.path);
+				ok = false;
+				number = 0;
+				break;
+			}
+			f = &(*files)[(*count)++];
+			*f = file;
+			continue;
+		}
+
+		/* "zone" lines belong to the file line before them */
+		zone z;
+		ok = f && !strncmp(line, "zone ", 5);
+		if (ok) z.payload = (uint32_t)strtoul(p = line + 5, &end, 10);
+		ok = ok && end != p && ' ' == *end && z.payload < f->payloads;
+		if (ok) z.count = (uint32_t)strtoul(p = end, &end, 10);
+		ok = ok && end != p;
+		for (uint32_t c = 0; ok && c < ZONE_COLUMNS; c++)
+		{
+			z.min[c] = strtod(p = end, &end);
+			ok = end != p;
+			if (ok) z.max[c] = strtod(p = end, &end);
+			ok = ok && end != p;
+		}
+		ok = ok && (f->count ? f->zones[f->count - 1].payload < z.payload : true);
+		if (!ok) break;
+
+		if (!ref_grow((void **)&f->zones, &f->zone_size, f->count, sizeof(zone)))
+		{
+			fprintf(stderr, "ERROR: out of memory reading %s\n", path);
+			number = 0;
+			break;
+		}
+		f->zones[f->count++] = z;
+		zone_merge(&f->all, &z);
+	}
+	if (!ok && number) fprintf(stderr, "ERROR: %s:%u: not a zone map catalog\n", path, number);
+	free(line);
+	if (ok && ferror(fp))
+	{
+		fprintf(stderr, "ERROR: unable to read %s\n", path);
+		ok = false;
+	}
+	fclose(fp);
+	return ok;
+}
+
+/* shortest of %.9g and %.17g that doesn't round a zone bound inwards, so the zone still holds every sample */
+static void zone_bound(FILE *fp, double v, bool is_min)
+{
+	char text[32];
+	double back;
+
+	snprintf(text, sizeof(text), "%.9g", v);
+	back = strtod(text, NULL);
+	if (is_min ? back > v : back < v) snprintf(text, sizeof(text), "%.17g", v);
+	fprintf(fp, " %s", text);
+}
+
+/* add the files indexed by this run */
+static bool zone_catalog_append(const char *path, const zone_file *files, uint32_t count, bool header)
+{
+	FILE *fp = fopen(path, "a");
+	if (!fp)
+	{
+		fprintf(stderr, "ERROR: unable to write %s\n", path);
+		return false;
+	}
+
+	if (header) fprintf(fp, "%s\n", ZONE_HEADER);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const zone_file *f = &files[i];
+		if (!f->fresh) continue;
+
+		fprintf(fp, "file %lld %lld %.6f %u %s\n", f->size, f->mtime, f->duration, f->payloads, f->path);
+		for (uint32_t z = 0; z < f->count; z++)
+		{
+			fprintf(fp, "zone %u %u", f->zones[z].payload, f->zones[z].count);
+			for (uint32_t c = 0; c < ZONE_COLUMNS; c++)
+			{
+				zone_bound(fp, f->zones[z].min[c], true);
+				zone_bound(fp, f->zones[z].max[c], false);
+			}
+			fprintf(fp, "\n");
+		}
+	}
+
+	bool ok = !ferror(fp);
+	if (fclose(fp) != 0) ok = false;
+	if (!ok) fprintf(stderr, "ERROR: unable to write %s\n", path);
+	return ok;
+}
+
+/*
+the zone maps of every input file, from the catalog where the file hasn't changed since, otherwise by decoding it
+(in parallel) and adding it to the catalog; files that couldn't be indexed are reported and have no path
+*/
+static zone_file *zone_catalog_update(const char *catalog, const decode_options *opt, uint32_t threads, int *result)
+{
+	uint32_t job_count = pipeline.job_count, cached_count = 0, indexed = 0;
+	zone_file *cached = NULL, *files = calloc(job_count, sizeof(zone_file));
+	file_job *done = calloc(job_count, sizeof(file_job));
+	void **slots = calloc(job_count, sizeof(void *));
+	bool exists = false;
+
+	if (!files || !done || !slots)
+	{
+		fprintf(stderr, "ERROR: unable to allocate the zone maps\n");
+		free(files);
+		free(done);
+		free(slots);
+		*result = -1;
+		return NULL;
+	}
+	if (!zone_catalog_load(catalog, &cached, &cached_count, &exists))
+	{
+		zone_files_free(cached, cached_count);
+		zone_files_free(files, job_count);
+		free(done);
+		free(slots);
+		*result = -1;
+		return NULL;
+	}
+
+	/* take over the latest catalogued entry of each file, if the file hasn't changed since */
+	for (uint32_t index = 0; index < job_count; index++)
+	{
+		long long size, mtime;
+		if (!file_stamp(pipeline.jobs[index].path, &size, &mtime)) continue;
+		for (uint32_t i = cached_count; i-- > 0;)
+		{
+			if (!cached[i].path || strcmp(cached[i].path, pipeline.jobs[index].path)) continue;
+			if (cached[i].size == size && cached[i].mtime == mtime)
+			{
+				files[index] = cached[i];
+				memset(&cached[i], 0, sizeof(zone_file));
+			}
+			break;
+		}
+	}
+	zone_files_free(cached, cached_count);
+
+	/* the zones cover every sample, whatever --min_fix and --max_precision this run was given */
+	decode_options all = *opt;
+	all.min_fix = all.max_precision = -1;
+
+	for (uint32_t index = 0; index < job_count; index++)
+	{
+		if (files[index].path) continue;
+		zone_init(&files[index].all, 0);
+		slots[index] = &files[index];
+	}
+	if (collect_some(&all, threads ? threads : 1, &zone_index_sink, slots, done)) *result = -1;
+
+	/* files that failed are left out */
+	for (uint32_t index = 0; index < job_count; index++)
+	{
+		zone_file *f = slots[index];
+		const file_job *job = &done[index];
+		if (!f) continue;
+		if (f->failed) fprintf(stderr, "ERROR: out of memory indexing %s\n", job->path);
+		if (f->failed || JOB_FINISHED != job->state || job->abort_reason || GPMF_OK != job->ret || !file_stamp(job->path, &f->size, &f->mtime))
+		{
+			if (f->failed) *result = -1;
+			continue;
+		}
+		f->path = strdup(job->path);
+		f->duration = job->file_finish;
+		f->payloads = job->payloads;
+		for (uint32_t z = 0; z < f->count; z++) zone_merge(&f->all, &f->zones[z]);
+		f->fresh = f->path != NULL;
+		indexed += f->fresh;
+	}
+
+	if (indexed && !zone_catalog_append(catalog, files, job_count, !exists)) *result = -1;
+
+	free(done);
+	free(slots);
+	return files;
+}
+
+/* zonemap mode: just bring the catalog up to date */
+static int make_zonemap(const char *catalog, const decode_options *opt, uint32_t threads)
+{
+	int result = 0;
+	zone_file *files = zone_catalog_update(catalog, opt, threads, &result);
+
+	zone_files_free(files, files ? pipeline.job_count : 0);
+	return result;
+}
+
+/* jobs for the runs of consecutive payloads whose zones may match, written to "jobs" if given; returns how many */
+static uint32_t zone_runs(const where_filter *w, const zone_file *f, const file_job *job, double start, file_job *jobs)
+{
+	uint32_t runs = 0, end = 0;
+
+	if (!f->path || !where_zone(w, &f->all)) return 0;
+
+	for (uint32_t z = 0; z < f->count; z++)
+	{
+		if (!where_zone(w, &f->zones[z])) continue;
+		if (runs && f->zones[z].payload == end)
+		{
+			end++;
+			if (jobs) jobs[runs - 1].end_payload = end;
+			continue;
+		}
+
+		end = f->zones[z].payload + 1;
+		if (jobs)
+		{
+			jobs[runs] = *job;
+			jobs[runs].first_payload = f->zones[z].payload;
+			jobs[runs].end_payload = end;
+			jobs[runs].continues = true;
+			jobs[runs].placed = true;
+			jobs[runs].placed_at = start;
+		}
+		runs++;
+	}
+
+	if (jobs && runs) jobs[runs - 1].continues = false;
+	return runs;
+}
+
+/*
+--where with --zonemap: replace the jobs with those runs, dropping files with none, each placed on the stitched
+timeline as though every file had been decoded; files that couldn't be indexed are left out, having been reported
+*/
+static bool zone_prune(const where_filter *w, const char *catalog, const decode_options *opt, uint32_t threads, int *result)
+{
+	zone_file *files = zone_catalog_update(catalog, opt, threads, result);
+	file_job *jobs = NULL;
+	uint64_t count = 0;
+	double start = 0.0;
+
+	if (!files) return false;
+
+	for (uint32_t index = 0; index < pipeline.job_count; index++)
+		count += zone_runs(w, &files[index], &pipeline.jobs[index], 0.0, NULL);
+	if (count > UINT32_MAX || (count && !(jobs = calloc((size_t)count, sizeof(file_job)))))
+	{
+		fprintf(stderr, "ERROR: unable to allocate decoder jobs\n");
+		zone_files_free(files, pipeline.job_count);
+		return false;
+	}
+
+	count = 0;
+	for (uint32_t index = 0; jobs && index < pipeline.job_count; index++)
+	{
+		count += zone_runs(w, &files[index], &pipeline.jobs[index], start, jobs + count);
+		start += files[index].duration;
+	}
+
+	zone_files_free(files, pipeline.job_count);
+	free(pipeline.jobs);
+	pipeline.jobs = jobs;
+	pipeline.job_count = (uint32_t)count;
+	return true;
+}
+
+static void print_usage(const char *name)
+{
+	fprintf(stderr, "%s [options] <mp4file> [mp4file_2] ... [mp4file_n]\n", name);
+	fprintf(stderr, "%s tiles [options] <output.pmtiles> <mp4file> [mp4file_2] ... [mp4file_n]\n", name);
+	fprintf(stderr, "%s heatmap [options] <output.png|output.f32> <mp4file> [mp4file_2] ... [mp4file_n]\n", name);
+	fprintf(stderr, "%s similar [options] <mp4file> [mp4file_2] ... [mp4file_n]\n", name);
+	fprintf(stderr, "%s sidecar [options] <output directory> <mp4file> [mp4file_2] ... [mp4file_n]\n", name);
+	fprintf(stderr, "%s verify [options] <mp4file> [mp4file_2] ... [mp4file_n]\n", name);
+	fprintf(stderr, "%s catalogue [options] <mp4file> [mp4file_2] ... [mp4file_n]\n", name);
+	fprintf(stderr, "%s zonemap [options] <catalog> <mp4file> [mp4file_2] ... [mp4file_n]\n", name);
+	fprintf(stderr, "  --print_filename   print the filename in output\n");
+	fprintf(stderr, "  --print_filepath   print the full file path in output\n");
+	fprintf(stderr, "  --min_fix=N        only output entries with fix >= N\n");
+	fprintf(stderr, "  --max_precision=N  only output entries with precision <= N\n");
+	fprintf(stderr, "  --jobs=N           decode on N threads, big files in parts (default or 0: the CPUs available, within any cgroup quota)\n");
+	fprintf(stderr, "  --mem_limit=SIZE   cap bytes held in payload, decode and output buffers (K, M or G suffix)\n");
+	fprintf(stderr, "  --stats            print throughput and peak memory to stderr\n");
+	fprintf(stderr, "  --segments         print one row per moving segment, stop or GPS outage instead of every sample\n");
+	fprintf(stderr, "  --stop_speed=M/S   --segments: speed below which the camera is stopped (default 1.0)\n");
+	fprintf(stderr, "  --stop_dwell=SECS  --segments: time below stop_speed before a stop begins (default 60)\n");
+	fprintf(stderr, "  --events           print harsh braking, acceleration, cornering and speeding events instead of every sample\n");
+	fprintf(stderr, "  --brake_threshold=M/S2   --events: deceleration of harsh braking (default 3.5, 0 disables)\n");
+	fprintf(stderr, "  --accel_threshold=M/S2   --events: acceleration of harsh acceleration (default 3.0, 0 disables)\n");
+	fprintf(stderr, "  --corner_threshold=M/S2  --events: lateral acceleration of harsh cornering (default 3.5, 0 disables)\n");
+	fprintf(stderr, "  --speed_limit=M/S        --events: speed above which the camera is speeding (default 0, off)\n");
+	fprintf(stderr, "  --accl_threshold=M/S2    --events: ACCL level of harsh motion (default 0, off)\n");
+	fprintf(stderr, "  --event_context=SECS     --events: context reported either side of an event (default 5)\n");
+	fprintf(stderr, "  --segments_ref=FILE      print laps and segments timed against the gates and routes in FILE\n");
+	fprintf(stderr, "  --match=FILE             snap samples to the road network in FILE\n");
+	fprintf(stderr, "  --every_distance=M       print a sample every M metres along the track, with interpolated position and altitude\n");
+	fprintf(stderr, "  --at_utc=TIME            print the sample nearest TIME (YYYY-MM-DDTHH:MM:SS[.fff]Z) across files given in time order\n");
+	fprintf(stderr, "  --utc_index=FILE         --at_utc: cache of each file's payload times, read and extended so files aren't indexed again\n");
+	fprintf(stderr, "  --at=SECONDS[,...]       print the sample nearest each time into a single file, decoding only the payloads around it\n");
+	fprintf(stderr, "  --where=TERMS            print only samples where all TERMS hold, e.g. speed2d>35,fix>=3 (columns lat lon alt speed2d speed3d fix precision)\n");
+	fprintf(stderr, "  --zonemap=FILE           --where: catalog of per-payload zone maps, read and extended, so only payloads that may match are decoded\n");
+	fprintf(stderr, "  --replay[=SPEED]         send samples in real time, or SPEED times as fast, instead of printing CSV\n");
+	fprintf(stderr, "  --replay_format=FORMAT   --replay: nmea (GGA and RMC sentences, the default) or binary (%d byte records)\n", REPLAY_RECORD);
+	fprintf(stderr, "  --replay_to=DEST         --replay: stdout (the default), a file, pty or serial device, or udp:HOST:PORT\n");
+	fprintf(stderr, "  --full_moov        index files with gpmf-parser's MP4 reader (all tracks)\n");
+	fprintf(stderr, "  --safe             harden parsing of untrusted files (validation plus the limits below)\n");
+	fprintf(stderr, "  --max_alloc=SIZE   largest buffer a file may need (--safe default 64M)\n");
+	fprintf(stderr, "  --max_klv=N        most KLVs walked per payload (--safe default 10000)\n");
+	fprintf(stderr, "  --cpu_limit=SECS   CPU seconds a file may use (--safe default 30)\n");
+	fprintf(stderr, "  --min_zoom=N       shallowest zoom level of tiles (default 0)\n");
+	fprintf(stderr, "  --max_zoom=N       deepest zoom level of tiles (default 14, at most %d)\n", TILE_MAX_ZOOM);
+	fprintf(stderr, "  --zoom=N           heatmap resolution, 256 << N pixels around the world (default 14, at most %d)\n", HEAT_MAX_ZOOM);
+	fprintf(stderr, "  --signatures=FILE  similar: route signature index, read and extended so indexed files aren't decoded again\n");
+	fprintf(stderr, "  --query=FILE       similar: only list recordings similar to this one\n");
+	fprintf(stderr, "  --similarity=J     similar: least estimated Jaccard similarity of the cells visited (default 0.5)\n");
+}
+
 int main(int argc, char* argv[])
 {
-	GPMF_ERR ret = GPMF_OK;
-	GPMF_stream metadata_stream, *ms = &metadata_stream;
-	double file_start = 0.0;
-	time_t gps9_epoch;
+	decode_options opt = { -1, -1, 0, false, false, 0, 0, 0.0, false, false };
+	output_options out = { false, false, false, 0.0, false, 1.0, 60.0, { 0 }, NULL, NULL, NULL, 0.0, { 0 }, 0.0, NULL, NULL };
+	event_state events;
+	bool print_events = false;
+	const char *refs_path = NULL, *roads_path = NULL;
+	const char *at_utc = NULL, *utc_index = NULL, *at = NULL;
+	const char *where = NULL, *zonemap = NULL;
+	where_filter filter;
+	replayer replay;
+	bool replaying = false, resampling = false;
+	const char *replay_format = "nmea", *replay_to = NULL;
+	double target_utc = 0.0;
 	struct tm tm;
-	bool use_gps9 = false;
-	int min_fix = -1; /* -1 means no filtering */
-	int max_precision = -1; /* -1 means no filtering */
-	bool print_filename = false;
-	bool print_filepath = false;
+	uint32_t threads = 0;
+	const char *jobs = NULL;
+	const char *output_path = NULL;
+	int min_zoom = 0, max_zoom = 14, zoom = 14;
+	const char *index_path = NULL, *query = NULL;
+	double similarity = 0.5;
+	bool print_stats = false;
+	int result = 0;
 
 	if (argc < 2)
 	{
-		fprintf(stderr, "%s [options] <mp4file> [mp4file_2] ... [mp4file_n]\n", argv[0]);
-		fprintf(stderr, "  --print_filename   print the filename in output\n");
-		fprintf(stderr, "  --print_filepath   print the full file path in output\n");
-		fprintf(stderr, "  --min_fix=N        only output entries with fix >= N\n");
-		fprintf(stderr, "  --max_precision=N  only output entries with precision <= N\n");
+		print_usage(argv[0]);
 		return -1;
 	}
 
+	memset(&events, 0, sizeof(events));
+	events.threshold[EVENT_BRAKING] = 3.5;
+	events.threshold[EVENT_ACCELERATION] = 3.0;
+	events.threshold[EVENT_CORNERING] = 3.5;
+	events.context = 5.0;
+
+	memset(&replay, 0, sizeof(replay));
+	replay.speed = 1.0;
+	replay.fd = -1;
+
 	memset(&tm, 0, sizeof(tm));
 	tm.tm_year = 100;
-	gps9_epoch = timegm(&tm);
+	opt.gps9_epoch = timegm(&tm);
+
+	if (!build_handler_table())
+	{
+		fprintf(stderr, "ERROR: unable to build the FOURCC handler table\n");
+		return -1;
+	}
 
-	/* check for filter parameters */
+	/* check for a subcommand, then filter parameters */
 	int first_file_index = 1;
+	enum { MODE_CSV, MODE_TILES, MODE_HEATMAP, MODE_SIMILAR, MODE_SIDECAR, MODE_VERIFY, MODE_ZONEMAP, MODE_CATALOGUE } mode = MODE_CSV;
+	if (!strcmp(argv[1], "tiles")) mode = MODE_TILES;
+	else if (!strcmp(argv[1], "heatmap")) mode = MODE_HEATMAP;
+	else if (!strcmp(argv[1], "similar")) mode = MODE_SIMILAR;
+	else if (!strcmp(argv[1], "sidecar")) mode = MODE_SIDECAR;
+	else if (!strcmp(argv[1], "verify")) mode = MODE_VERIFY;
+	else if (!strcmp(argv[1], "zonemap")) mode = MODE_ZONEMAP;
+	else if (!strcmp(argv[1], "catalogue")) mode = MODE_CATALOGUE;
+	if (mode != MODE_CSV) first_file_index++;
+
 	while (first_file_index < argc)
 	{
-		if (strcmp(argv[first_file_index], "--print_filename") == 0)
-		{
-			print_filename = true;
-			first_file_index++;
-		}
-		else if (strcmp(argv[first_file_index], "--print_filepath") == 0)
-		{
-			print_filepath = true;
-			first_file_index++;
-		}
-		else if (strncmp(argv[first_file_index], "--min_fix=", 10) == 0)
+		const char *arg = argv[first_file_index];
+		const char *value;
+
+		if (match_option(arg, "--print_filename"))
+			out.print_filename = true;
+		else if (match_option(arg, "--print_filepath"))
+			out.print_filepath = true;
+		else if ((value = match_option(arg, "--min_fix=")))
+			opt.min_fix = atoi(value);
+		else if ((value = match_option(arg, "--max_precision=")))
+			opt.max_precision = atoi(value);
+		else if ((value = match_option(arg, "--jobs=")))
+			jobs = value;
+		else if ((value = match_option(arg, "--mem_limit=")))
+			pipeline.mem_limit = parse_size(value);
+		else if (match_option(arg, "--segments"))
+			out.segments = true;
+		else if ((value = match_option(arg, "--stop_speed=")))
+			out.stop_speed = atof(value);
+		else if ((value = match_option(arg, "--stop_dwell=")))
+			out.stop_dwell = atof(value);
+		else if ((value = match_option(arg, "--segments_ref=")))
+			refs_path = value;
+		else if ((value = match_option(arg, "--match=")))
+			roads_path = value;
+		else if ((value = match_option(arg, "--every_distance=")))
 		{
-			min_fix = atoi(argv[first_file_index] + 10);
-			first_file_index++;
+			resampling = true;
+			out.every_distance = atof(value);
 		}
-		else if (strncmp(argv[first_file_index], "--max_precision=", 16) == 0)
+		else if ((value = match_option(arg, "--at_utc=")))
+			at_utc = value;
+		else if ((value = match_option(arg, "--utc_index=")))
+			utc_index = value;
+		else if ((value = match_option(arg, "--at=")))
+			at = value;
+		else if ((value = match_option(arg, "--where=")))
+			where = value;
+		else if ((value = match_option(arg, "--zonemap=")))
+			zonemap = value;
+		else if (match_option(arg, "--replay"))
+			replaying = true;
+		else if ((value = match_option(arg, "--replay=")))
 		{
-			max_precision = atoi(argv[first_file_index] + 16);
-			first_file_index++;
+			replaying = true;
+			replay.speed = atof(value);
 		}
+		else if ((value = match_option(arg, "--replay_format=")))
+			replay_format = value;
+		else if ((value = match_option(arg, "--replay_to=")))
+			replay_to = value;
+		else if (match_option(arg, "--events"))
+			print_events = true;
+		else if ((value = match_option(arg, "--brake_threshold=")))
+			events.threshold[EVENT_BRAKING] = atof(value);
+		else if ((value = match_option(arg, "--accel_threshold=")))
+			events.threshold[EVENT_ACCELERATION] = atof(value);
+		else if ((value = match_option(arg, "--corner_threshold=")))
+			events.threshold[EVENT_CORNERING] = atof(value);
+		else if ((value = match_option(arg, "--speed_limit=")))
+			events.threshold[EVENT_SPEEDING] = atof(value);
+		else if ((value = match_option(arg, "--accl_threshold=")))
+			events.threshold[EVENT_HARSH_MOTION] = atof(value);
+		else if ((value = match_option(arg, "--event_context=")))
+			events.context = atof(value) > 0.0 ? atof(value) : 0.0;
+		else if (match_option(arg, "--stats"))
+			print_stats = true;
+		else if (match_option(arg, "--full_moov"))
+			opt.full_moov = true;
+		else if (match_option(arg, "--safe"))
+			opt.safe = true;
+		else if ((value = match_option(arg, "--max_alloc=")))
+			opt.max_alloc = parse_size(value);
+		else if ((value = match_option(arg, "--max_klv=")))
+			opt.max_klv = (uint32_t)strtoul(value, NULL, 10);
+		else if ((value = match_option(arg, "--cpu_limit=")))
+			opt.cpu_limit = atof(value);
+		else if ((value = match_option(arg, "--min_zoom=")))
+			min_zoom = atoi(value);
+		else if ((value = match_option(arg, "--max_zoom=")))
+			max_zoom = atoi(value);
+		else if ((value = match_option(arg, "--zoom=")))
+			zoom = atoi(value);
+		else if ((value = match_option(arg, "--signatures=")))
+			index_path = value;
+		else if ((value = match_option(arg, "--query=")))
+			query = value;
+		else if ((value = match_option(arg, "--similarity=")))
+			similarity = atof(value);
 		else
-		{
 			break; /* not a parameter, must be a filename */
+
+		first_file_index++;
+	}
+
+	if (jobs)
+	{
+		char *end;
+		long n = strtol(jobs, &end, 10);
+		if (end == jobs || *end || n < 0 || n > JOBS_MAX)
+		{
+			fprintf(stderr, "ERROR: --jobs must be a number of threads from 0 (the CPUs available) to %d\n", JOBS_MAX);
+			return -1;
 		}
+		threads = (uint32_t)n;
+	}
+	if (!threads) threads = available_cpus();
+
+	if (opt.safe)
+	{
+		if (!opt.max_alloc) opt.max_alloc = 64 * 1024 * 1024;
+		if (!opt.max_klv) opt.max_klv = 10000;
+		if (opt.cpu_limit <= 0.0) opt.cpu_limit = 30.0;
 	}
 
+	/* tiles, heatmap and zonemap write to a file named before the inputs, sidecar to a directory */
+	if ((MODE_TILES == mode || MODE_HEATMAP == mode || MODE_SIDECAR == mode || MODE_ZONEMAP == mode) && first_file_index < argc)
+		output_path = argv[first_file_index++];
+
 	if (first_file_index >= argc)
 	{
-		fprintf(stderr, "%s [options] <mp4file> [mp4file_2] ... [mp4file_n]\n", argv[0]);
+		print_usage(argv[0]);
 		return -1;
 	}
 
-	for (int argc_index = first_file_index; argc_index < argc; argc_index++)
+	if (min_zoom < 0 || max_zoom > TILE_MAX_ZOOM || min_zoom > max_zoom)
 	{
-		char *mp4filename = argv[argc_index];
-		/* extract just the filename from the path */
-		const char *display_name = strrchr(mp4filename, '/');
-		display_name = display_name ? display_name + 1 : mp4filename;
+		fprintf(stderr, "ERROR: zoom levels must satisfy 0 <= min_zoom <= max_zoom <= %d\n", TILE_MAX_ZOOM);
+		return -1;
+	}
+
+	if (out.segments + print_events + (refs_path != NULL) + (roads_path != NULL) + resampling + (at_utc != NULL) + (at != NULL) + (where != NULL) + replaying > 1)
+	{
+		fprintf(stderr, "ERROR: only one of --segments, --events, --segments_ref, --match, --every_distance, --at_utc, --at, --where and --replay may be used\n");
+		return -1;
+	}
+
+	if (at && argc - first_file_index != 1)
+	{
+		fprintf(stderr, "ERROR: --at looks up times in a single file (--at_utc works across chapters)\n");
+		return -1;
+	}
+
+	if (where && !where_parse(where, &filter))
+	{
+		fprintf(stderr, "ERROR: --where must be terms like speed2d>35,fix>=3 over lat, lon, alt, speed2d, speed3d, fix and precision\n");
+		return -1;
+	}
+	if (zonemap && !where)
+	{
+		fprintf(stderr, "ERROR: --zonemap is only used with --where\n");
+		return -1;
+	}
+	if (where) out.where = &filter;
 
-		/* search for GPMF Track */
-		size_t mp4handle = OpenMP4Source(mp4filename, MOV_GPMF_TRAK_TYPE, MOV_GPMF_TRAK_SUBTYPE, 0);
+	if (resampling && !(out.every_distance > 0.0))
+	{
+		fprintf(stderr, "ERROR: --every_distance must be above 0\n");
+		return -1;
+	}
 
-		if (mp4handle == 0)
+	if (replaying)
+	{
+		if (!(replay.speed > 0.0))
 		{
-			fprintf(stderr, "ERROR: %s is an invalid MP4/MOV or it has no GPMF data\n\n", mp4filename);
+			fprintf(stderr, "ERROR: --replay speed must be above 0\n");
 			return -1;
 		}
-
-		double metadataduration = GetDuration(mp4handle);
-		if (metadataduration <= 0.0) return -1;
-
-		if (first_file_index == argc_index)
+		if (strcmp(replay_format, "nmea") && strcmp(replay_format, "binary"))
 		{
-			/* print column names on the first row */
-			int col = 0;
-			if (print_filename || print_filepath)
-				printf("\"%s\"", column_names[0]); /* "file" */
-			for (int i = 1; i < (sizeof(column_names) / sizeof(*column_names)); i++)
-				printf("%s\"%s\"", (col++ || print_filename || print_filepath) ? "," : "", column_names[i]);
-			printf("\n");
+			fprintf(stderr, "ERROR: --replay_format must be nmea or binary\n");
+			return -1;
 		}
+		replay.binary = !strcmp(replay_format, "binary");
+		if (!replay_open(&replay, replay_to)) return -1;
+		out.replay = &replay;
+		out.header_printed = true; /* no CSV */
+		if (!pipeline.mem_limit) pipeline.mem_limit = REPLAY_MEM_LIMIT;
+	}
 
-		size_t payloadres = 0;
-		double file_finish = 0.0;
+	if (at_utc && !parse_utc(at_utc, &target_utc))
+	{
+		fprintf(stderr, "ERROR: --at_utc must be YYYY-MM-DDTHH:MM:SS[.fff]Z\n");
+		return -1;
+	}
 
-		/* each MP4 has a given number of payloads, and we must iterate through all of them */
-		uint32_t payloads = GetNumberPayloads(mp4handle);
+	if (print_events)
+	{
+		out.ev = &events;
+		/* harsh motion comes from the accelerometer, which is otherwise skipped */
+		opt.accl = events.threshold[EVENT_HARSH_MOTION] > 0.0;
+	}
 
-		for (uint32_t index = 0; index < payloads; index++)
-		{
-			double start = 0.0, finish = 0.0;
-			uint32_t payloadsize = GetPayloadSize(mp4handle, index);
-			payloadres = GetPayloadResource(mp4handle, payloadres, payloadsize);
+	/* samples the filters reject still mark outages */
+	opt.keep_filtered = out.segments;
 
-			uint32_t *payload = GetPayload(mp4handle, payloadres, index);
-			if (payload == NULL) break;
+	if (refs_path && !(out.refs = reference_load(refs_path))) return -1;
+	if (roads_path && !(out.matcher = match_load(roads_path))) return -1;
 
-			ret = GetPayloadTime(mp4handle, index, &start, &finish);
-			if (ret != GPMF_OK) break;
+	if (zoom < 0 || zoom > HEAT_MAX_ZOOM)
+	{
+		fprintf(stderr, "ERROR: --zoom must be between 0 and %d\n", HEAT_MAX_ZOOM);
+		return -1;
+	}
 
-			ret = GPMF_Init(ms, payload, payloadsize);
-			if (ret != GPMF_OK) break;
+	pipeline.job_count = argc - first_file_index;
+	pipeline.jobs = calloc(pipeline.job_count, sizeof(file_job));
+	if (!pipeline.jobs) return -1;
 
-			uint32_t fix;       /* data from "GPSF" */
-			uint16_t precision; /* data from "GPSP" */
-			struct              /* data from "GPSU" */
-			{
-				time_t time; /* second-accurate standard format compatible with time.h routines */
-				double milliseconds; /* sub-second quantity to add to the above time_t data */
-			} gpsu;
+	for (uint32_t index = 0; index < pipeline.job_count; index++)
+	{
+		file_job *job = &pipeline.jobs[index];
+		job->path = argv[first_file_index + index];
+		/* extract just the filename from the path */
+		job->display_name = strrchr(job->path, '/');
+		job->display_name = job->display_name ? job->display_name + 1 : job->path;
+	}
 
-			/* iterate through all GPMF data in this particular payload */
-			do
-			{
-				uint32_t key = GPMF_Key(ms);
-				uint32_t samples = GPMF_Repeat(ms);
-				uint32_t elements = GPMF_ElementsInStruct(ms);
+	struct timespec began;
+	clock_gettime(CLOCK_MONOTONIC, &began);
+
+	/* tile encoding is parallel across tiles, so may use more threads than there are files */
+	uint32_t tile_threads = threads;
 
-				if (!samples) continue;
+	/* a --where query decodes only what the zone maps can't rule out, which may be nothing */
+	if (MODE_CSV == mode && zonemap)
+	{
+		if (!zone_prune(&filter, zonemap, &opt, threads, &result)) return -1;
+		if (!pipeline.job_count) print_header(&out);
+	}
 
-				uint32_t structsize = GPMF_StructSize(ms);
+	/* the ordered writer and verify take big files in parts */
+	if (((MODE_CSV == mode && !at_utc && !at) || MODE_VERIFY == mode) && threads > 1 && !split_jobs(&opt, threads))
+	{
+		fprintf(stderr, "ERROR: unable to allocate decoder jobs\n");
+		return -1;
+	}
+	if (threads > pipeline.job_count) threads = pipeline.job_count;
 
-				if (!structsize) continue;
+	if (MODE_TILES == mode)
+	{
+		result = make_tiles(output_path, &opt, tile_threads, (uint8_t)min_zoom, (uint8_t)max_zoom);
+	}
+	else if (MODE_HEATMAP == mode)
+	{
+		result = make_heatmap(output_path, &opt, threads, (uint8_t)zoom);
+	}
+	else if (MODE_SIMILAR == mode)
+	{
+		result = make_similar(&out, &opt, threads, index_path, query, similarity);
+	}
+	else if (MODE_SIDECAR == mode)
+	{
+		result = make_sidecars(output_path, &opt, threads);
+	}
+	else if (MODE_VERIFY == mode)
+	{
+		result = verify_files(&out, &opt, threads);
+	}
+	else if (MODE_ZONEMAP == mode)
+	{
+		result = make_zonemap(output_path, &opt, threads);
+	}
+	else if (MODE_CATALOGUE == mode)
+	{
+		result = make_catalogue(&out, &opt, threads);
+	}
+	else if (at_utc)
+	{
+		result = find_utc(&out, &opt, threads, target_utc, utc_index);
+	}
+	else if (at)
+	{
+		result = find_at(&out, &opt, at);
+	}
+	else if (threads <= 1)
+	{
+		decode_state state;
+		memset(&state, 0, sizeof(state));
 
-				uint32_t buffersize = samples * elements * structsize;
-				void *tmpbuffer = malloc(buffersize);
+		for (uint32_t index = 0; index < pipeline.job_count; index++)
+		{
+			file_job *job = &pipeline.jobs[index];
+			pipeline.head = index;
+			if (job->placed) out.file_start = job->placed_at;
+			decode_file(job, &state, &opt, &direct_sink, &out);
+			if (finish_job(&out, job, &result)) break;
+		}
 
-				if (!tmpbuffer) continue;
+		decode_state_free(&state);
+	}
+	else
+	{
+		decode_worker *workers = calloc(threads, sizeof(decode_worker));
+		uint32_t started = 0;
 
-				int res = GPMF_ERROR_UNKNOWN_TYPE;
-				if ( (STR2FOURCC("GPSU") == key) || (STR2FOURCC("GPSF") == key) | (STR2FOURCC("GPSP") == key) )
-					res = GPMF_FormattedData(ms, tmpbuffer, buffersize, 0, samples);
-				else if (STR2FOURCC("GPS5") == key)
-					res = GPMF_ScaledData(ms, tmpbuffer, buffersize, 0, samples, GPMF_TYPE_DOUBLE);
-				else if (STR2FOURCC("GPS9") == key)
-					res = GPMF_ScaledData(ms, tmpbuffer, buffersize, 0, samples, GPMF_TYPE_DOUBLE);
+		if (!workers) return -1;
 
-				if (GPMF_OK == res)
-				{
-					double *ptr = tmpbuffer;
-					double step = (finish - start) / (double)samples;;
-					double now = start;
+		for (; started < threads; started++)
+		{
+			workers[started].opt = &opt;
+			if (pthread_create(&workers[started].thread, NULL, decode_thread, &workers[started]) != 0) break;
+		}
 
-					file_finish = finish;
+		if (started)
+		{
+			int written = write_jobs(&out);
+			if (written) result = written;
+		}
+		else
+		{
+			fprintf(stderr, "ERROR: unable to start decoder threads\n");
+			result = -1;
+		}
 
-					for (uint32_t i = 0; i < samples; i++)
-					{
-						if (STR2FOURCC("GPSU") == key)
-						{
-							char *gpsu_string = tmpbuffer;
-							struct tm tm;
-							memset(&tm, 0, sizeof(tm));
-
-							/* GoPro provides the time as a fixed-size ASCII string, which we must convert to something useable */
-							tm.tm_year  = 10 * (gpsu_string[0]  - '0') + (gpsu_string[1]  - '0');
-							tm.tm_year += 100;
-							tm.tm_mon   = 10 * (gpsu_string[2]  - '0') + (gpsu_string[3]  - '0');
-							tm.tm_mon--; /* struct tm uses an ordinal month */
-							tm.tm_mday  = 10 * (gpsu_string[4]  - '0') + (gpsu_string[5]  - '0');
-							tm.tm_hour  = 10 * (gpsu_string[6]  - '0') + (gpsu_string[7]  - '0');
-							tm.tm_min   = 10 * (gpsu_string[8]  - '0') + (gpsu_string[9]  - '0');
-							tm.tm_sec   = 10 * (gpsu_string[10] - '0') + (gpsu_string[11] - '0');
-							gpsu.time         = timegm(&tm);
-							gpsu.milliseconds = 100.0 * (gpsu_string[13] - '0') + 10.0 * (gpsu_string[14] - '0') + (gpsu_string[15] - '0');
-						}
-						else if ( (STR2FOURCC("GPS5") == key) && !use_gps9 )
-						{
-							/* at this point, we should have all the data (with "GPS5" being at the highest sample rate) */
-
-							/* apply filters if specified */
-							if ((min_fix < 0 || (int)fix >= min_fix) &&
-							    (max_precision < 0 || (int)precision <= max_precision))
-							{
-								/* we print the filename (if requested) and time... */
-								if (print_filepath)
-									printf("\"%s\", ", mp4filename);
-								else if (print_filename)
-									printf("\"%s\", ", display_name);
-								printf("%f, ", (file_start + now) * 1000.0);
-								char ftimestr[64];
-								strftime(ftimestr, sizeof(ftimestr), "%Y-%m-%dT%H:%M:%S", gmtime(&gpsu.time));
-								printf("%s.%03dZ, ", ftimestr, (int)gpsu.milliseconds);
-
-								/* ... and print out all the data */
-								for (uint32_t j = 0; j < elements; j++)
-									printf("%.6f, ", *ptr++);
-								printf("%d, %d\n", fix, precision);
-							}
-							else
-							{
-								ptr += elements; /* skip this sample's data */
-							}
-
-							/*
-							the time increment potentially rolls over into the next minute, hour, or even day
-							storing the second data in time_t makes our job much easier as strftime() above handles this
-							*/
-							now += step; gpsu.milliseconds += step * 1000.0;
-							if (gpsu.milliseconds >= 1000.0)
-							{
-								gpsu.milliseconds -= 1000.0;
-								gpsu.time++;
-							}
-						}
-						else if (STR2FOURCC("GPS9") == key)
-						{
-							use_gps9 = true;
-							int gps9_fix = (int)ptr[8]; /* fix is at index 8 in GPS9 */
-							int gps9_precision = (int)ptr[7]; /* precision is at index 7 in GPS9 */
-
-							/* apply filters if specified */
-							if ((min_fix < 0 || gps9_fix >= min_fix) &&
-							    (max_precision < 0 || gps9_precision <= max_precision))
-							{
-								/* we print the filename (if requested) and time... */
-								if (print_filepath)
-									printf("\"%s\", ", mp4filename);
-								else if (print_filename)
-									printf("\"%s\", ", display_name);
-								printf("%f, ", (file_start + now) * 1000.0);
-								char ftimestr[64];
-								if (0.0 == now)
-								{
-									gpsu.time = gps9_epoch + /* days since 2000 */ ((time_t)ptr[5] + 1) * /* secs per day */ 86400;
-									double sub_secs = fmod(ptr[6], 1.0);
-									gpsu.milliseconds = (int)(1000.0 * sub_secs);
-									gpsu.time += (time_t)(ptr[6] - sub_secs);
-								}
-								strftime(ftimestr, sizeof(ftimestr), "%Y-%m-%dT%H:%M:%S", gmtime(&gpsu.time));
-								printf("%s.%03dZ", ftimestr, (int)gpsu.milliseconds);
-								for (uint32_t j = 0; j < (sizeof(gps9_indexes) / sizeof(*gps9_indexes)); j++)
-									printf(", %.6f", ptr[gps9_indexes[j]]);
-								printf("\n");
-							}
-
-							ptr += elements; /* advance to next sample */
-							now += step; gpsu.milliseconds += step * 1000.0;
-							if (gpsu.milliseconds >= 1000.0)
-							{
-								gpsu.milliseconds -= 1000.0;
-								gpsu.time++;
-							}
-						}
-						else if (STR2FOURCC("GPSF") == key)
-						{
-							fix = *(uint32_t *)tmpbuffer;
-						}
-						else if (STR2FOURCC("GPSP") == key)
-						{
-							precision = *(uint16_t *)tmpbuffer;
-						}
-					}
-				}
+		/* stop any decoders still busy with files we no longer need */
+		pthread_mutex_lock(&pipeline.lock);
+		pipeline.abort = true;
+		pthread_cond_broadcast(&pipeline.cond);
+		pthread_mutex_unlock(&pipeline.lock);
 
-				free(tmpbuffer);
+		for (uint32_t t = 0; t < started; t++)
+			pthread_join(workers[t].thread, NULL);
+		free(workers);
 
-			} while (GPMF_OK == GPMF_Next(ms, GPMF_RECURSE_LEVELS));
+		for (uint32_t index = 0; index < pipeline.job_count; index++)
+		{
+			while (pipeline.jobs[index].first)
+			{
+				sample_batch *batch = pipeline.jobs[index].first;
+				pipeline.jobs[index].first = batch->next;
+				free(batch);
+			}
+		}
+	}
 
-			GPMF_ResetState(ms);
+	/* the last segment or events are still open */
+	if (out.segments) segment_finish(&out);
+	if (out.ev)
+	{
+		events_finish(&out);
+		if (events.failed)
+		{
+			fprintf(stderr, "ERROR: out of memory, some events were not reported\n");
+			result = -1;
 		}
+		free(events.history);
+		free(events.pending);
+	}
+	reference_free(out.refs);
+	if (out.matcher) match_flush(&out);
+	match_free(out.matcher);
+	replay_close(&replay);
+
+	double seconds = seconds_since(CLOCK_MONOTONIC, &began);
 
-		if (payloadres) FreePayloadResource(mp4handle, payloadres);
-		if (ms) GPMF_Free(ms);
-		CloseSource(mp4handle);
+	if (print_stats)
+	{
+		uint32_t files = 0, payloads = 0;
+		uint64_t payload_bytes = 0, samples = 0;
 
-		if (ret != GPMF_OK)
+		for (uint32_t index = 0; index < pipeline.job_count; index++)
 		{
-			if (GPMF_ERROR_UNKNOWN_TYPE == ret)
-				fprintf(stderr, "ERROR: Unknown GPMF Type within\n");
-			else
-				fprintf(stderr, "ERROR: GPMF data has corruption\n");
-			break;
+			file_job *job = &pipeline.jobs[index];
+			if (JOB_FINISHED != job->state) continue;
+			files += !job->continues;
+			payloads += job->payloads;
+			payload_bytes += job->payload_bytes;
+			samples += job->samples;
 		}
 
-		file_start += file_finish;
+		fprintf(stderr, "files: %u, payloads: %u, payload bytes: %llu, samples: %llu, %.3f s\n",
+			files, payloads, (unsigned long long)payload_bytes, (unsigned long long)samples, seconds);
+		fprintf(stderr, "peak memory: %zu bytes", pipeline.mem_peak);
+		if (pipeline.mem_limit) fprintf(stderr, " (limit %zu)", pipeline.mem_limit);
+		fprintf(stderr, "\n");
 	}
 
-	return (int)ret;
+	free(pipeline.jobs);
+
+	return result;
 }